@@ -9,17 +9,29 @@
 #define THERMISTOR_SERIES   10000.0
 #define B_COEFF             3350.0
 
+// The conversion in Q16.16, T = T0 / (1 + ln(R/R0) * T0/B)
+#define THERMISTOR_FULL_SCALE FIX_CONST(LSBS_PER_VOLT * THERMISTOR_SUPPLY) // Code at the supply voltage
+#define THERMISTOR_LN_SERIES  FIX_CONST(1.3862943611198906)                 // ln(THERMISTOR_SERIES / THERMISTOR_NOMINAL)
+#define THERMISTOR_T0         FIX_CONST(TEMPERATURE_NOMINAL + 273.15)
+#define THERMISTOR_T0_OVER_B  FIX_CONST((TEMPERATURE_NOMINAL + 273.15) / B_COEFF)
+#define THERMISTOR_KELVIN_X10 FIX_CONST(2731.5)
+
 #define N_TEMPERATURE_SAMPLES 10
 
+// State of all thermistors as parallel arrays, each channel keeps its sample
+// history as a ring as in cells_t
 typedef struct
 {
-    unsigned int16 raw;
-    unsigned int16 samples[N_TEMPERATURE_SAMPLES];
-    unsigned int16 average;
-    float          converted;
-    unsigned int8  ot_count; // Critical temperature error counter
-    unsigned int8  wt_count; // Temperature warning counter
-} temperature_t;
+    unsigned int16 raw[N_ADC_CHANNELS];
+    unsigned int16 average[N_ADC_CHANNELS];
+    signed int16   converted[N_ADC_CHANNELS]; // 0.1 C
+    unsigned int8  ot_count[N_ADC_CHANNELS];  // Critical temperature error counter, saturating
+    unsigned int8  wt_count[N_ADC_CHANNELS];  // Temperature warning counter, saturating
+    unsigned int32 ot_faults;                 // Bit per channel at N_BAD_SAMPLES
+    unsigned int32 wt_faults;
+    unsigned int16 samples[N_ADC_CHANNELS][N_TEMPERATURE_SAMPLES];
+    unsigned int8  head;
+} temperatures_t;
 
 // ADC channels on PCB are not mapped in order
 // These two arrays are lookup tables to correctly map the channels
@@ -69,9 +81,8 @@ void ads7952_init(void)
     output_high(ADC2_SEL);
 }
 
-// Reads all the channel voltages
-// Expects an array of size 12 as an input
-void ads7952_read_all_channels(temperature_t * adc)
+// Reads all the channel voltages into an array of N_ADC_CHANNELS raw readings
+void ads7952_read_all_channels(unsigned int16 * raw)
 {
     int i;
     int ch;
@@ -96,7 +107,7 @@ void ads7952_read_all_channels(temperature_t * adc)
         output_high(ADC1_SEL);
         
         ch = msb >> 4;
-        adc[g_channel_map1[ch]].raw = ((0x0F & msb) << 8 ) | lsb;
+        raw[g_channel_map1[ch]] = ((0x0F & msb) << 8 ) | lsb;
     }
     
     for (i = 12 ; i < 24 ; i ++)
@@ -117,24 +128,27 @@ void ads7952_read_all_channels(temperature_t * adc)
         output_high(ADC2_SEL);
         
         ch = (msb >> 4);
-        adc[g_channel_map2[ch]].raw = ((0x0F & msb) << 8 ) | lsb;
+        raw[g_channel_map2[ch]] = ((0x0F & msb) << 8 ) | lsb;
     }
 }
 
-float thermistor_convert_data(unsigned int16 raw)
+// Returns the temperature of a thermistor reading in 0.1 C
+signed int16 thermistor_convert_data(unsigned int16 raw)
 {
-    float resistance;
-    float temperature;
+    fix_t ln_ratio;
+    fix_t kelvin;
+    
+    // A reading of 0 would be a short, keep the log finite
+    if (raw == 0)
+    {
+        raw = 1;
+    }
     
-    resistance = THERMISTOR_SERIES * (float)(raw) / (LSBS_PER_VOLT * THERMISTOR_SUPPLY - (float)(raw));
-    temperature = resistance / THERMISTOR_NOMINAL;
-    temperature = log(temperature);
-    temperature /= B_COEFF;
-    temperature += 1.0 / (TEMPERATURE_NOMINAL + 273.15);
-    temperature = 1.0 / temperature;
-    temperature -= 273.15;
+    // R / R0 = (SERIES / R0) * raw / (full scale - raw)
+    ln_ratio = fix_ln(fix_from_int(raw)) - fix_ln(THERMISTOR_FULL_SCALE - fix_from_int(raw)) + THERMISTOR_LN_SERIES;
+    kelvin = fix_div(THERMISTOR_T0, FIX_ONE + fix_mul(ln_ratio, THERMISTOR_T0_OVER_B));
     
-    return temperature;
+    return (signed int16) fix_round(fix_mul(kelvin, fix_from_int(10)) - THERMISTOR_KELVIN_X10);
 }
 
 #endif
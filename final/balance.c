@@ -0,0 +1,295 @@
+#ifndef BALANCE_C
+#define BALANCE_C
+
+// Balancing sessions
+// COMMAND_ENABLE_BALANCING starts a session that runs over as many cycles as
+// it needs. A cycle bleeds the cells more than the target above the lowest
+// for BALANCE_PERIOD_MS, then rests with the bleeders off for
+// N_VOLTAGE_SAMPLES safety checks so the averages hold no reading taken
+// before the bleed. No cycle starts while a check is counting bad samples,
+// so a fault is confirmed as fast as without a session. The session ends when
+// the spread of the averages is within the target, when its time is up, on a
+// stop command or on a trip.
+//
+// Command (COMMAND_ENABLE_BALANCING_ID):
+//   bytes 0-1: target spread, 0.1 mV, MSB first
+//   bytes 2-3: longest time to run, s, 0 stops a running session
+//   byte 4   : most cells bled at once, the highest first, 0 for no limit
+// A command without a payload runs the one cycle at BALANCE_THRESHOLD the
+// command always did, unless a session is already running, and ends as
+// BALANCE_CYCLE_DONE once that cycle's rest is over. A command with a
+// payload replaces a running session unless it repeats its parameters; the
+// replacement starts its first cycle once the current rest is over.
+//
+// Frame (BALANCE_PROGRESS_ID), sent after every cycle and when a session ends:
+//   byte 0   : status (balance_status_t)
+//   byte 1   : cells bled in the last cycle
+//   bytes 2-3: spread of the averages, 0.1 mV, MSB first
+//   bytes 4-5: estimated time left, s, from the rate the spread has fallen
+//              at so far, 0xFFFF if it has not fallen
+//   bytes 6-7: time since the session started, s
+
+#define BALANCE_PERIOD_MS  2000 // Bleeding time of one cycle
+#define BALANCE_THRESHOLD   500 // Target of a command without payload (BALANCE_THRESHOLD / 10) mV
+#define BALANCE_COMMAND_LEN   5
+#define BALANCE_UNKNOWN  0xFFFF
+
+typedef enum
+{
+    BALANCE_IDLE = 0,    // No session since start up
+    BALANCE_RUNNING = 1,
+    BALANCE_DONE = 2,    // Spread within the target
+    BALANCE_TIMEOUT = 3, // Time up before the target was reached
+    BALANCE_STOPPED = 4, // Stop command
+    BALANCE_TRIPPED = 5, // A safety check failed
+    BALANCE_CYCLE_DONE = 6, // The cycle of a command without payload ran
+} balance_status_t;
+
+typedef struct
+{
+    unsigned int8  status;       // balance_status_t
+    unsigned int16 target;       // Spread to reach, 0.1 mV
+    int8           max_bleeders;
+    unsigned int16 duration_s;   // As commanded, 0 for a command without payload
+    int8           bleeders;     // Cells bled in the last cycle
+    unsigned int32 start_ms;
+    unsigned int32 end_ms;
+    unsigned int16 start_spread; // Spread before the first cycle
+    unsigned int16 spread;       // Spread after the last cycle
+    unsigned int16 eta_s;
+    unsigned int16 cycles;
+    int8           rest;         // Safety checks left before the next cycle
+} balance_session_t;
+
+static balance_session_t g_balance;
+
+void balance_init(void)
+{
+    g_balance.status = BALANCE_IDLE;
+    g_balance.target = BALANCE_THRESHOLD;
+    g_balance.max_bleeders = N_CELLS;
+    g_balance.bleeders = 0;
+}
+
+// Sends the progress frame, returns false if no transmit buffer was free
+int1 balance_send(void)
+{
+    int8 data[8];
+    unsigned int32 elapsed_s = (g_balance.status == BALANCE_IDLE) ? 0 : (timebase_ms() - g_balance.start_ms) / 1000;
+    
+    if (elapsed_s > 0xFFFF)
+    {
+        elapsed_s = 0xFFFF;
+    }
+    data[0] = g_balance.status;
+    data[1] = g_balance.bleeders;
+    data[2] = (int8) (g_balance.spread >> 8);
+    data[3] = (int8) (g_balance.spread);
+    data[4] = (int8) (g_balance.eta_s >> 8);
+    data[5] = (int8) (g_balance.eta_s);
+    data[6] = (int8) (elapsed_s >> 8);
+    data[7] = (int8) (elapsed_s);
+    return can_bus_putd(BALANCE_PROGRESS_BUS, BALANCE_PROGRESS_ID, data, 8);
+}
+
+// Ends a running session and reports why
+void balance_stop(balance_status_t status)
+{
+    if (g_balance.status == BALANCE_RUNNING)
+    {
+        g_balance.status = status;
+        g_balance.bleeders = 0;
+        balance_send();
+    }
+}
+
+// Starts, replaces or stops a session from a command payload. Returns false
+// if the command changed nothing.
+int1 balance_command(unsigned int8 * data, int8 len, unsigned int32 now_ms)
+{
+    unsigned int16 target;
+    unsigned int16 duration_s;
+    int8 max_bleeders;
+    
+    if (len < BALANCE_COMMAND_LEN)
+    {
+        // The single cycle of a command without payload
+        if (g_balance.status == BALANCE_RUNNING)
+        {
+            return 0;
+        }
+        g_balance.target = BALANCE_THRESHOLD;
+        g_balance.max_bleeders = N_CELLS;
+        g_balance.duration_s = 0;
+        g_balance.rest = 0;
+    }
+    else
+    {
+        target = ((unsigned int16)data[0] << 8) | data[1];
+        duration_s = ((unsigned int16)data[2] << 8) | data[3];
+        max_bleeders = ((data[4] == 0) || (data[4] > N_CELLS)) ? N_CELLS : data[4];
+        if (duration_s == 0)
+        {
+            if (g_balance.status != BALANCE_RUNNING)
+            {
+                return 0;
+            }
+            balance_stop(BALANCE_STOPPED);
+            return 1;
+        }
+        if (g_balance.status == BALANCE_RUNNING)
+        {
+            if ((target == g_balance.target) && (duration_s == g_balance.duration_s)
+                && (max_bleeders == g_balance.max_bleeders))
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            g_balance.rest = 0;
+        }
+        g_balance.target = target;
+        g_balance.max_bleeders = max_bleeders;
+        g_balance.duration_s = duration_s;
+        g_balance.end_ms = now_ms + (unsigned int32)duration_s * 1000;
+    }
+    
+    g_balance.status = BALANCE_RUNNING;
+    g_balance.start_ms = now_ms;
+    g_balance.eta_s = BALANCE_UNKNOWN;
+    g_balance.cycles = 0;
+    return 1;
+}
+
+// Called after every passing safety check, returns true if a cycle is due.
+// Works out the spread once the rest after a cycle is over, reports it and
+// ends the session if it is within the target or the time is up, or after
+// its one cycle for a command without payload.
+int1 balance_due(unsigned int16 * average, unsigned int32 now_ms)
+{
+    unsigned int16 lowest = 0xFFFF;
+    unsigned int16 highest = 0;
+    unsigned int64 eta_s;
+    unsigned int64 den;
+    int8 i;
+    
+    if (g_balance.status != BALANCE_RUNNING)
+    {
+        return 0;
+    }
+    if (g_balance.rest > 0)
+    {
+        g_balance.rest--;
+        return 0;
+    }
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        lowest = (average[i] < lowest) ? average[i] : lowest;
+        highest = (average[i] > highest) ? average[i] : highest;
+    }
+    g_balance.spread = highest - lowest;
+    
+    // Extrapolate the fall of the spread so far to the target
+    if (g_balance.cycles == 0)
+    {
+        g_balance.start_spread = g_balance.spread;
+    }
+    else if ((g_balance.spread < g_balance.start_spread) && (g_balance.spread > g_balance.target))
+    {
+        // Rounded up so the estimate is 0 only once the target is reached
+        den = (unsigned int64)(g_balance.start_spread - g_balance.spread) * 1000;
+        eta_s = ((unsigned int64)(g_balance.spread - g_balance.target) * (now_ms - g_balance.start_ms) + den - 1) / den;
+        g_balance.eta_s = (eta_s >= BALANCE_UNKNOWN) ? BALANCE_UNKNOWN - 1 : (unsigned int16)eta_s;
+    }
+    
+    if (g_balance.spread <= g_balance.target)
+    {
+        g_balance.eta_s = 0;
+        balance_stop(BALANCE_DONE);
+        return 0;
+    }
+    if (g_balance.duration_s == 0)
+    {
+        if (g_balance.cycles > 0)
+        {
+            balance_stop(BALANCE_CYCLE_DONE);
+            return 0;
+        }
+    }
+    else if ((signed int32)(now_ms - g_balance.end_ms) >= 0)
+    {
+        balance_stop(BALANCE_TIMEOUT);
+        return 0;
+    }
+    if (g_balance.cycles > 0)
+    {
+        balance_send();
+    }
+    return 1;
+}
+
+// Returns the cells to bleed in the next cycle, bit n for cell n: those more
+// than the target above the lowest average, at most max_bleeders of them and
+// the highest first
+unsigned int32 balance_select(unsigned int16 * average)
+{
+    unsigned int32 mask = 0;
+    unsigned int16 lowest = 0xFFFF;
+    unsigned int16 level;
+    int8 n = 0;
+    int8 drop;
+    int8 i;
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        lowest = (average[i] < lowest) ? average[i] : lowest;
+    }
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        if (average[i] - lowest > g_balance.target)
+        {
+            mask |= (unsigned int32)1 << i;
+            n++;
+        }
+    }
+    
+    // Too many, leave out the lowest of them until few enough are left
+    while (n > g_balance.max_bleeders)
+    {
+        level = 0xFFFF;
+        drop = 0;
+        for (i = 0 ; i < N_CELLS ; i++)
+        {
+            if ((mask & ((unsigned int32)1 << i)) && (average[i] < level))
+            {
+                level = average[i];
+                drop = i;
+            }
+        }
+        mask &= ~((unsigned int32)1 << drop);
+        n--;
+    }
+    
+    g_balance.bleeders = n;
+    return mask;
+}
+
+// Holds off the next cycle for at least one more safety check
+void balance_hold(void)
+{
+    if (g_balance.rest < 1)
+    {
+        g_balance.rest = 1;
+    }
+}
+
+// Starts the rest after a cycle
+void balance_cycle_done(void)
+{
+    g_balance.rest = N_VOLTAGE_SAMPLES;
+    g_balance.cycles++;
+}
+
+#endif
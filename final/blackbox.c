@@ -0,0 +1,192 @@
+#ifndef BLACKBOX_C
+#define BLACKBOX_C
+
+// Black box recorder
+// Keeps a RAM ring with a compact summary of every safety check cycle and the
+// full cell vector every BLACKBOX_CELL_DIVIDER cycles. The ring freezes on the
+// first trip and is dumped over CAN once the contactor is open, a few frames
+// per pass of the disconnect state so the trip keeps being signalled.
+//
+// Dump frame (BLACKBOX_DUMP_ID): byte 0 = record index, byte 1 = part
+//   part 0     : min cell V, max cell V, current (16 bit each, MSB first)
+//   part 1     : max temperature, min cell index, max cell index, flags,
+//                sweep time (ms since reset, low 16 bits, MSB first)
+//   part 2-11  : cells 3*(part-2) to 3*(part-2)+2 (16 bit each, MSB first),
+//                only sent for records with index % BLACKBOX_CELL_DIVIDER == 0
+
+#define N_BLACKBOX_RECORDS     256 // Must stay 256, the head index wraps as an int8
+#define BLACKBOX_CELL_DIVIDER   16 // A cell vector is kept every 16 records
+#define N_BLACKBOX_CELL_RECORDS (N_BLACKBOX_RECORDS/BLACKBOX_CELL_DIVIDER)
+#define BLACKBOX_SUMMARY_PARTS   2
+#define BLACKBOX_CELL_PARTS     (N_CELLS/3)
+
+typedef struct
+{
+    unsigned int16 min_voltage;
+    unsigned int16 max_voltage;
+    unsigned int16 current;
+    signed int8    max_temperature;
+    unsigned int8  min_cell;
+    unsigned int8  max_cell;
+    unsigned int8  flags; // Bit 7: pack connected
+    unsigned int16 ms;    // Sweep time, ms since reset
+} blackbox_summary_t;
+
+static blackbox_summary_t g_blackbox_summary[N_BLACKBOX_RECORDS];
+static unsigned int16     g_blackbox_cells[N_BLACKBOX_CELL_RECORDS][N_CELLS];
+static unsigned int8      g_blackbox_head = 0;        // Next record to write
+static unsigned int16     g_blackbox_count = 0;       // Records held in the ring
+static int1               gb_blackbox_frozen = false;
+static unsigned int16     g_blackbox_dump_record = 0; // Records dumped so far
+static unsigned int8      g_blackbox_dump_part = 0;   // Next part of that record
+
+// Adds a summary of the current cycle to the ring, ignored once frozen
+void blackbox_record(unsigned int16 * voltage, signed int16 * temperature, current_t * current, int1 b_connected, unsigned int16 ms)
+{
+    blackbox_summary_t * s;
+    signed int8 t;
+    int i;
+    
+    if (gb_blackbox_frozen)
+    {
+        return;
+    }
+    
+    s = &g_blackbox_summary[g_blackbox_head];
+    s->min_cell = 0;
+    s->max_cell = 0;
+    for (i = 1 ; i < N_CELLS ; i++)
+    {
+        if (voltage[i] < voltage[s->min_cell])
+        {
+            s->min_cell = i;
+        }
+        if (voltage[i] > voltage[s->max_cell])
+        {
+            s->max_cell = i;
+        }
+    }
+    s->min_voltage = voltage[s->min_cell];
+    s->max_voltage = voltage[s->max_cell];
+    s->current = current->raw;
+    
+    s->max_temperature = -128;
+    for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+    {
+        t = (signed int8) (temperature[i] / 10);
+        if (t > s->max_temperature)
+        {
+            s->max_temperature = t;
+        }
+    }
+    
+    s->flags = (int8)b_connected << 7;
+    s->ms = ms;
+    
+    // Keep the full cell vector at a reduced rate
+    if ((g_blackbox_head % BLACKBOX_CELL_DIVIDER) == 0)
+    {
+        for (i = 0 ; i < N_CELLS ; i++)
+        {
+            g_blackbox_cells[g_blackbox_head / BLACKBOX_CELL_DIVIDER][i] = voltage[i];
+        }
+    }
+    
+    g_blackbox_head++;
+    if (g_blackbox_count < N_BLACKBOX_RECORDS)
+    {
+        g_blackbox_count++;
+    }
+}
+
+// Stops recording, the ring keeps the lead-up to the first trip
+void blackbox_freeze(void)
+{
+    gb_blackbox_frozen = true;
+}
+
+// Writes one part of a record into a payload, returns the number of bytes
+int8 blackbox_fill(unsigned int8 * payload, unsigned int8 record, int8 part)
+{
+    blackbox_summary_t * s = &g_blackbox_summary[record];
+    unsigned int16 * cells;
+    int i;
+    
+    if (part == 0)
+    {
+        payload[0] = (unsigned int8) (s->min_voltage >> 8);
+        payload[1] = (unsigned int8) (s->min_voltage);
+        payload[2] = (unsigned int8) (s->max_voltage >> 8);
+        payload[3] = (unsigned int8) (s->max_voltage);
+        payload[4] = (unsigned int8) (s->current >> 8);
+        payload[5] = (unsigned int8) (s->current);
+        return 6;
+    }
+    else if (part == 1)
+    {
+        payload[0] = s->max_temperature;
+        payload[1] = s->min_cell;
+        payload[2] = s->max_cell;
+        payload[3] = s->flags;
+        payload[4] = (unsigned int8) (s->ms >> 8);
+        payload[5] = (unsigned int8) (s->ms);
+        return 6;
+    }
+    else
+    {
+        cells = &g_blackbox_cells[record / BLACKBOX_CELL_DIVIDER][(part - BLACKBOX_SUMMARY_PARTS) * 3];
+        for (i = 0 ; i < 3 ; i++)
+        {
+            payload[2*i]   = (unsigned int8) (cells[i] >> 8);
+            payload[2*i+1] = (unsigned int8) (cells[i]);
+        }
+        return 6;
+    }
+}
+
+// Sends the frozen ring oldest record first, as many frames as the free
+// transmit buffers allow. Returns true once everything has been sent
+int1 blackbox_dump(int8 reserve)
+{
+    unsigned int8 record;
+    unsigned int8 port;
+    unsigned int8 * payload;
+    int8 n_parts;
+    int8 len;
+    
+    if (!gb_blackbox_frozen)
+    {
+        return 1;
+    }
+    
+    while (g_blackbox_dump_record < g_blackbox_count)
+    {
+        record = (unsigned int8) (g_blackbox_head - g_blackbox_count + g_blackbox_dump_record);
+        n_parts = BLACKBOX_SUMMARY_PARTS;
+        if ((record % BLACKBOX_CELL_DIVIDER) == 0)
+        {
+            n_parts += BLACKBOX_CELL_PARTS;
+        }
+        
+        port = can_bus_reserve(BLACKBOX_DUMP_BUS, reserve);
+        if (port == CAN_TX_NONE)
+        {
+            return 0;
+        }
+        
+        payload = can_bus_payload(BLACKBOX_DUMP_BUS, port);
+        payload[0] = record;
+        payload[1] = g_blackbox_dump_part;
+        len = blackbox_fill(&payload[2], record, g_blackbox_dump_part);
+        can_bus_commit(BLACKBOX_DUMP_BUS, port, BLACKBOX_DUMP_ID, len + 2);
+        
+        if (++g_blackbox_dump_part >= n_parts)
+        {
+            g_blackbox_dump_part = 0;
+            g_blackbox_dump_record++;
+        }
+    }
+    return 1;
+}
+
+#endif
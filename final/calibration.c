@@ -0,0 +1,151 @@
+#ifndef CALIBRATION_C
+#define CALIBRATION_C
+
+// Per channel calibration
+// Every cell and thermistor channel has a gain trim and an offset, applied to
+// its readings right after they are acquired:
+//   corrected = reading + reading * gain / 2^16 + offset
+// so a gain of 0 leaves the slope alone and one bit trims it by 15 ppm.
+// Cell offsets are in 0.1 mV and thermistor offsets in ADC codes. The tables
+// are read from the eeprom at start up; an erased or corrupt block leaves
+// every channel uncorrected. host/calfit fits the block from reference meter
+// logs and host/calprog writes it with COMMAND_CALIBRATION_WRITE, a piece
+// per command. The tables are reloaded once the piece holding the last byte
+// of the block is written, the readings keep the old trims until then.
+//
+// Eeprom block at CAL_ADDRESS:
+//   byte 0        : CAL_MARKER
+//   bytes 1-216   : cell gains, cell offsets, thermistor gains, thermistor
+//                   offsets, signed 16 bit, MSB first
+//   byte 217      : checksum, all bytes of the block add up to 0
+//
+// Command (COMMAND_CALIBRATION_WRITE_ID):
+//   byte 0   : offset of the piece in the block
+//   bytes 1-7: the piece
+// Response (RESPONSE_CALIBRATION_WRITE_ID):
+//   byte 0   : offset of the piece
+//   byte 1   : bytes written, 0 if the piece does not fit in the block
+//   byte 2   : 1 if the tables were reloaded from a valid block
+
+#define CAL_MARKER    0xC1
+#define CAL_BLOCK_LEN (2 + 4*(N_CELLS + N_ADC_CHANNELS))
+#define CAL_CELL_MAX  0xFFFF
+#define CAL_ADC_MAX   0x0FFF // 12 bit ADS7952 codes
+#define CAL_RESPONSE_LEN 3
+
+typedef struct
+{
+    signed int16 cell_gain[N_CELLS];
+    signed int16 cell_offset[N_CELLS];
+    signed int16 thermistor_gain[N_ADC_CHANNELS];
+    signed int16 thermistor_offset[N_ADC_CHANNELS];
+    int1         b_valid; // The eeprom held a valid block
+} calibration_t;
+
+static calibration_t g_cal;
+
+// Unpacks n MSB first values from the block
+void calibration_unpack(signed int16 * table, unsigned int8 * data, int8 n)
+{
+    int8 i;
+    
+    for (i = 0 ; i < n ; i++)
+    {
+        table[i] = ((signed int16)data[2*i] << 8) | data[2*i + 1];
+    }
+}
+
+// Reads the tables from the eeprom, clears them if the block is not valid
+void calibration_load(void)
+{
+    unsigned int8 block[CAL_BLOCK_LEN];
+    unsigned int8 sum = 0;
+    unsigned int8 * data = block + 1;
+    int16 i;
+    
+    eeprom_read_bytes(CAL_ADDRESS, block, CAL_BLOCK_LEN);
+    for (i = 0 ; i < CAL_BLOCK_LEN ; i++)
+    {
+        sum += block[i];
+    }
+    
+    // Without a valid block every trim unpacks as 0
+    g_cal.b_valid = (block[0] == CAL_MARKER) && (sum == 0);
+    if (!g_cal.b_valid)
+    {
+        for (i = 0 ; i < CAL_BLOCK_LEN ; i++)
+        {
+            block[i] = 0;
+        }
+    }
+    
+    calibration_unpack(g_cal.cell_gain, data, N_CELLS);
+    data += 2*N_CELLS;
+    calibration_unpack(g_cal.cell_offset, data, N_CELLS);
+    data += 2*N_CELLS;
+    calibration_unpack(g_cal.thermistor_gain, data, N_ADC_CHANNELS);
+    data += 2*N_ADC_CHANNELS;
+    calibration_unpack(g_cal.thermistor_offset, data, N_ADC_CHANNELS);
+}
+
+// Writes a piece of the block from a command payload and answers it, the
+// last piece reloads the tables. Returns false if the piece does not fit.
+int1 calibration_write(unsigned int8 * data, int8 len)
+{
+    unsigned int8 response[CAL_RESPONSE_LEN];
+    unsigned int8 offset = (len > 0) ? data[0] : 0;
+    int8 n = len - 1;
+    
+    response[0] = offset;
+    response[1] = 0;
+    response[2] = 0;
+    if ((n < 1) || ((int16)offset + n > CAL_BLOCK_LEN))
+    {
+        can_bus_putd(RESPONSE_CALIBRATION_WRITE_BUS, RESPONSE_CALIBRATION_WRITE_ID, response, CAL_RESPONSE_LEN);
+        return 0;
+    }
+    
+    eeprom_write_bytes(CAL_ADDRESS + offset, data + 1, n);
+    response[1] = n;
+    if ((int16)offset + n == CAL_BLOCK_LEN)
+    {
+        calibration_load();
+        response[2] = g_cal.b_valid;
+    }
+    can_bus_putd(RESPONSE_CALIBRATION_WRITE_BUS, RESPONSE_CALIBRATION_WRITE_ID, response, CAL_RESPONSE_LEN);
+    return 1;
+}
+
+// Corrects n readings in place and clamps them to 0..max. One pass over
+// parallel arrays, the product fits in 32 bits for any reading and gain.
+void calibration_apply(unsigned int16 * x, signed int16 * gain, signed int16 * offset, int8 n, unsigned int16 max)
+{
+    signed int32 y;
+    int8 i;
+    
+    for (i = 0 ; i < n ; i++)
+    {
+        y = (signed int32)x[i] + (((signed int32)x[i] * gain[i]) >> 16) + offset[i];
+        if (y < 0)
+        {
+            y = 0;
+        }
+        if (y > max)
+        {
+            y = max;
+        }
+        x[i] = (unsigned int16)y;
+    }
+}
+
+void calibration_apply_cells(unsigned int16 * voltage)
+{
+    calibration_apply(voltage, g_cal.cell_gain, g_cal.cell_offset, N_CELLS, CAL_CELL_MAX);
+}
+
+void calibration_apply_thermistors(unsigned int16 * raw)
+{
+    calibration_apply(raw, g_cal.thermistor_gain, g_cal.thermistor_offset, N_ADC_CHANNELS, CAL_ADC_MAX);
+}
+
+#endif
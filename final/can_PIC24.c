@@ -32,6 +32,12 @@
 ////  can2_get_id - Gets the standard and extended ID for CAN2              ////
 ////                                                                        ////
 ////  can_putd - Sends a message/request with specified ID for CAN1         ////
+////  can_tx_reserve/can_tx_commit - Builds a message in place in the CAN1  ////
+////     DMA buffer without copying the payload                             ////
+////  can2_tx_reserve/can2_tx_commit - Same for CAN2                        ////
+////  can_tx_reserve_batch/can_tx_commit_batch - Claims and queues several  ////
+////     CAN1 messages built in place, one critical section each            ////
+////  can2_tx_reserve_batch/can2_tx_commit_batch - Same for CAN2            ////
 ////  can2_putd - Sends a message/request with specified ID for CAN2        ////
 ////                                                                        ////
 ////  can_getd - Returns specifid message/request and ID for CAN1           ////
@@ -81,6 +87,8 @@
 ////  can2_associate_filter_to_mask - associates a filter with a mask       ////
 ////     for CAN2                                                           ////
 ////                                                                        ////
+////  can_set_filters - receives only a list of standard IDs on CAN1        ////
+////                                                                        ////
 ////  can_fifo_getd - retrive data in FIFO mode for CAN1                    ////
 ////  can2_fifo_getd - retrive data in FIFO mode for CAN2                   ////
 ////                                                                        ////
@@ -135,12 +143,10 @@
 
 //macros
 #define can_kbhit() (C1RXFUL1.rxful0 || C1RXFUL1.rxful1 || C1RXFUL1.rxful2 || C1RXFUL1.rxful3 || C1RXFUL1.rxful4 || C1RXFUL1.rxful5 || C1RXFUL1.rxful6 || C1RXFUL1.rxful7 || C1RXFUL1.rxful8 || C1RXFUL1.rxful9 || C1RXFUL1.rxful10 || C1RXFUL1.rxful11 || C1RXFUL1.rxful12 || C1RXFUL1.rxful13 || C1RXFUL1.rxful14 || C1RXFUL1.rxful15 || C1RXFUL2.rxful16 || C1RXFUL2.rxful17 || C1RXFUL2.rxful18 || C1RXFUL2.rxful19 || C1RXFUL2.rxful20 || C1RXFUL2.rxful21 || C1RXFUL2.rxful22 || C1RXFUL2.rxful23 || C1RXFUL2.rxful24 || C1RXFUL2.rxful25 || C1RXFUL2.rxful26 || C1RXFUL2.rxful27 || C1RXFUL2.rxful28 || C1RXFUL2.rxful29 || C1RXFUL2.rxful30 || C1RXFUL2.rxful31)
-#define can_tbe() ((C1TR01CON.txenm && !C1TR01CON.txreqm) || (C1TR01CON.txenn && !C1TR01CON.txreqn) || (C1TR23CON.txenm && !C1TR23CON.txreqm) || (C1TR23CON.txenn && !C1TR23CON.txreqn) || (C1TR45CON.txenm && !C1TR45CON.txreqm) || (C1TR45CON.txenn && !C1TR45CON.txreqn) || ( C1TR67CON.txenm && !C1TR67CON.txreqm) || (C1TR67CON.txenn && !C1TR67CON.txreqn))
 #define can_abort()                 (C1CTRL1.abat=1)
 
 #if getenv("SFR:C2CTRL1")
    #define can2_kbhit() (C2RXFUL1.rxful0 || C2RXFUL1.rxful1 || C2RXFUL1.rxful2 || C2RXFUL1.rxful3 || C2RXFUL1.rxful4 || C2RXFUL1.rxful5 || C2RXFUL1.rxful6 || C2RXFUL1.rxful7 || C2RXFUL1.rxful8 || C2RXFUL1.rxful9 || C2RXFUL1.rxful10 || C2RXFUL1.rxful11 || C2RXFUL1.rxful12 || C2RXFUL1.rxful13 || C2RXFUL1.rxful14 || C2RXFUL1.rxful15 || C2RXFUL2.rxful16 || C2RXFUL2.rxful17 || C2RXFUL2.rxful18 || C2RXFUL2.rxful19 || C2RXFUL2.rxful20 || C2RXFUL2.rxful21 || C2RXFUL2.rxful22 || C2RXFUL2.rxful23 || C2RXFUL2.rxful24 || C2RXFUL2.rxful25 || C2RXFUL2.rxful26 || C2RXFUL2.rxful27 || C2RXFUL2.rxful28 || C2RXFUL2.rxful29 || C2RXFUL2.rxful30 || C2RXFUL2.rxful31)
-   #define can2_tbe() ((C2TR01CON.txenm && !C2TR01CON.txreqm) || (C2TR01CON.txenn && !C2TR01CON.txreqn) || (C2TR23CON.txenm && !C2TR23CON.txreqm) || (C2TR23CON.txenn && !C2TR23CON.txreqn) || (C2TR45CON.txenm && !C2TR45CON.txreqm) || (C2TR45CON.txenn && !C2TR45CON.txreqn) || ( C2TR67CON.txenm && !C2TR67CON.txreqm) || (C2TR67CON.txenn && !C2TR67CON.txreqn))
    #define can2_abort()                 (C2CTRL1.abat=1)
 #endif
 
@@ -216,6 +222,9 @@ void can_init(void) {
    can_set_mode(CAN_OP_CONFIG);   //must be in config mode before params can be set
    
    C1CTRL1.cancap=CAN_ENABLE_CAN_CAPTURE;
+   #if CAN_ENABLE_CAN_CAPTURE
+      CAN_IC2CON=CAN_IC2_CAPTURE_TMR2;
+   #endif
    C1CTRL1.cancks=0;
    can_set_baud();
    
@@ -294,6 +303,37 @@ void can_init(void) {
    }
 #endif
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// can_set_filters()
+//
+// Replaces the accept all filter set up by can_init() with exact matches on
+// a list of standard IDs. Mask 0 compares all 11 bits and filters 0 to
+// count-1 hold the IDs, all received into the FIFO.
+//
+// Parameters:
+//       ids - the standard IDs to receive
+//       count - number of IDs, at most 16
+//
+////////////////////////////////////////////////////////////////////////////////
+void can_set_filters(uint16_t *ids, uint8_t count) {
+   CAN_OP_MODE mode=C1CTRL1.opmode;   //can_set_id() changes curmode
+   uint16_t enable=0;
+   uint8_t i;
+   
+   can_set_mode(CAN_OP_CONFIG);
+   
+   can_set_id(&C1RXM0, 0x7FF, FALSE);
+   for(i=0;(i<count)&&(i<16);i++) {
+      can_set_id(&C1RXF0+2*i, ids[i], FALSE);   //filter registers are 4 bytes apart
+      can_associate_filter_to_buffer(AFIFO, i);
+      enable|=(1<<i);
+   }
+   C1FEN1=enable;
+   
+   can_set_mode(mode);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // can_set_baud()
@@ -999,59 +1039,84 @@ void can_associate_filter_to_mask(CAN_MASK_FILTER_ASSOCIATION mask, CAN_FILTER_A
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// can_putd()
-// can2_putd()
-//
-// Puts data on a transmit buffer, at which time the CAN peripheral will
-// send when the CAN bus becomes available.
-//
-//    Paramaters:
-//       id - ID to transmit data as
-//       data - pointer to data to send
-//       len - length of data to send
-//       priority - priority of message.  The higher the number, the
-//                  sooner the CAN peripheral will send the message.
-//                  Numbers 0 through 3 are valid.
-//       ext - TRUE to use an extended ID, FALSE if not
-//       rtr - TRUE to set the RTR (request) bit in the ID, false if NOT
+// CAN1 transmit buffer bookkeeping
 //
-//    Returns:
-//       If successful, it will return TRUE
-//       If un-successful, will return FALSE
+// can_tx_free holds one bit per transmit buffer (TRB0-TRB7) that is enabled as
+// a transmitter and free to be loaded.  can_tx_inflight holds the buffers that
+// have been requested and not yet seen complete.  can_tx_complete() is called
+// from the CAN1 event interrupt (TBIF) and returns finished buffers to the free
+// mask, so finding an empty transmitter is a single find-first-set instead of
+// a scan through the C1TRmnCON registers.
 //
 ////////////////////////////////////////////////////////////////////////////////
-int1 can_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ext, int1 rtr) 
+uint8_t can_tx_free=0;
+uint8_t can_tx_inflight=0;
+
+// de Bruijn lookup, maps the isolated lowest bit of a mask to its index
+const uint8_t can_tx_debruijn[8]={0,1,6,2,7,5,4,3};
+
+#define can_tx_ffs(m) can_tx_debruijn[((uint8_t)(((m)&(uint8_t)(0-(m)))*0x1D))>>5]
+
+// Returns the TXREQ bits of TRB0-TRB7 packed into one byte
+uint8_t can_tx_pending(void)
+{
+   uint16_t con;
+   uint8_t pending;
+   
+   con=can_tr_word(C1TR01CON);
+   pending =((con>>3)&0x01)|((con>>10)&0x02);
+   con=can_tr_word(C1TR23CON);
+   pending|=((con>>1)&0x04)|((con>>8)&0x08);
+   con=can_tr_word(C1TR45CON);
+   pending|=((con<<1)&0x10)|((con>>6)&0x20);
+   con=can_tr_word(C1TR67CON);
+   pending|=((con<<3)&0x40)|((con>>4)&0x80);
+   
+   return(pending);
+}
+
+// Moves buffers that have finished transmitting back to the free mask and
+// returns the new free mask.  Must be called with the transmit lock held or
+// from the CAN1 interrupt.
+uint8_t can_tx_reclaim(void)
+{
+   uint8_t done;
+   
+   done=can_tx_inflight&~can_tx_pending();
+   can_tx_inflight&=~done;
+   can_tx_free|=done;
+   
+   return(can_tx_free);
+}
+
+// Call from #INT_CAN1 with the TB interrupt enabled
+void can_tx_complete(void)
+{
+   C1INTF.tbif=0;
+   can_tx_reclaim();
+}
+
+// Returns true if a transmit buffer is free, reclaiming finished ones under
+// the transmit lock
+int1 can_tbe(void)
+{
+   uint8_t avail;
+   uint16_t ipl;
+   
+   CAN_TX_LOCK(ipl);
+   avail=can_tx_free;
+   if (!avail)
+      avail=can_tx_reclaim();
+   CAN_TX_UNLOCK(ipl);
+   
+   return(avail!=0);
+}
+
+// Writes the ECAN header words (ID, DLC) of a transmit buffer
+void can_load_header(uint16_t port, uint32_t id, uint8_t len, int1 ext, int1 rtr)
 {
-   uint16_t *ptr;
-   uint16_t i;
-   uint16_t port;
    uint16_t temp;
-      
-    // find emtpy transmitter
-   if (C1TR01CON.txenm && !C1TR01CON.txreqm && !C1TR01CON.rtrenm)
-      port=0;
-   else if (C1TR01CON.txenn && !C1TR01CON.txreqn && !C1TR01CON.rtrenn)
-      port=1;
-   else if (C1TR23CON.txenm && !C1TR23CON.txreqm && !C1TR23CON.rtrenm)
-      port=2;
-   else if (C1TR23CON.txenn && !C1TR23CON.txreqn && !C1TR23CON.rtrenn)
-      port=3;
-   else if (C1TR45CON.txenm && !C1TR45CON.txreqm && !C1TR45CON.rtrenm)
-      port=4;
-   else if (C1TR45CON.txenn && !C1TR45CON.txreqn && !C1TR45CON.rtrenn)
-      port=5;
-   else if (C1TR67CON.txenm && !C1TR67CON.txreqm && !C1TR67CON.rtrenm)
-      port=6;
-   else if (C1TR67CON.txenn && !C1TR67CON.txreqn && !C1TR67CON.rtrenn)
-      port=7;
-   else {
-      #if CAN_DO_DEBUG
-         can_debug("\r\nCAN_PUTD() FAIL: NO OPEN TX BUFFERS\r\n");
-      #endif
-      return(0);
-   }
    
-   // load data into correct buffer
    if(ext)
    {
       temp=(((id & 0x1FFC0000) >> 16) | (((uint16_t)rtr << 1) | ext)) & 0x1FFF;
@@ -1069,6 +1134,15 @@ int1 can_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ex
       temp=(((uint16_t)rtr << 9) | len) & 0xFF1F;
       ecan1_message_buffer[port][2]=temp;
    }
+}
+
+// Writes the ECAN header words and copies the payload into a transmit buffer
+void can_load_buffer(uint16_t port, uint32_t id, uint8_t *data, uint8_t len, int1 ext, int1 rtr)
+{
+   uint16_t *ptr;
+   uint16_t i;
+   
+   can_load_header(port, id, len, ext, rtr);
    
    ptr=&ecan1_message_buffer[port][3];
    for(i=0;i<len;i+=2)
@@ -1079,7 +1153,12 @@ int1 can_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ex
          *ptr=make16(data[i+1],data[i]);
       ptr++;
    }
-   
+}
+
+// Sets the priority and send request of a loaded transmit buffer.  Must be
+// called with the transmit lock held.
+void can_tx_set_request(uint16_t port, uint8_t priority)
+{
    switch(port)
    {
       case 0:
@@ -1115,55 +1194,223 @@ int1 can_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ex
          C1TR67CON.txreqn=1;                 //enable transmission buffer 7
          break;
    }
-       
-   #if CAN_DO_DEBUG
-            can_debug("\r\nCAN_PUTD(): BUFF=%U ID=%LX LEN=%U PRI=%U EXT=%U RTR=%U\r\n", port, id, len, priority, ext, rtr);
-            if ((len)&&(!rtr)) {
-               can_debug("  DATA = ");
-               for (i=0;i<len;i++) {
-                  can_debug("%X ",*data);
-                  data++;
-               }
-               can_debug("\r\n");
-            }
-   #endif 
+}
 
-   return(1);
+// Sets the priority and send request of a loaded transmit buffer
+void can_tx_request(uint16_t port, uint8_t priority)
+{
+   uint16_t ipl;
+   
+   CAN_TX_LOCK(ipl);
+   can_tx_inflight|=(1<<port);
+   can_tx_set_request(port, priority);
+   CAN_TX_UNLOCK(ipl);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// can_tx_reserve()
+// can_tx_payload()
+// can_tx_commit()
+// can_tx_cancel()
+//
+// Zero copy transmit.  can_tx_reserve() claims a free transmit buffer, the
+// caller writes the payload straight into the DMA message buffer through the
+// pointer returned by can_tx_payload(), then can_tx_commit() writes the ID and
+// length and requests transmission.  A reserved buffer that won't be sent
+// must be handed back with can_tx_cancel().
+//
+//    Paramaters:
+//       reserve - number of transmit buffers to leave free for other callers
+//       port - buffer returned by can_tx_reserve()
+//       id, len, priority, ext, rtr - as for can_putd()
+//
+//    Returns:
+//       can_tx_reserve() returns the claimed buffer, or CAN_TX_NONE if fewer
+//       than reserve+1 buffers are free
+//
+////////////////////////////////////////////////////////////////////////////////
+uint8_t can_tx_reserve(uint8_t reserve)
+{
+   uint8_t avail;
+   uint8_t port;
+   uint16_t ipl;
+   
+   CAN_TX_LOCK(ipl);
+   if (!can_tx_free)
+      can_tx_reclaim();
+   
+   // more than reserve buffers must be free
+   avail=can_tx_free;
+   while(reserve && avail)
+   {
+      avail&=avail-1;
+      reserve--;
+   }
+   if (!avail) {
+      CAN_TX_UNLOCK(ipl);
+      return(CAN_TX_NONE);
+   }
+   port=can_tx_ffs(can_tx_free);
+   can_tx_free&=~(1<<port);
+   CAN_TX_UNLOCK(ipl);
+   
+   return(port);
+}
+
+void can_tx_commit(uint16_t port, uint32_t id, uint8_t len, uint8_t priority, int1 ext, int1 rtr)
+{
+   can_load_header(port, id, len, ext, rtr);
+   can_tx_request(port, priority);
+}
+
+void can_tx_cancel(uint16_t port)
+{
+   uint16_t ipl;
+   
+   CAN_TX_LOCK(ipl);
+   can_tx_free|=(1<<port);
+   CAN_TX_UNLOCK(ipl);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// can_tx_reserve_batch()
+// can_tx_commit_batch()
+//
+// Batch zero copy transmit.  can_tx_reserve_batch() claims several free
+// transmit buffers from one read of the free mask in a single critical
+// section.  The caller builds each frame in place as for can_tx_reserve(),
+// writing the ID and length with can_load_header(), then
+// can_tx_commit_batch() requests all of them in a second critical section.
+// Frames of equal priority leave the ECAN highest buffer number first.
+//
+//    Paramaters:
+//       count - number of transmit buffers wanted
+//       reserve - number of transmit buffers to leave free for other callers
+//       ports - buffers returned by can_tx_reserve_batch(), bit n for TRBn
+//       priority - as for can_putd()
+//
+//    Returns:
+//       can_tx_reserve_batch() returns the lowest numbered free buffers, at
+//       most count of them and 0 if no more than reserve buffers are free
+//
+////////////////////////////////////////////////////////////////////////////////
+uint8_t can_tx_reserve_batch(uint8_t count, uint8_t reserve)
+{
+   uint8_t avail;
+   uint8_t spare;
+   uint8_t bit;
+   uint8_t claimed=0;
+   uint16_t ipl;
+   
+   CAN_TX_LOCK(ipl);
+   avail=can_tx_free;
+   if (!avail)
+      avail=can_tx_reclaim();
+   
+   // spare keeps one bit per buffer that may be claimed past the reserve
+   spare=avail;
+   while(reserve && spare)
+   {
+      spare&=spare-1;
+      reserve--;
+   }
+   while(count && spare)
+   {
+      bit=avail&(uint8_t)(0-avail);
+      claimed|=bit;
+      avail&=~bit;
+      spare&=spare-1;
+      count--;
+   }
+   can_tx_free&=~claimed;
+   CAN_TX_UNLOCK(ipl);
+   
+   return(claimed);
+}
+
+void can_tx_commit_batch(uint8_t ports, uint8_t priority)
+{
+   uint16_t port;
+   uint16_t ipl;
+   
+   CAN_TX_LOCK(ipl);
+   can_tx_inflight|=ports;
+   while(ports)
+   {
+      port=can_tx_ffs(ports);
+      ports&=ports-1;
+      can_tx_set_request(port, priority);
+   }
+   CAN_TX_UNLOCK(ipl);
 }
 
+// CAN2 transmit buffer bookkeeping, works the same as the CAN1 functions above
 #if getenv("SFR:C2CTRL1")
-   int1 can2_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ext, int1 rtr)
+   uint8_t can2_tx_free=0;
+   uint8_t can2_tx_inflight=0;
+
+   // Returns the TXREQ bits of TRB0-TRB7 packed into one byte
+   uint8_t can2_tx_pending(void)
+   {
+      uint16_t con;
+      uint8_t pending;
+
+      con=can_tr_word(C2TR01CON);
+      pending =((con>>3)&0x01)|((con>>10)&0x02);
+      con=can_tr_word(C2TR23CON);
+      pending|=((con>>1)&0x04)|((con>>8)&0x08);
+      con=can_tr_word(C2TR45CON);
+      pending|=((con<<1)&0x10)|((con>>6)&0x20);
+      con=can_tr_word(C2TR67CON);
+      pending|=((con<<3)&0x40)|((con>>4)&0x80);
+
+      return(pending);
+   }
+
+   // Moves buffers that have finished transmitting back to the free mask and
+   // returns the new free mask.  Must be called with the transmit lock held or
+   // from the CAN2 interrupt.
+   uint8_t can2_tx_reclaim(void)
+   {
+      uint8_t done;
+
+      done=can2_tx_inflight&~can2_tx_pending();
+      can2_tx_inflight&=~done;
+      can2_tx_free|=done;
+
+      return(can2_tx_free);
+   }
+
+   // Call from #INT_CAN2 with the TB interrupt enabled
+   void can2_tx_complete(void)
+   {
+      C2INTF.tbif=0;
+      can2_tx_reclaim();
+   }
+
+   // Returns true if a transmit buffer is free, reclaiming finished ones
+   // under the transmit lock
+   int1 can2_tbe(void)
+   {
+      uint8_t avail;
+      uint16_t ipl;
+
+      CAN_TX_LOCK(ipl);
+      avail=can2_tx_free;
+      if (!avail)
+         avail=can2_tx_reclaim();
+      CAN_TX_UNLOCK(ipl);
+
+      return(avail!=0);
+   }
+
+   // Writes the ECAN header words (ID, DLC) of a transmit buffer
+   void can2_load_header(uint16_t port, uint32_t id, uint8_t len, int1 ext, int1 rtr)
    {
-      uint16_t *ptr;
-      uint16_t i;
-      uint16_t port;
       uint16_t temp;
-         
-       // find emtpy transmitter
-      if (C2TR01CON.txenm && !C2TR01CON.txreqm && !C2TR01CON.rtrenm)
-         port=0;
-      else if (C2TR01CON.txenn && !C2TR01CON.txreqn && !C2TR01CON.rtrenn)
-         port=1;
-      else if (C2TR23CON.txenm && !C2TR23CON.txreqm && !C2TR23CON.rtrenm)
-         port=2;
-      else if (C2TR23CON.txenn && !C2TR23CON.txreqn && !C2TR23CON.rtrenn)
-         port=3;
-      else if (C2TR45CON.txenm && !C2TR45CON.txreqm && !C2TR45CON.rtrenm)
-         port=4;
-      else if (C2TR45CON.txenn && !C2TR45CON.txreqn && !C2TR45CON.rtrenn)
-         port=5;
-      else if (C2TR67CON.txenm && !C2TR67CON.txreqm && !C2TR67CON.rtrenm)
-         port=6;
-      else if (C2TR67CON.txenn && !C2TR67CON.txreqn && !C2TR67CON.rtrenn)
-         port=7;
-      else {
-         #if CAN_DO_DEBUG
-            can_debug("\r\nCAN2_PUTD() FAIL: NO OPEN TX BUFFERS\r\n");
-         #endif
-         return(0);
-      }
-      
-      // load data into correct buffer
+
       if(ext)
       {
          temp=(((id & 0x1FFC0000) >> 16) | (((uint16_t)rtr << 1) | ext)) & 0x1FFF;
@@ -1181,7 +1428,16 @@ int1 can_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ex
          temp=(((uint16_t)rtr << 9) | len) & 0xFF1F;
          ecan2_message_buffer[port][2]=temp;
       }
-      
+   }
+
+   // Writes the ECAN header words and copies the payload into a transmit buffer
+   void can2_load_buffer(uint16_t port, uint32_t id, uint8_t *data, uint8_t len, int1 ext, int1 rtr)
+   {
+      uint16_t *ptr;
+      uint16_t i;
+
+      can2_load_header(port, id, len, ext, rtr);
+
       ptr=&ecan2_message_buffer[port][3];
       for(i=0;i<len;i+=2)
       {
@@ -1191,10 +1447,15 @@ int1 can_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ex
             *ptr=make16(data[i+1],data[i]);
          ptr++;
       }
-      
+   }
+
+   // Sets the priority and send request of a loaded transmit buffer.  Must be
+   // called with the transmit lock held.
+   void can2_tx_set_request(uint16_t port, uint8_t priority)
+   {
       switch(port)
       {
-         case  0:
+         case 0:
             C2TR01CON.txmpri=priority;          //set priority DMA buffer 0
             C2TR01CON.txreqm=1;                 //enable transmission buffer 0
             break;
@@ -1227,6 +1488,191 @@ int1 can_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ex
             C2TR67CON.txreqn=1;                 //enable transmission buffer 7
             break;
       }
+   }
+
+   // Sets the priority and send request of a loaded transmit buffer
+   void can2_tx_request(uint16_t port, uint8_t priority)
+   {
+      uint16_t ipl;
+
+      CAN_TX_LOCK(ipl);
+      can2_tx_inflight|=(1<<port);
+      can2_tx_set_request(port, priority);
+      CAN_TX_UNLOCK(ipl);
+   }
+
+   uint8_t can2_tx_reserve(uint8_t reserve)
+   {
+      uint8_t avail;
+      uint8_t port;
+      uint16_t ipl;
+
+      CAN_TX_LOCK(ipl);
+      if (!can2_tx_free)
+         can2_tx_reclaim();
+
+      // more than reserve buffers must be free
+      avail=can2_tx_free;
+      while(reserve && avail)
+      {
+         avail&=avail-1;
+         reserve--;
+      }
+      if (!avail) {
+         CAN_TX_UNLOCK(ipl);
+         return(CAN_TX_NONE);
+      }
+      port=can_tx_ffs(can2_tx_free);
+      can2_tx_free&=~(1<<port);
+      CAN_TX_UNLOCK(ipl);
+
+      return(port);
+   }
+
+   void can2_tx_commit(uint16_t port, uint32_t id, uint8_t len, uint8_t priority, int1 ext, int1 rtr)
+   {
+      can2_load_header(port, id, len, ext, rtr);
+      can2_tx_request(port, priority);
+   }
+
+   void can2_tx_cancel(uint16_t port)
+   {
+      uint16_t ipl;
+
+      CAN_TX_LOCK(ipl);
+      can2_tx_free|=(1<<port);
+      CAN_TX_UNLOCK(ipl);
+   }
+
+   uint8_t can2_tx_reserve_batch(uint8_t count, uint8_t reserve)
+   {
+      uint8_t avail;
+      uint8_t spare;
+      uint8_t bit;
+      uint8_t claimed=0;
+      uint16_t ipl;
+
+      CAN_TX_LOCK(ipl);
+      avail=can2_tx_free;
+      if (!avail)
+         avail=can2_tx_reclaim();
+
+      // spare keeps one bit per buffer that may be claimed past the reserve
+      spare=avail;
+      while(reserve && spare)
+      {
+         spare&=spare-1;
+         reserve--;
+      }
+      while(count && spare)
+      {
+         bit=avail&(uint8_t)(0-avail);
+         claimed|=bit;
+         avail&=~bit;
+         spare&=spare-1;
+         count--;
+      }
+      can2_tx_free&=~claimed;
+      CAN_TX_UNLOCK(ipl);
+
+      return(claimed);
+   }
+
+   void can2_tx_commit_batch(uint8_t ports, uint8_t priority)
+   {
+      uint16_t port;
+      uint16_t ipl;
+
+      CAN_TX_LOCK(ipl);
+      can2_tx_inflight|=ports;
+      while(ports)
+      {
+         port=can_tx_ffs(ports);
+         ports&=ports-1;
+         can2_tx_set_request(port, priority);
+      }
+      CAN_TX_UNLOCK(ipl);
+   }
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// can_putd()
+// can2_putd()
+//
+// Puts data on a transmit buffer, at which time the CAN peripheral will
+// send when the CAN bus becomes available.
+//
+//    Paramaters:
+//       id - ID to transmit data as
+//       data - pointer to data to send
+//       len - length of data to send
+//       priority - priority of message.  The higher the number, the
+//                  sooner the CAN peripheral will send the message.
+//                  Numbers 0 through 3 are valid.
+//       ext - TRUE to use an extended ID, FALSE if not
+//       rtr - TRUE to set the RTR (request) bit in the ID, false if NOT
+//
+//    Returns:
+//       If successful, it will return TRUE
+//       If un-successful, will return FALSE
+//
+////////////////////////////////////////////////////////////////////////////////
+int1 can_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ext, int1 rtr) 
+{
+   uint8_t port;
+   #if CAN_DO_DEBUG
+      uint16_t i;
+   #endif
+      
+   // claim the lowest numbered free transmitter
+   port=can_tx_reserve(0);
+   if (port==CAN_TX_NONE) {
+      #if CAN_DO_DEBUG
+         can_debug("\r\nCAN_PUTD() FAIL: NO OPEN TX BUFFERS\r\n");
+      #endif
+      return(0);
+   }
+   
+   // load data into correct buffer
+   can_load_buffer(port, id, data, len, ext, rtr);
+   can_tx_request(port, priority);
+       
+   #if CAN_DO_DEBUG
+            can_debug("\r\nCAN_PUTD(): BUFF=%U ID=%LX LEN=%U PRI=%U EXT=%U RTR=%U\r\n", port, id, len, priority, ext, rtr);
+            if ((len)&&(!rtr)) {
+               can_debug("  DATA = ");
+               for (i=0;i<len;i++) {
+                  can_debug("%X ",*data);
+                  data++;
+               }
+               can_debug("\r\n");
+            }
+   #endif 
+
+   return(1);
+}
+
+#if getenv("SFR:C2CTRL1")
+   int1 can2_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ext, int1 rtr)
+   {
+      uint8_t port;
+      #if CAN_DO_DEBUG
+         uint16_t i;
+      #endif
+         
+      // claim the lowest numbered free transmitter
+      port=can2_tx_reserve(0);
+      if (port==CAN_TX_NONE) {
+         #if CAN_DO_DEBUG
+            can_debug("\r\nCAN2_PUTD() FAIL: NO OPEN TX BUFFERS\r\n");
+         #endif
+         return(0);
+      }
+      
+      // load data into correct buffer
+      can2_load_buffer(port, id, data, len, ext, rtr);
+      can2_tx_request(port, priority);
           
       #if CAN_DO_DEBUG
                can_debug("\r\nCAN2_PUTD(): BUFF=%U ID=%LX LEN=%U PRI=%U EXT=%U RTR=%U\r\n", port, id, len, priority, ext, rtr);
@@ -1244,6 +1690,46 @@ int1 can_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ex
    }
 #endif
 
+#if CAN_ENABLE_CAN_CAPTURE
+////////////////////////////////////////////////////////////////////////////////
+//
+// can_capture_take()
+//
+// Takes the newest IC2 capture and empties the capture FIFO.  IC2 captures
+// every frame on the CAN1 bus, those the filters reject too, so the FIFO can
+// hold captures of other frames around the one being read.  The newest is
+// that of the last frame on the bus, which is the frame read unless another
+// one followed it before the read.  Once the FIFO has overflowed IC2 stops
+// capturing and only holds old captures, so it is restarted and no capture
+// is returned.
+//
+//    Parameters:
+//      capture - set to the newest capture of TMR2
+//
+//    Returns:
+//      TRUE if there was a capture to take
+//
+////////////////////////////////////////////////////////////////////////////////
+int1 can_capture_take(uint16_t *capture)
+{
+   int1 taken=0;
+   
+   if (CAN_IC2_ICOV)
+   {
+      CAN_IC2CON=0;                      //turning IC2 off empties the FIFO and clears ICOV
+      CAN_IC2CON=CAN_IC2_CAPTURE_TMR2;
+      return(0);
+   }
+   while(CAN_IC2_BNE)
+   {
+      *capture=CAN_IC2BUF;
+      taken=1;
+   }
+   
+   return(taken);
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // can_getd()
@@ -1471,6 +1957,12 @@ int1 can_getd(uint32_t &id, uint8_t *data, uint8_t &len, struct rx_stat &stat)
    
    C1INTF.rbif=0;
    
+   #if CAN_ENABLE_CAN_CAPTURE
+      stat.stamped=can_capture_take(&stat.timestamp);
+   #else
+      stat.stamped=0;
+   #endif
+   
    ptr=&ecan1_message_buffer[stat.buffer][0];
    stat.ext=(*ptr & 0x1);
    temp=(*ptr & 0x1);
@@ -1820,6 +2312,7 @@ int1 can_getd(uint32_t &id, uint8_t *data, uint8_t &len, struct rx_stat &stat)
        }
       
       C2INTF.rbif=0;
+      stat.stamped=0;   //CAN capture only covers CAN1
       
       ptr=&ecan2_message_buffer[stat.buffer][0];
       stat.ext=(*ptr & 0x1);
@@ -2089,6 +2582,8 @@ void can_enable_b_transfer(BUFFER b)
          C1TR67CON.txenn=1;
          break;
    }
+   if (b<8)
+      can_tx_free|=(1<<b)&~can_tx_inflight;
    if(C1TR67CON.txenn)
       C1FCTRL.fsa=8;
    else if (C1TR67CON.txenm)
@@ -2137,6 +2632,8 @@ void can_enable_b_transfer(BUFFER b)
             C2TR67CON.txenn=1;
             break;
       }
+      if (b<8)
+         can2_tx_free|=(1<<b)&~can2_tx_inflight;
       if(C2TR67CON.txenn)
          C2FCTRL.fsa=8;
       else if (C2TR67CON.txenm)
@@ -2199,6 +2696,8 @@ void can_enable_b_receiver(BUFFER b)
          C1TR67CON.txenn=0;
          break;
    }
+   if (b<8)
+      can_tx_free&=~(1<<b);
    if(C1TR67CON.txenn)
       C1FCTRL.fsa=8;
    else if (C1TR67CON.txenm)
@@ -2249,6 +2748,8 @@ void can_enable_b_receiver(BUFFER b)
             C2TR67CON.txenn=0;
             break;
       }
+      if (b<8)
+         can2_tx_free&=~(1<<b);
       if(C2TR67CON.txenn)
          C2FCTRL.fsa=8;
       else if (C2TR67CON.txenm)
@@ -2311,6 +2812,8 @@ void can_enable_rtr(BUFFER b)
          C1TR67CON.rtrenn=1;
          break;
    }
+   if (b<8)
+      can_tx_free&=~(1<<b);
 }
 
 #if getenv("SFR:C2CTRL1")
@@ -2343,6 +2846,8 @@ void can_enable_rtr(BUFFER b)
             C2TR67CON.rtrenn=1;
             break;
       }
+      if (b<8)
+         can2_tx_free&=~(1<<b);
    }
 #endif
 
@@ -2387,6 +2892,8 @@ void can_disable_rtr(BUFFER b)
          C1TR67CON.rtrenn=0;
          break;
    }
+   if (b<8)
+      can_tx_free|=(1<<b)&~can_tx_inflight;
 }
 
 #if getenv("SFR:C2CTRL1")
@@ -2419,6 +2926,8 @@ void can_disable_rtr(BUFFER b)
             C2TR67CON.rtrenn=0;
             break;
       }
+      if (b<8)
+         can2_tx_free|=(1<<b)&~can2_tx_inflight;
    }
 #endif
 
@@ -2792,6 +3301,12 @@ int1 can_fifo_getd(uint32_t &id, uint8_t *data, uint8_t &len, struct rx_stat &st
    
    C1INTF.rbif=0;
    
+   #if CAN_ENABLE_CAN_CAPTURE
+      stat.stamped=can_capture_take(&stat.timestamp);
+   #else
+      stat.stamped=0;
+   #endif
+   
    stat.buffer=C1FIFO.fnrb;
    
    ptr=&ecan1_message_buffer[stat.buffer][0];
@@ -3192,6 +3707,7 @@ int1 can_fifo_getd(uint32_t &id, uint8_t *data, uint8_t &len, struct rx_stat &st
       }
       
       C2INTF.rbif=0;
+      stat.stamped=0;   //CAN capture only covers CAN1
       
       stat.buffer=C2FIFO.fnrb;
       
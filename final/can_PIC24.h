@@ -100,7 +100,7 @@
 #endif
 
 #ifndef CAN_ENABLE_CAN_CAPTURE
- #define CAN_ENABLE_CAN_CAPTURE 0
+ #define CAN_ENABLE_CAN_CAPTURE 1   //CAN1 receptions are captured by IC2 (TMR2) and returned in rx_stat
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -780,6 +780,33 @@ struct DMAxREQ_stuct DMA1REQ;
 
 #word DSADR=getenv("SFR:DSADR")
 
+// Input capture 2, captures TMR2 on every frame on the CAN1 bus when CAN capture
+// is enabled, whether the filters accept it or not
+#word CAN_IC2CON=getenv("SFR:IC2CON")
+#word CAN_IC2BUF=getenv("SFR:IC2BUF")
+#bit  CAN_IC2_BNE=CAN_IC2CON.3   //capture buffer not empty
+#bit  CAN_IC2_ICOV=CAN_IC2CON.4  //capture FIFO overflowed, captures stopped
+#define CAN_IC2_CAPTURE_TMR2 0x0083   //ICTMR = TMR2, capture every rising edge
+
+////////////////////////////////////////////////////////////////////////////////
+
+// CPU status register.  The transmit buffer bookkeeping raises the CPU priority
+// to 7 while it claims a buffer so an interrupt can't claim the same one.
+#word CAN_SR=getenv("SFR:SR")
+
+#define CAN_TX_LOCK(ipl)   {ipl=CAN_SR&0x00E0; CAN_SR|=0x00E0;}
+#define CAN_TX_UNLOCK(ipl) {CAN_SR=(CAN_SR&0xFF1F)|ipl;}
+
+// Reads a Tx/Rx buffer control register as a single word
+#define can_tr_word(reg)   (*((uint16_t *)&reg))
+
+// Returned by can_tx_reserve() when no transmit buffer could be claimed
+#define CAN_TX_NONE        0xFF
+
+// Payload bytes of a transmit buffer claimed with can_tx_reserve()
+#define can_tx_payload(port)  ((uint8_t *)&ecan1_message_buffer[port][3])
+#define can2_tx_payload(port) ((uint8_t *)&ecan2_message_buffer[port][3])
+
 ////////////////////////////////////////////////////////////////////////////////
 
 //value to put in mask field to accept all incoming id's
@@ -794,6 +821,8 @@ struct rx_stat {
    int1 rtr;            // rtr requested
    int1 ext;            // extended id
    int1 inv;            // invalid id?
+   int1 stamped;        // timestamp is valid (CAN capture enabled, CAN1 only)
+   uint16_t timestamp;  // newest TMR2 capture of IC2 when the frame was read, see can_capture_take()
 };
 
 void can_init(void);
@@ -804,7 +833,16 @@ void can_set_buffer_id(BUFFER buffer, uint32_t id, int1 ext);
 void can_set_buffer_size(uint8_t size);
 uint32_t can_get_id(BUFFER buffer, int1 ext);
 int1 can_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ext, int1 rtr);
+uint8_t can_tx_reserve(uint8_t reserve);
+void can_tx_commit(uint16_t port, uint32_t id, uint8_t len, uint8_t priority, int1 ext, int1 rtr);
+void can_tx_cancel(uint16_t port);
+uint8_t can_tx_reserve_batch(uint8_t count, uint8_t reserve);
+void can_tx_commit_batch(uint8_t ports, uint8_t priority);
+uint8_t can_tx_reclaim(void);
+void can_tx_complete(void);
+int1 can_tbe(void);
 int1 can_getd(uint32_t &id, uint8_t *data, uint8_t &len, struct rx_stat &stat);
+int1 can_capture_take(uint16_t *capture);
 void can_enable_b_transfer(BUFFER b);
 void can_enable_b_receiver(BUFFER b);
 void can_enable_rtr(BUFFER b);
@@ -814,6 +852,7 @@ void can_enable_filter(CAN_FILTER_CONTROL filter);
 void can_disable_filter(CAN_FILTER_CONTROL filter);
 void can_associate_filter_to_buffer(CAN_FILTER_ASSOCIATION_BUFFERS buffer, CAN_FILTER_ASSOCIATION filter);
 void can_associate_filter_to_mask(CAN_MASK_FILTER_ASSOCIATION mask, CAN_FILTER_ASSOCIATION filter);
+void can_set_filters(uint16_t *ids, uint8_t count);
 int1 can_fifo_getd(uint32_t &id, uint8_t *data, uint8_t &len, struct rx_stat &stat );
 void can_config_DMA(void);
 void can_enable_interrupts(INTERRUPT setting);
@@ -829,6 +868,14 @@ void can_disable_interrupt(INTERRUPT setting);
    void can2_set_buffer_size(uint8_t size);
    uint32_t can2_get_id(BUFFER buffer, int1 ext);
    int1 can2_putd(uint32_t id, uint8_t *data, uint8_t len, uint8_t priority, int1 ext, int1 rtr);
+   uint8_t can2_tx_reserve(uint8_t reserve);
+   void can2_tx_commit(uint16_t port, uint32_t id, uint8_t len, uint8_t priority, int1 ext, int1 rtr);
+   void can2_tx_cancel(uint16_t port);
+   uint8_t can2_tx_reserve_batch(uint8_t count, uint8_t reserve);
+   void can2_tx_commit_batch(uint8_t ports, uint8_t priority);
+   uint8_t can2_tx_reclaim(void);
+   void can2_tx_complete(void);
+   int1 can2_tbe(void);
    int1 can2_getd(uint32_t &id, uint8_t *data, uint8_t &len, struct rx_stat & stat);
    void can2_enable_b_transfer(BUFFER b);
    void can2_enable_b_receiver(BUFFER b);
@@ -0,0 +1,189 @@
+#ifndef CAN_BUS_C
+#define CAN_BUS_C
+
+#include "can_telem.h"
+#ifdef HOST_BUILD
+#include "host_ecan.c" // ECAN driver over SocketCAN, see host/
+#else
+#include "can_PIC24.c"
+#endif
+
+// CAN bus defines
+#define TX_PRI 3
+#define TX_EXT 0
+#define TX_RTR 0
+#define N_TX_BUFFERS 8 // ECAN buffers 0-7 are used for transmitting
+
+// Sends a command from the misc table (no payload) on the bus it is routed to
+#define CAN_SEND_COMMAND(name) \
+    can_bus_putd(name##_BUS, name##_ID, 0, 0)
+
+static int16 g_can_node_offset = CAN_NODE_ID * CAN_NODE_STRIDE;
+static int16 g_can_misc_id[N_CAN_MISC]  = {CAN_MISC_TABLE(EXPAND_AS_MISC_ID_ARRAY)};
+static int8  g_can_misc_node[N_CAN_MISC] = {CAN_MISC_TABLE(EXPAND_AS_MISC_NODE_ARRAY)};
+
+// Selects the node, CAN_NODE_ID is kept if it is out of range (an erased
+// eeprom reads 0xFF). Call before can_bus_init.
+void can_bus_set_node(unsigned int8 node)
+{
+    if (node < N_CAN_NODES)
+    {
+        g_can_node_offset = node * CAN_NODE_STRIDE;
+    }
+}
+
+int1 can_bus_is_shared(int16 id)
+{
+    int8 i;
+    
+    for (i = 0 ; i < N_CAN_MISC ; i++)
+    {
+        if ((g_can_misc_id[i] == id) && (g_can_misc_node[i] == CAN_NODE_SHARED))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the ID a table entry has on the bus for this node
+int16 can_bus_node_id(int16 id)
+{
+    return can_bus_is_shared(id) ? id : id + g_can_node_offset;
+}
+
+// Returns the table ID of a frame received from the bus
+int32 can_bus_table_id(int32 id)
+{
+    return can_bus_is_shared(id) ? id : id - g_can_node_offset;
+}
+
+// Initializes CAN1 and, when telemetry is routed to it, CAN2
+// Configures the outputs, enables the transmit buffers and TX complete
+// interrupts. The CAN1 filters accept only the given table IDs, at most 16.
+void can_bus_init(int16 * rx_ids, int8 n_rx_ids)
+{
+    unsigned int16 filter_ids[16];
+    int8 i;
+    
+    can_init();
+    for (i = 0 ; (i < n_rx_ids) && (i < 16) ; i++)
+    {
+        filter_ids[i] = can_bus_node_id(rx_ids[i]);
+    }
+    can_set_filters(filter_ids, i);
+    set_tris_f((get_tris_f()&0xFFFD)|0x01); // set F0 to CANRX, F1 to CANTX
+    for (i = 0 ; i < N_TX_BUFFERS ; i++)
+    {
+        can_enable_b_transfer(i);
+    }
+    can_enable_interrupts(TB);
+    
+#if TELEMETRY_ON_CAN2
+    can2_init();
+    set_tris_g((get_tris_g()&0xFFFD)|0x01); // set G0 to C2RX, G1 to C2TX
+    for (i = 0 ; i < N_TX_BUFFERS ; i++)
+    {
+        can2_enable_b_transfer(i);
+    }
+    can2_enable_interrupts(TB);
+#endif
+}
+
+// Claims a transmit buffer on the given bus, leaving reserve buffers free
+// Returns CAN_TX_NONE if no buffer could be claimed
+unsigned int8 can_bus_reserve(int8 bus, int8 reserve)
+{
+#if TELEMETRY_ON_CAN2
+    if (bus == CAN_BUS_2)
+    {
+        return can2_tx_reserve(reserve);
+    }
+#endif
+    return can_tx_reserve(reserve);
+}
+
+// Returns the payload of a buffer claimed with can_bus_reserve
+unsigned int8 * can_bus_payload(int8 bus, unsigned int8 port)
+{
+#if TELEMETRY_ON_CAN2
+    if (bus == CAN_BUS_2)
+    {
+        return can2_tx_payload(port);
+    }
+#endif
+    return can_tx_payload(port);
+}
+
+// Queues a buffer claimed with can_bus_reserve for transmission, the table
+// ID is offset for the node
+void can_bus_commit(int8 bus, unsigned int8 port, int16 id, int8 len)
+{
+    id = can_bus_node_id(id);
+#if TELEMETRY_ON_CAN2
+    if (bus == CAN_BUS_2)
+    {
+        can2_tx_commit(port, id, len, TX_PRI, TX_EXT, TX_RTR);
+        return;
+    }
+#endif
+    can_tx_commit(port, id, len, TX_PRI, TX_EXT, TX_RTR);
+}
+
+// Claims up to count transmit buffers on the given bus in one go, leaving
+// reserve buffers free. Returns the claimed buffers, bit n for buffer n, 0 if
+// none could be claimed.
+unsigned int8 can_bus_reserve_batch(int8 bus, int8 count, int8 reserve)
+{
+#if TELEMETRY_ON_CAN2
+    if (bus == CAN_BUS_2)
+    {
+        return can2_tx_reserve_batch(count, reserve);
+    }
+#endif
+    return can_tx_reserve_batch(count, reserve);
+}
+
+// Writes the ID and length of a buffer claimed with can_bus_reserve_batch,
+// the table ID is offset for the node
+void can_bus_load(int8 bus, unsigned int8 port, int16 id, int8 len)
+{
+    id = can_bus_node_id(id);
+#if TELEMETRY_ON_CAN2
+    if (bus == CAN_BUS_2)
+    {
+        can2_load_header(port, id, len, TX_EXT, TX_RTR);
+        return;
+    }
+#endif
+    can_load_header(port, id, len, TX_EXT, TX_RTR);
+}
+
+// Queues every loaded buffer claimed with can_bus_reserve_batch together
+void can_bus_commit_batch(int8 bus, unsigned int8 ports)
+{
+#if TELEMETRY_ON_CAN2
+    if (bus == CAN_BUS_2)
+    {
+        can2_tx_commit_batch(ports, TX_PRI);
+        return;
+    }
+#endif
+    can_tx_commit_batch(ports, TX_PRI);
+}
+
+// Copies and sends a frame on the given bus, returns false if no buffer was
+// free. The table ID is offset for the node.
+int1 can_bus_putd(int8 bus, int16 id, int8 * data, int8 len)
+{
+    id = can_bus_node_id(id);
+#if TELEMETRY_ON_CAN2
+    if (bus == CAN_BUS_2)
+    {
+        return can2_putd(id, data, len, TX_PRI, TX_EXT, TX_RTR);
+    }
+#endif
+    return can_putd(id, data, len, TX_PRI, TX_EXT, TX_RTR);
+}
+
+#endif
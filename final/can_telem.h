@@ -8,24 +8,66 @@
 // CAN BUS DEFINES ///////////
 //////////////////////////////
 
-#define EXPAND_AS_CAN_ID_ENUM(a,b,c,d)  a##_ID  = b,
-#define EXPAND_AS_CAN_LEN_ENUM(a,b,c,d) a##_LEN = c,
-#define EXPAND_AS_CAN_ID_ARRAY(a,b,c,d)           b,
-#define EXPAND_AS_CAN_LEN_ARRAY(a,b,c,d)          c,
-#define EXPAND_AS_DATA_ADDRESS_ARRAY(a,b,c,d)     d,
+// CAN1 carries the safety critical traffic. Setting TELEMETRY_ON_CAN2 moves
+// everything routed to CAN_BUS_TELEMETRY onto CAN2 (logger bus), otherwise
+// all traffic shares CAN1.
+#ifndef TELEMETRY_ON_CAN2
+#define TELEMETRY_ON_CAN2 0
+#endif
+
+#define CAN_BUS_1 1
+#define CAN_BUS_2 2
+
+#define CAN_BUS_SAFETY CAN_BUS_1
+#if TELEMETRY_ON_CAN2
+#define CAN_BUS_TELEMETRY CAN_BUS_2
+#else
+#define CAN_BUS_TELEMETRY CAN_BUS_1
+#endif
+
+// Several packs can share a bus: each BMS is a node and the IDs it owns go
+// out offset by node * CAN_NODE_STRIDE: the telemetry and status frames
+// (0x600-0x614), the PMS disconnect exchange and heartbeat (0x777-0x779), the
+// balancing command (0x77A) and the calibration write exchange (0x77B-0x77C),
+// so a node's PMS and ground station use its offset IDs. Every ID is a standard 11 bit one and must stay below 0x800
+// with the offset of the highest node, the ECAN filters and buffers drop the
+// bits above. CAN_NODE_SHARED entries belong to nodes that serve the whole
+// car and are used as is by every BMS: the time master's broadcasts, the
+// motor controller's drive command, the blinker's trip signal and the MPPT
+// responses. The node is CAN_NODE_ID unless the eeprom holds one, see
+// eeprom_read_node().
+#ifndef CAN_NODE_ID
+#define CAN_NODE_ID 0
+#endif
+#define N_CAN_NODES     4
+#define CAN_NODE_STRIDE 0x20 // Covers 0x600-0x61F
+#define CAN_NODE_LOCAL  0
+#define CAN_NODE_SHARED 1
+
+#define EXPAND_AS_CAN_ID_ENUM(a,b,c,d,e,f)  a##_ID  = b,
+#define EXPAND_AS_CAN_LEN_ENUM(a,b,c,d,e,f) a##_LEN = c,
+#define EXPAND_AS_CAN_ID_ARRAY(a,b,c,d,e,f)           b,
+#define EXPAND_AS_CAN_LEN_ARRAY(a,b,c,d,e,f)          c,
+#define EXPAND_AS_TELEM_FRAME_ARRAY(a,b,c,d,e,f)   {b, c, d, e, f},
 
 // X macro table of CANbus packets
-//        Packet name            ,    ID, Length
-#define CAN_ID_TABLE(ENTRY)                                              \
-    ENTRY(CAN_BPS_VOLTAGE1       , 0x600,  8, g_bps_voltage_page)        \
-    ENTRY(CAN_BPS_VOLTAGE2       , 0x601,  8, g_bps_voltage_page+8)      \
-    ENTRY(CAN_BPS_VOLTAGE3       , 0x602,  8, g_bps_voltage_page+16)     \
-    ENTRY(CAN_BPS_VOLTAGE4       , 0x603,  6, g_bps_voltage_page+24)     \
-    ENTRY(CAN_BPS_TEMPERATURE1   , 0x608,  8, g_bps_temperature_page)    \
-    ENTRY(CAN_BPS_TEMPERATURE2   , 0x609,  8, g_bps_temperature_page+8)  \
-    ENTRY(CAN_BPS_TEMPERATURE3   , 0x60A,  8, g_bps_temperature_page+16) \
-    ENTRY(CAN_BPS_CUR_BAL_STAT   , 0x60B,  8, g_bps_cur_bal_stat_page)
-#define N_CAN_ID 8
+// The payload builder writes the packet straight into the CAN transmit buffer,
+// starting at the given cell/thermistor index
+//        Packet name            ,    ID, Length, Payload builder        , First, Bus
+#define CAN_ID_TABLE(ENTRY)                                                                    \
+    ENTRY(CAN_BPS_TIME           , 0x604,  8, telem_fill_time         ,  0, CAN_BUS_TELEMETRY) \
+    ENTRY(CAN_BPS_VOLTAGE1       , 0x600,  8, telem_fill_voltage      ,  0, CAN_BUS_TELEMETRY) \
+    ENTRY(CAN_BPS_VOLTAGE2       , 0x601,  8, telem_fill_voltage      ,  8, CAN_BUS_TELEMETRY) \
+    ENTRY(CAN_BPS_VOLTAGE3       , 0x602,  8, telem_fill_voltage      , 16, CAN_BUS_TELEMETRY) \
+    ENTRY(CAN_BPS_VOLTAGE4       , 0x603,  6, telem_fill_voltage      , 24, CAN_BUS_TELEMETRY) \
+    ENTRY(CAN_BPS_TEMPERATURE1   , 0x608,  8, telem_fill_temperature  ,  0, CAN_BUS_TELEMETRY) \
+    ENTRY(CAN_BPS_TEMPERATURE2   , 0x609,  8, telem_fill_temperature  ,  8, CAN_BUS_TELEMETRY) \
+    ENTRY(CAN_BPS_TEMPERATURE3   , 0x60A,  8, telem_fill_temperature  , 16, CAN_BUS_TELEMETRY) \
+    ENTRY(CAN_BPS_CUR_BAL_STAT   , 0x60B,  8, telem_fill_cur_bal_stat ,  0, CAN_BUS_TELEMETRY) \
+    ENTRY(CAN_BPS_CELL_IR        , 0x60C,  8, telem_fill_ir           ,  0, CAN_BUS_TELEMETRY) \
+    ENTRY(CAN_BPS_LATENCY        , 0x611,  8, telem_fill_latency      ,  0, CAN_BUS_TELEMETRY) \
+    ENTRY(CAN_BPS_EVENTS         , 0x613,  8, telem_fill_events       ,  0, CAN_BUS_TELEMETRY)
+#define N_CAN_ID 12
 
 enum {CAN_ID_TABLE(EXPAND_AS_CAN_ID_ENUM)};
 enum {CAN_ID_TABLE(EXPAND_AS_CAN_LEN_ENUM)};
@@ -35,18 +77,16 @@ enum {CAN_ID_TABLE(EXPAND_AS_CAN_LEN_ENUM)};
 // TELEMETRY_DEFINES /////
 //////////////////////////
 
-#define EXPAND_AS_TELEM_ID_ENUM(a,b,c,d)  a##_ID  = b,
-#define EXPAND_AS_TELEM_LEN_ENUM(a,b,c,d) a##_LEN = c,
-#define EXPAND_AS_TELEM_LEN_ARRAY(a,b,c,d)          c,
-#define EXPAND_AS_TELEM_PAGE_ARRAY(a,b,c,d)         d,
-#define EXPAND_AS_TELEM_PAGE_DECLARATIONS(a,b,c,d) static int8 d[c];
+#define EXPAND_AS_TELEM_ID_ENUM(a,b,c)  a##_ID  = b,
+#define EXPAND_AS_TELEM_LEN_ENUM(a,b,c) a##_LEN = c,
+#define EXPAND_AS_TELEM_LEN_ARRAY(a,b,c)          c,
 
 // X macro table of telemetry packets
-//        Packet name            ,    ID, Length, Page array
-#define TELEM_ID_TABLE(ENTRY)                                          \
-    ENTRY(TELEM_BPS_VOLTAGE      ,  0x0B, 30, g_bps_voltage_page)      \
-    ENTRY(TELEM_BPS_TEMPERATURE  ,  0x0D, 24, g_bps_temperature_page)  \
-    ENTRY(TELEM_BPS_CUR_BAL_STAT ,  0x11,  8, g_bps_cur_bal_stat_page)
+//        Packet name            ,    ID, Length
+#define TELEM_ID_TABLE(ENTRY)                 \
+    ENTRY(TELEM_BPS_VOLTAGE      ,  0x0B, 30) \
+    ENTRY(TELEM_BPS_TEMPERATURE  ,  0x0D, 24) \
+    ENTRY(TELEM_BPS_CUR_BAL_STAT ,  0x11,  8)
 #define N_TELEM_ID 3
 
 enum {TELEM_ID_TABLE(EXPAND_AS_TELEM_ID_ENUM)};
@@ -57,22 +97,39 @@ enum {TELEM_ID_TABLE(EXPAND_AS_TELEM_LEN_ENUM)};
 // CAN COMMAND DEFINES ///////
 //////////////////////////////
 
-#define EXPAND_AS_MISC_ID_ENUM(a,b)  a##_ID  = b,
+#define EXPAND_AS_MISC_ID_ENUM(a,b,c,d)    a##_ID   = b,
+#define EXPAND_AS_MISC_BUS_ENUM(a,b,c,d)   a##_BUS  = c,
+#define EXPAND_AS_MISC_NODE_ENUM(a,b,c,d)  a##_NODE = d,
+#define EXPAND_AS_MISC_ID_ARRAY(a,b,c,d)             b,
+#define EXPAND_AS_MISC_NODE_ARRAY(a,b,c,d)           d,
 
 // X macro table of miscellaneous CANbus packets
-//        Packet name                   ,    ID
-#define CAN_MISC_TABLE(ENTRY)                    \
-    ENTRY(COMMAND_PMS_DISCONNECT_ARRAY  , 0x777) \
-    ENTRY(RESPONSE_PMS_DISCONNECT_ARRAY , 0x778) \
-    ENTRY(COMMAND_ENABLE_BALANCING      , 0x888) \
-    ENTRY(COMMAND_EVDC_DRIVE            , 0x501) \
-    ENTRY(COMMAND_BPS_TRIP_SIGNAL       , 0x303) \
-    ENTRY(RESPONSE_MPPT1                , 0x771) \
-    ENTRY(RESPONSE_MPPT2                , 0x772) \
-    ENTRY(RESPONSE_MPPT3                , 0x773) \
-    ENTRY(RESPONSE_MPPT4                , 0x774)
-#define N_CAN_MISC 9
+//        Packet name                   ,    ID, Bus              , Node
+#define CAN_MISC_TABLE(ENTRY)                                                     \
+    ENTRY(COMMAND_PMS_DISCONNECT_ARRAY  , 0x777, CAN_BUS_SAFETY   , CAN_NODE_LOCAL)  \
+    ENTRY(RESPONSE_PMS_DISCONNECT_ARRAY , 0x778, CAN_BUS_SAFETY   , CAN_NODE_LOCAL)  \
+    ENTRY(PMS_HEARTBEAT                 , 0x779, CAN_BUS_SAFETY   , CAN_NODE_LOCAL)  \
+    ENTRY(COMMAND_ENABLE_BALANCING      , 0x77A, CAN_BUS_SAFETY   , CAN_NODE_LOCAL)  \
+    ENTRY(COMMAND_CALIBRATION_WRITE     , 0x77B, CAN_BUS_SAFETY   , CAN_NODE_LOCAL)  \
+    ENTRY(RESPONSE_CALIBRATION_WRITE    , 0x77C, CAN_BUS_SAFETY   , CAN_NODE_LOCAL)  \
+    ENTRY(COMMAND_EVDC_DRIVE            , 0x501, CAN_BUS_SAFETY   , CAN_NODE_SHARED) \
+    ENTRY(COMMAND_BPS_TRIP_SIGNAL       , 0x303, CAN_BUS_SAFETY   , CAN_NODE_SHARED) \
+    ENTRY(RESPONSE_MPPT1                , 0x771, CAN_BUS_SAFETY   , CAN_NODE_SHARED) \
+    ENTRY(RESPONSE_MPPT2                , 0x772, CAN_BUS_SAFETY   , CAN_NODE_SHARED) \
+    ENTRY(RESPONSE_MPPT3                , 0x773, CAN_BUS_SAFETY   , CAN_NODE_SHARED) \
+    ENTRY(RESPONSE_MPPT4                , 0x774, CAN_BUS_SAFETY   , CAN_NODE_SHARED) \
+    ENTRY(BLACKBOX_DUMP                 , 0x610, CAN_BUS_TELEMETRY, CAN_NODE_LOCAL)  \
+    ENTRY(SOP_LIMITS                    , 0x60D, CAN_BUS_SAFETY   , CAN_NODE_LOCAL)  \
+    ENTRY(TREND_WARNING                 , 0x60E, CAN_BUS_SAFETY   , CAN_NODE_LOCAL)  \
+    ENTRY(FAULT_SUMMARY                 , 0x60F, CAN_BUS_TELEMETRY, CAN_NODE_LOCAL)  \
+    ENTRY(PEER_STATUS                   , 0x612, CAN_BUS_TELEMETRY, CAN_NODE_LOCAL)  \
+    ENTRY(BALANCE_PROGRESS              , 0x614, CAN_BUS_TELEMETRY, CAN_NODE_LOCAL)  \
+    ENTRY(TIMESYNC_SYNC                 , 0x080, CAN_BUS_SAFETY   , CAN_NODE_SHARED) \
+    ENTRY(TIMESYNC_FOLLOW_UP            , 0x081, CAN_BUS_SAFETY   , CAN_NODE_SHARED)
+#define N_CAN_MISC 20
 
 enum {CAN_MISC_TABLE(EXPAND_AS_MISC_ID_ENUM)};
+enum {CAN_MISC_TABLE(EXPAND_AS_MISC_BUS_ENUM)};
+enum {CAN_MISC_TABLE(EXPAND_AS_MISC_NODE_ENUM)};
 
 #endif
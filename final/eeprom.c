@@ -16,6 +16,8 @@
 #define UV_ADDRESS      0x04
 #define OT_ADDRESS      0x08
 #define CURRENT_ADDRESS 0x0B
+#define NODE_ADDRESS    0x10 // CAN node ID, see can_telem.h
+#define CAL_ADDRESS     0x20 // Calibration block, see calibration.c
 
 // The eeprom will store 4 bytes of error data
 #define N_ERROR_BYTES 4
@@ -23,6 +25,9 @@
 // The EEPROM takes 5ms to write data to memory
 #define WRITE_TIME_MS 5
 
+// A write wraps around within its 16 byte page
+#define EEPROM_PAGE_LEN 16
+
 #define EEPROM_SUCCESS 0xFF
 
 typedef enum
@@ -70,6 +75,64 @@ void eeprom_read(int8 * data)
     output_high(WP_PIN);
 }
 
+// Reads the CAN node ID, 0xFF if it was never programmed
+unsigned int8 eeprom_read_node(void)
+{
+    unsigned int8 node;
+    
+    output_low(WP_PIN);
+    i2c_start();
+    i2c_write(DEVICE_ADDRESS|I2C_WRITE_BIT);
+    i2c_write(NODE_ADDRESS);
+    i2c_start();
+    i2c_write(DEVICE_ADDRESS|I2C_READ_BIT);
+    node = i2c_read(0); // NOACK, stop
+    i2c_stop();
+    output_high(WP_PIN);
+    return node;
+}
+
+// Reads n bytes from an address with one sequential read
+void eeprom_read_bytes(unsigned int8 address, unsigned int8 * data, unsigned int8 n)
+{
+    unsigned int8 i;
+    
+    output_low(WP_PIN);
+    i2c_start();
+    i2c_write(DEVICE_ADDRESS|I2C_WRITE_BIT);
+    i2c_write(address);
+    i2c_start();
+    i2c_write(DEVICE_ADDRESS|I2C_READ_BIT);
+    for (i = 0 ; i < n ; i++)
+    {
+        data[i] = i2c_read(i < n - 1); // ACK all but the last, NOACK, stop
+    }
+    i2c_stop();
+    output_high(WP_PIN);
+}
+
+// Writes n bytes from an address, one page write for every page they touch
+void eeprom_write_bytes(unsigned int8 address, unsigned int8 * data, unsigned int8 n)
+{
+    unsigned int8 i = 0;
+    
+    while (i < n)
+    {
+        output_low(WP_PIN);
+        i2c_start();
+        i2c_write(DEVICE_ADDRESS|I2C_WRITE_BIT);
+        i2c_write(address);
+        do
+        {
+            i2c_write(data[i++]);
+            address++;
+        } while ((i < n) && (address % EEPROM_PAGE_LEN != 0));
+        i2c_stop();
+        output_high(WP_PIN);
+        delay_ms(WRITE_TIME_MS);
+    }
+}
+
 void eeprom_clear_memory(void)
 {
     // Write the error code
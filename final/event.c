@@ -0,0 +1,133 @@
+#ifndef EVENT_C
+#define EVENT_C
+
+// Receive event queue
+// isr_c1rx queues the commands and responses the state machine acts on, each
+// with its payload and receive time, and the main loop takes them in order.
+// There is one producer and one consumer: head is only written by the
+// interrupt and tail only by the main loop, both 8 bit so their writes are
+// atomic and neither side masks interrupts. An event is written before head
+// moves past it and read before tail does. The free running indices wrap at
+// 256, a multiple of N_EVENTS. A full queue drops the new event.
+// Every event taken is counted as handled, or as ignored when the state
+// machine was not in a state to act on it (a repeated command, a stray
+// response).
+//
+// Frame (CAN_BPS_EVENTS_ID), multiplexed with one event type per frame:
+//   byte 0   : type (event_type_t)
+//   byte 1   : most events ever queued at once, all types
+//   bytes 2-3: events handled, MSB first
+//   bytes 4-5: events ignored
+//   bytes 6-7: events dropped on a full queue
+// Counts wrap at 65536.
+
+#define N_EVENTS    8 // Power of 2
+#define EVENT_MASK  (N_EVENTS - 1)
+
+typedef enum
+{
+    EVENT_BALANCE = 0,      // COMMAND_ENABLE_BALANCING
+    EVENT_PMS_RESPONSE = 1, // RESPONSE_PMS_DISCONNECT_ARRAY
+    EVENT_CALIBRATION = 2,  // COMMAND_CALIBRATION_WRITE
+    N_EVENT_TYPES
+} event_type_t;
+
+typedef struct
+{
+    unsigned int8  type; // event_type_t
+    unsigned int8  len;
+    unsigned int8  data[8];
+    unsigned int64 time; // Receive time, timebase ticks
+} event_t;
+
+typedef struct
+{
+    event_t        queue[N_EVENTS];
+    unsigned int8  head;      // Next slot to write, interrupt only
+    unsigned int8  tail;      // Next event to take, main loop only
+    unsigned int8  max_depth; // Interrupt only
+    unsigned int16 handled[N_EVENT_TYPES]; // Main loop only
+    unsigned int16 ignored[N_EVENT_TYPES]; // Main loop only
+    unsigned int16 dropped[N_EVENT_TYPES]; // Interrupt only
+} event_queue_t;
+
+static event_queue_t g_event;
+
+// Queues an event from the interrupt, returns false if the queue was full
+int1 event_put(event_type_t type, unsigned int8 * data, int8 len, unsigned int64 time)
+{
+    event_t * event;
+    unsigned int8 depth = g_event.head - g_event.tail;
+    int8 i;
+    
+    if (depth >= N_EVENTS)
+    {
+        g_event.dropped[type]++;
+        return 0;
+    }
+    
+    event = &g_event.queue[g_event.head & EVENT_MASK];
+    event->type = type;
+    event->len = len;
+    for (i = 0 ; i < len ; i++)
+    {
+        event->data[i] = data[i];
+    }
+    event->time = time;
+    g_event.head++;
+    
+    if (depth + 1 > g_event.max_depth)
+    {
+        g_event.max_depth = depth + 1;
+    }
+    return 1;
+}
+
+// Returns the oldest queued event, or 0 if there is none. It stays queued
+// until event_done.
+event_t * event_peek(void)
+{
+    if (g_event.tail == g_event.head)
+    {
+        return 0;
+    }
+    return &g_event.queue[g_event.tail & EVENT_MASK];
+}
+
+// Counts the oldest event as handled or ignored and frees its slot
+void event_done(int1 b_handled)
+{
+    event_t * event = &g_event.queue[g_event.tail & EVENT_MASK];
+    
+    if (b_handled)
+    {
+        g_event.handled[event->type]++;
+    }
+    else
+    {
+        g_event.ignored[event->type]++;
+    }
+    g_event.tail++;
+}
+
+// Writes the counts of the next event type
+void event_fill(unsigned int8 * payload)
+{
+    static int8 type = 0;
+    
+    payload[0] = type;
+    payload[1] = g_event.max_depth;
+    payload[2] = (unsigned int8) (g_event.handled[type] >> 8);
+    payload[3] = (unsigned int8) (g_event.handled[type]);
+    payload[4] = (unsigned int8) (g_event.ignored[type] >> 8);
+    payload[5] = (unsigned int8) (g_event.ignored[type]);
+    payload[6] = (unsigned int8) (g_event.dropped[type] >> 8);
+    payload[7] = (unsigned int8) (g_event.dropped[type]);
+    
+    if (++type >= N_EVENT_TYPES)
+    {
+        type = 0;
+    }
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef FAULT_C
+#define FAULT_C
+
+// Pack fault summary
+// Keeps a bitmap of every channel for each fault class and state, so the
+// ground sees all cells, thermistors and the current at fault at once rather
+// than the one channel per class written to the eeprom. A state is:
+//   active : the channel's bad sample count is at N_BAD_SAMPLES
+//   latched: the channel has been active since start up
+//   warning: the channel is counting bad samples but is not yet active
+// The checks pass in the active and warning maps after each sweep, a map that
+// changes is queued and timer 4 sends one queued map per tick. All maps are
+// queued at start up.
+//
+// Frame (FAULT_SUMMARY_ID), multiplexed with one map per frame:
+//   byte 0   : state (fault_state_t)
+//   byte 1   : class (fault_class_t)
+//   bytes 2-5: map, bit n = cell n, thermistor n or bit 0 for the current,
+//              MSB first
+
+#define FAULT_SUMMARY_LEN 6
+
+typedef enum
+{
+    FAULT_ACTIVE = 0,
+    FAULT_LATCHED = 1,
+    FAULT_WARNING = 2,
+    N_FAULT_STATES
+} fault_state_t;
+
+typedef enum
+{
+    FAULT_OV = 0, // Cells
+    FAULT_UV = 1,
+    FAULT_OT = 2, // Thermistors
+    FAULT_WT = 3,
+    FAULT_OC = 4, // Pack current
+    FAULT_UC = 5,
+    N_FAULT_CLASSES
+} fault_class_t;
+
+typedef struct
+{
+    unsigned int32 map[N_FAULT_STATES][N_FAULT_CLASSES];
+    unsigned int8  pending[N_FAULT_STATES][N_FAULT_CLASSES]; // Set by the main loop, cleared by timer 4
+} fault_t;
+
+static fault_t g_fault;
+
+// Clears all maps and queues them to be sent
+void fault_init(void)
+{
+    int8 s;
+    int8 c;
+    
+    for (s = 0 ; s < N_FAULT_STATES ; s++)
+    {
+        for (c = 0 ; c < N_FAULT_CLASSES ; c++)
+        {
+            g_fault.map[s][c] = 0;
+            g_fault.pending[s][c] = 1;
+        }
+    }
+}
+
+// Stores a map and queues it if it changed
+void fault_set(fault_state_t state, fault_class_t fault_class, unsigned int32 map)
+{
+    if (g_fault.map[state][fault_class] != map)
+    {
+        g_fault.map[state][fault_class] = map;
+        g_fault.pending[state][fault_class] = 1;
+    }
+}
+
+// Updates a class from the active and warning maps of the latest sweep
+void fault_update(fault_class_t fault_class, unsigned int32 active, unsigned int32 warning)
+{
+    fault_set(FAULT_ACTIVE, fault_class, active);
+    fault_set(FAULT_LATCHED, fault_class, g_fault.map[FAULT_LATCHED][fault_class] | active);
+    fault_set(FAULT_WARNING, fault_class, warning);
+}
+
+// Returns true if any channel is counting bad samples
+int1 fault_warning(void)
+{
+    unsigned int32 map = 0;
+    int8 c;
+    
+    for (c = 0 ; c < N_FAULT_CLASSES ; c++)
+    {
+        map |= g_fault.map[FAULT_WARNING][c];
+    }
+    return map != 0;
+}
+
+// Sends the first queued map, returns false if none was queued or no transmit
+// buffer was free. The map is dequeued before it is read, so a change made
+// while it is sent queues it again.
+int1 fault_send(int8 reserve)
+{
+    int8 s;
+    int8 c;
+    unsigned int8 port;
+    unsigned int8 * payload;
+    unsigned int32 map;
+    
+    for (s = 0 ; s < N_FAULT_STATES ; s++)
+    {
+        for (c = 0 ; c < N_FAULT_CLASSES ; c++)
+        {
+            if (g_fault.pending[s][c])
+            {
+                port = can_bus_reserve(FAULT_SUMMARY_BUS, reserve);
+                if (port == CAN_TX_NONE)
+                {
+                    return 0;
+                }
+                
+                g_fault.pending[s][c] = 0;
+                map = g_fault.map[s][c];
+                payload = can_bus_payload(FAULT_SUMMARY_BUS, port);
+                payload[0] = s;
+                payload[1] = c;
+                payload[2] = (unsigned int8) (map >> 24);
+                payload[3] = (unsigned int8) (map >> 16);
+                payload[4] = (unsigned int8) (map >> 8);
+                payload[5] = (unsigned int8) (map);
+                can_bus_commit(FAULT_SUMMARY_BUS, port, FAULT_SUMMARY_ID, FAULT_SUMMARY_LEN);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+#endif
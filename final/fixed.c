@@ -0,0 +1,163 @@
+#ifndef FIXED_C
+#define FIXED_C
+
+// Q16.16 fixed point
+// Keeps the sensor conversions off the CCS soft float library. Results that
+// do not fit saturate at FIX_MAX or FIX_MIN instead of wrapping. Products and
+// quotients are worked out in 64 bits.
+//
+// The log and exp approximations interpolate 2^x and log2(x) linearly
+// between 16 table points over one octave, which is within 1e-3 of the true
+// value (relative for exp). bms_bench -e checks the bounds on the host.
+
+typedef signed int32 fix_t;
+
+#define FIX_ONE     0x00010000
+#define FIX_MAX     0x7FFFFFFF
+#define FIX_MIN     (-FIX_MAX - 1)
+#define FIX_LN2     45426      // ln(2)
+#define FIX_LOG2E   94548      // 1/ln(2)
+
+// Converts a constant to Q16.16 when compiling, rounding to nearest
+#define FIX_CONST(x) ((fix_t)((x) >= 0 ? (x) * 65536.0 + 0.5 : (x) * 65536.0 - 0.5))
+
+#define FIX_TABLE_SIZE  16     // Points per octave
+#define FIX_TABLE_SHIFT 12     // Fraction bits below the table index
+#define FIX_TABLE_MASK  0x0FFF
+
+// log2(1 + i/16) and 2^(i/16) for i = 0..16
+static const fix_t g_fix_log2[FIX_TABLE_SIZE + 1] =
+{
+        0,  5732, 11136, 16248, 21098, 25711, 30109, 34312, 38336,
+    42196, 45904, 49472, 52911, 56229, 59434, 62534, 65536
+};
+static const fix_t g_fix_exp2[FIX_TABLE_SIZE + 1] =
+{
+     65536,  68438,  71468,  74632,  77936,  81386,  84990,  88752,  92682,
+     96785, 101070, 105545, 110218, 115098, 120194, 125515, 131072
+};
+
+// Clamps a 64 bit result to Q16.16
+fix_t fix_saturate(signed int64 x)
+{
+    if (x > FIX_MAX)
+    {
+        return FIX_MAX;
+    }
+    if (x < FIX_MIN)
+    {
+        return FIX_MIN;
+    }
+    return (fix_t)x;
+}
+
+fix_t fix_from_int(signed int32 n)
+{
+    return fix_saturate((signed int64)n << 16);
+}
+
+// Rounds to the nearest integer, halves away from zero
+signed int32 fix_round(fix_t x)
+{
+    return (x >= 0) ? (x + 0x8000) >> 16 : -((0x8000 - x) >> 16);
+}
+
+fix_t fix_add(fix_t a, fix_t b)
+{
+    return fix_saturate((signed int64)a + b);
+}
+
+fix_t fix_sub(fix_t a, fix_t b)
+{
+    return fix_saturate((signed int64)a - b);
+}
+
+fix_t fix_mul(fix_t a, fix_t b)
+{
+    return fix_saturate(((signed int64)a * b) >> 16);
+}
+
+// Divides, saturating towards the sign of a when b is 0
+fix_t fix_div(fix_t a, fix_t b)
+{
+    if (b == 0)
+    {
+        return (a >= 0) ? FIX_MAX : FIX_MIN;
+    }
+    return fix_saturate(((signed int64)a << 16) / b);
+}
+
+// Scales an integer by a Q16.16 gain and rounds back to an integer, for
+// sensor codes to engineering units
+signed int32 fix_scale(signed int32 n, fix_t gain)
+{
+    signed int64 x = (signed int64)n * gain;
+    
+    return (signed int32)((x >= 0) ? (x + 0x8000) >> 16 : -((0x8000 - x) >> 16));
+}
+
+// Base 2 log, FIX_MIN for x <= 0
+fix_t fix_log2(fix_t x)
+{
+    signed int8 e = 0;
+    unsigned int8 i;
+    fix_t frac;
+    
+    if (x <= 0)
+    {
+        return FIX_MIN;
+    }
+    
+    // Bring x into [1, 2)
+    while (x >= 2*FIX_ONE)
+    {
+        x >>= 1;
+        e++;
+    }
+    while (x < FIX_ONE)
+    {
+        x <<= 1;
+        e--;
+    }
+    
+    // Interpolate between the table points either side of the fraction
+    frac = x & 0xFFFF;
+    i = frac >> FIX_TABLE_SHIFT;
+    frac &= FIX_TABLE_MASK;
+    return ((fix_t)e << 16) + g_fix_log2[i] + (((g_fix_log2[i+1] - g_fix_log2[i]) * frac) >> FIX_TABLE_SHIFT);
+}
+
+fix_t fix_ln(fix_t x)
+{
+    if (x <= 0)
+    {
+        return FIX_MIN;
+    }
+    return fix_mul(fix_log2(x), FIX_LN2);
+}
+
+// 2^x, saturating at FIX_MAX
+fix_t fix_exp2(fix_t x)
+{
+    signed int16 e = (signed int16)(x >> 16); // Rounded down
+    unsigned int8 i = (x & 0xFFFF) >> FIX_TABLE_SHIFT;
+    fix_t frac = x & FIX_TABLE_MASK;
+    fix_t m = g_fix_exp2[i] + (((g_fix_exp2[i+1] - g_fix_exp2[i]) * frac) >> FIX_TABLE_SHIFT);
+    
+    if (e >= 15)
+    {
+        return FIX_MAX;
+    }
+    if (e < -16)
+    {
+        return 0;
+    }
+    return (e >= 0) ? (m << e) : (m >> -e);
+}
+
+fix_t fix_exp(fix_t x)
+{
+    return fix_exp2(fix_mul(x, FIX_LOG2E));
+}
+
+#endif
@@ -3,7 +3,8 @@
 
 // Hall sensor parameters
 #define CURRENT_ZERO           2055
-#define CURRENT_SLOPE         12.64
+#define CURRENT_SLOPE_X100     1264 // 12.64 counts per A
+#define CURRENT_MA_PER_COUNT   FIX_CONST(100000.0 / CURRENT_SLOPE_X100)
 
 #define HALL_ADC_CHANNEL         24
 #define HALL_TEMPERATURE_CHANNEL 25
@@ -17,8 +18,8 @@ typedef struct
     unsigned int16 raw;
     unsigned int16 samples[N_CURRENT_SAMPLES];
     unsigned int16 average;
-    unsigned int8  oc_count; // Overcurrent error counter
-    unsigned int8  uc_count; // Undercurrent error counter
+    unsigned int8  oc_count; // Overcurrent error counter, saturating
+    unsigned int8  uc_count; // Undercurrent error counter, saturating
 } current_t;
 
 // Initializes the hall effect sensor interface
@@ -28,10 +29,11 @@ void hall_sensor_init(void)
     setup_adc_ports(HALL_ANALOG_PIN|HALL_TEMPERATURE_PIN);
 }
 
-// Returns the calibrated current value from the raw adc reading
-float hall_sensor_adjust_current(unsigned int16 raw_current)
+// Returns the calibrated current in mA from the raw adc reading, positive
+// when discharging
+signed int32 hall_sensor_adjust_current(unsigned int16 raw_current)
 {
-   return ((float)raw_current - CURRENT_ZERO)/CURRENT_SLOPE;
+    return fix_scale((signed int32)raw_current - CURRENT_ZERO, CURRENT_MA_PER_COUNT);
 }
 
 // Returns 1 if current_data is a positive current reading, 0 if negative
@@ -48,6 +50,26 @@ unsigned int16 hall_sensor_read_data(void)
     return((unsigned int16)(read_adc()));
 }
 
+// Selects the current channel so a conversion can be started without waiting
+// for the input to settle
+void hall_sensor_select(void)
+{
+    set_adc_channel(HALL_ADC_CHANNEL);
+    delay_us(10);
+}
+
+// Starts a current conversion on the selected channel
+void hall_sensor_start(void)
+{
+    read_adc(ADC_START_ONLY);
+}
+
+// Returns the result of the conversion started by hall_sensor_start
+unsigned int16 hall_sensor_result(void)
+{
+    return((unsigned int16)(read_adc(ADC_READ_ONLY)));
+}
+
 unsigned int16 hall_sensor_read_temperature(void)
 {
     set_adc_channel(HALL_TEMPERATURE_CHANNEL);
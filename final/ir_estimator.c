@@ -0,0 +1,96 @@
+#ifndef IR_ESTIMATOR_C
+#define IR_ESTIMATOR_C
+
+// Per-cell internal resistance estimator
+// Whenever the pack current steps between two cell voltage sweeps, each cell
+// gives a sample R = -dV/dI. The samples are smoothed with a constant gain
+// recursive filter in fixed point.
+
+// Units: cell voltage 1 bit = 0.1 mV, hall sensor 12.64 bits per amp, so
+// R [uOhm] = dV * 0.1 mV * 12.64 / dI = dV * 1264 / dI
+#define IR_UOHM_PER_BIT     1264
+#define IR_MIN_STEP          126 // Minimum current step, about 10 A
+#define IR_MAX_UOHM       100000 // Samples above 100 mOhm are treated as noise
+#define IR_GAIN_SHIFT          3 // Filter gain of 1/8
+#define IR_FRAC_BITS           4 // Estimates are kept in 1/16 uOhm
+
+typedef struct
+{
+    signed int32  estimate;  // uOhm << IR_FRAC_BITS
+    unsigned int8 n_samples; // Saturates at 255
+} ir_cell_t;
+
+static ir_cell_t      g_ir[N_CELLS];
+static unsigned int16 g_ir_voltage[N_CELLS]; // Cell voltages of the previous sweep
+static unsigned int16 g_ir_current;          // Current of the previous sweep
+static int1           gb_ir_primed = false;
+
+// Feeds one sweep of cell voltages and the matching current reading
+void ir_estimator_update(unsigned int16 * voltage, unsigned int16 current)
+{
+    signed int16 di;
+    signed int32 dv;
+    signed int32 r;
+    int i;
+    
+    if (gb_ir_primed)
+    {
+        // Current above CURRENT_ZERO is discharge, so the cell voltage drops
+        // as the reading rises
+        di = (signed int16)current - (signed int16)g_ir_current;
+        if ((di >= IR_MIN_STEP) || (di <= -IR_MIN_STEP))
+        {
+            for (i = 0 ; i < N_CELLS ; i++)
+            {
+                dv = (signed int32)g_ir_voltage[i] - (signed int32)voltage[i];
+                r = (dv * IR_UOHM_PER_BIT) / di;
+                if ((r <= 0) || (r >= IR_MAX_UOHM))
+                {
+                    // Not a plausible resistance, skip the sample
+                    continue;
+                }
+                
+                r <<= IR_FRAC_BITS;
+                if (g_ir[i].n_samples == 0)
+                {
+                    g_ir[i].estimate = r;
+                }
+                else
+                {
+                    g_ir[i].estimate += (r - g_ir[i].estimate) >> IR_GAIN_SHIFT;
+                }
+                if (g_ir[i].n_samples < 255)
+                {
+                    g_ir[i].n_samples++;
+                }
+            }
+        }
+    }
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_ir_voltage[i] = voltage[i];
+    }
+    g_ir_current = current;
+    gb_ir_primed = true;
+}
+
+// Returns the resistance estimate of a cell in uOhm, 0 if there is none yet
+unsigned int16 ir_estimator_get(int8 i)
+{
+    signed int32 r = g_ir[i].estimate >> IR_FRAC_BITS;
+    
+    if (r > 0xFFFF)
+    {
+        return 0xFFFF;
+    }
+    return (unsigned int16) r;
+}
+
+// Returns the number of samples behind the estimate of a cell
+unsigned int8 ir_estimator_samples(int8 i)
+{
+    return g_ir[i].n_samples;
+}
+
+#endif
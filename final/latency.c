@@ -0,0 +1,101 @@
+#ifndef LATENCY_C
+#define LATENCY_C
+
+// Command to action latency
+// A path is started with the receive time of the command and stopped when the
+// BMS has acted on it. The receive time is the newest IC2 capture when
+// isr_c1rx read the command (see timebase_rx_time), the end of the command
+// on the bus unless another frame followed it first, which takes the time
+// of that frame off the latency. With no usable capture it is the time
+// isr_c1rx read the command, and the interrupt latency is left out. Latencies are counted in a log2 histogram, bin k holds
+// latencies of 2^k to 2^(k+1)-1 us (bin 0 also holds 0 us) and the last bin
+// everything longer. Counts saturate at 65535.
+//
+// Frame (CAN_BPS_LATENCY_ID), multiplexed with 3 bins per frame:
+//   byte 0   : path (latency_path_t)
+//   byte 1   : first bin in the frame
+//   bytes 2-7: counts of the three bins, MSB first
+
+#define N_LATENCY_BINS       24 // Last bin starts at 2^23 us, about 8.4 s
+#define LATENCY_BINS_PER_FRAME 3
+
+typedef enum
+{
+    LATENCY_BALANCE = 0,    // COMMAND_ENABLE_BALANCING to the first balance config write
+    LATENCY_DISCONNECT = 1, // RESPONSE_PMS_DISCONNECT_ARRAY to the Kilovac opening
+    N_LATENCY
+} latency_path_t;
+
+typedef struct
+{
+    unsigned int64 start;   // Receive time of the command
+    int1           b_pending;
+    unsigned int16 bins[N_LATENCY_BINS];
+} latency_t;
+
+static latency_t g_latency[N_LATENCY];
+
+// Starts timing a path from the receive time of its command
+// A repeated command does not restart a path that is already running
+void latency_start(latency_path_t path, unsigned int64 rx_time)
+{
+    if (!g_latency[path].b_pending)
+    {
+        g_latency[path].start = rx_time;
+        g_latency[path].b_pending = true;
+    }
+}
+
+// Stops timing a path and counts the latency, does nothing if it was not started
+void latency_stop(latency_path_t path)
+{
+    unsigned int64 us;
+    int8 bin = 0;
+    
+    if (!g_latency[path].b_pending)
+    {
+        return;
+    }
+    
+    us = (timebase_ticks() - g_latency[path].start) / TIMEBASE_TICKS_PER_US;
+    while ((us > 1) && (bin < N_LATENCY_BINS-1))
+    {
+        us >>= 1;
+        bin++;
+    }
+    if (g_latency[path].bins[bin] < 0xFFFF)
+    {
+        g_latency[path].bins[bin]++;
+    }
+    g_latency[path].b_pending = false;
+}
+
+// Writes the next 3 bins of the histograms, cycling through every path
+void latency_fill(unsigned int8 * payload)
+{
+    static int8 path = 0;
+    static int8 first = 0;
+    unsigned int16 n;
+    int i;
+    
+    payload[0] = path;
+    payload[1] = first;
+    for (i = 0 ; i < LATENCY_BINS_PER_FRAME ; i++)
+    {
+        n = g_latency[path].bins[first+i];
+        payload[2+2*i] = (unsigned int8) (n >> 8);
+        payload[3+2*i] = (unsigned int8) (n);
+    }
+    
+    first += LATENCY_BINS_PER_FRAME;
+    if (first >= N_LATENCY_BINS)
+    {
+        first = 0;
+        if (++path >= N_LATENCY)
+        {
+            path = 0;
+        }
+    }
+}
+
+#endif
@@ -61,22 +61,30 @@ static int16 g_discharge1;
 static int16 g_discharge2;
 static int16 g_discharge3;
 
-// Struct for a cell
+// State of all cells as parallel arrays, so the loops over the cells walk
+// contiguous memory. Each cell keeps its sample history as a ring, head is
+// the oldest sample of every ring and the next one replaced.
 typedef struct
 {
-    unsigned int16 voltage; // LTC6804 has a 16 bit voltage ADC
-    unsigned int16 average_voltage;
-    unsigned int16 samples[N_VOLTAGE_SAMPLES];
-    unsigned int16 ov_count;
-    unsigned int16 uv_count;
-} cell_t;
+    unsigned int16 voltage[N_CELLS]; // LTC6804 has a 16 bit voltage ADC
+    unsigned int16 average_voltage[N_CELLS];
+    unsigned int8  ov_count[N_CELLS]; // Saturating, see COUNT_SAMPLE
+    unsigned int8  uv_count[N_CELLS];
+    unsigned int32 ov_faults;         // Bit per cell at N_BAD_SAMPLES
+    unsigned int32 uv_faults;
+    unsigned int16 samples[N_CELLS][N_VOLTAGE_SAMPLES];
+    unsigned int8  head;
+} cells_t;
 
 // Function prototypes
 void ltc6804_wakeup(void);
 void ltc6804_write_command(unsigned int16);
-void ltc6804_write_config(int16,int16);
+void ltc6804_write_config(int16);
 void ltc6804_init(void);
-void ltc6804_read_cell_voltages(cell_t *);
+void ltc6804_start_conversion(void);
+void ltc6804_read_cell_registers(unsigned int16 *);
+void ltc6804_read_cell_voltages(unsigned int16 *);
+unsigned int16 ltc6804_cell_mv(unsigned int16);
 
 void ltc6804_wakeup(void)
 {
@@ -120,7 +128,7 @@ void ltc6804_write_config(int16 data)
     bytes[4] = data&0x00FF;
     bytes[5] = (data&0xFF00)>>8;
     crc = pec15(bytes,6);
-
+    
     ltc6804_write_command(WRCFG);
     spi_write(CFGR0);
     spi_write(CFGR1);
@@ -152,26 +160,27 @@ void ltc6804_init(void)
     output_high(CSBI3);
 }
 
-// Receives a pointer to an array of cells, writes the cell voltage to each one
-void ltc6804_read_cell_voltages(cell_t * cell)
+// Starts the cell voltage adc conversion on all three LTCs at the same instant
+// The MISO lines are muxed, so the ADCV command can be broadcast with every
+// chip select low
+void ltc6804_start_conversion(void)
 {
-    int i;
-    int msb;
-    int lsb;
-    
-    // Start the cell voltage adc conversion
     output_low(CSBI1);
-    ltc6804_write_command(ADCV);
-    output_high(CSBI1);
     output_low(CSBI2);
-    ltc6804_write_command(ADCV);
-    output_high(CSBI2);
     output_low(CSBI3);
     ltc6804_write_command(ADCV);
+    output_high(CSBI1);
+    output_high(CSBI2);
     output_high(CSBI3);
-    
-    // Wait 500us for the conversion to complete
-    delay_us(500);
+}
+
+// Receives the array of cell voltages, writes the converted voltage of each
+// cell. The conversion must have been started beforehand
+void ltc6804_read_cell_registers(unsigned int16 * voltage)
+{
+    int i;
+    int msb;
+    int lsb;
     
     // Read data for cells 0-2 from LTC-1
     SELECT_LTC_1;
@@ -181,7 +190,7 @@ void ltc6804_read_cell_voltages(cell_t * cell)
     {
         lsb = spi_read(0xFF);
         msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
+        voltage[i] = (msb<<8)+lsb;
     }    
     spi_read(0xFF); // PEC1
     spi_read(0xFF); // PEC2
@@ -194,7 +203,7 @@ void ltc6804_read_cell_voltages(cell_t * cell)
     {
         lsb = spi_read(0xFF);
         msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
+        voltage[i] = (msb<<8)+lsb;
     }    
     spi_read(0xFF); // PEC1
     spi_read(0xFF); // PEC2
@@ -207,7 +216,7 @@ void ltc6804_read_cell_voltages(cell_t * cell)
     {
         lsb = spi_read(0xFF);
         msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
+        voltage[i] = (msb<<8)+lsb;
     }    
     spi_read(0xFF); // PEC1
     spi_read(0xFF); // PEC2
@@ -220,7 +229,7 @@ void ltc6804_read_cell_voltages(cell_t * cell)
     {
         lsb = spi_read(0xFF);
         msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
+        voltage[i] = (msb<<8)+lsb;
     }    
     spi_read(0xFF); // PEC1
     spi_read(0xFF); // PEC2
@@ -234,7 +243,7 @@ void ltc6804_read_cell_voltages(cell_t * cell)
     {
         lsb = spi_read(0xFF);
         msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
+        voltage[i] = (msb<<8)+lsb;
     }    
     spi_read(0xFF); // PEC1
     spi_read(0xFF); // PEC2
@@ -247,7 +256,7 @@ void ltc6804_read_cell_voltages(cell_t * cell)
     {
         lsb = spi_read(0xFF);
         msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
+        voltage[i] = (msb<<8)+lsb;
     }    
     spi_read(0xFF); // PEC1
     spi_read(0xFF); // PEC2
@@ -260,7 +269,7 @@ void ltc6804_read_cell_voltages(cell_t * cell)
     {
         lsb = spi_read(0xFF);
         msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
+        voltage[i] = (msb<<8)+lsb;
     }    
     spi_read(0xFF); // PEC1
     spi_read(0xFF); // PEC2
@@ -273,7 +282,7 @@ void ltc6804_read_cell_voltages(cell_t * cell)
     {
         lsb = spi_read(0xFF);
         msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
+        voltage[i] = (msb<<8)+lsb;
     }    
     spi_read(0xFF); // PEC1
     spi_read(0xFF); // PEC2
@@ -287,7 +296,7 @@ void ltc6804_read_cell_voltages(cell_t * cell)
     {
         lsb = spi_read(0xFF);
         msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
+        voltage[i] = (msb<<8)+lsb;
     }    
     spi_read(0xFF); // PEC1
     spi_read(0xFF); // PEC2
@@ -300,11 +309,28 @@ void ltc6804_read_cell_voltages(cell_t * cell)
     {
         lsb = spi_read(0xFF);
         msb = spi_read(0xFF);
-        cell[i].voltage = (msb<<8)+lsb;
+        voltage[i] = (msb<<8)+lsb;
     }    
     spi_read(0xFF); // PEC1
     spi_read(0xFF); // PEC2
     output_high(CSBI3);
 }
 
+// Receives the array of cell voltages, writes the voltage of each cell
+void ltc6804_read_cell_voltages(unsigned int16 * voltage)
+{
+    ltc6804_start_conversion();
+    
+    // Wait 500us for the conversion to complete
+    delay_us(500);
+    
+    ltc6804_read_cell_registers(voltage);
+}
+
+// Returns a cell voltage reading (1 bit = 0.1 mV) in mV, rounded
+unsigned int16 ltc6804_cell_mv(unsigned int16 voltage)
+{
+    return (unsigned int16)(((unsigned int32)voltage + 5) / 10);
+}
+
 #endif
@@ -8,15 +8,27 @@
 // Includes
 #include "main.h"
 #include "stdlib.h"
-#include "math.h"
+#include "fixed.c"
 #include "pec.c"
 #include "ltc6804.c"
 #include "adc.c"
 #include "lcd.c"
 #include "hall_sensor.c"
 #include "eeprom.c"
-#include "can_telem.h"
-#include "can_PIC24.c"
+#include "timebase.c"
+#include "can_bus.c"
+#include "calibration.c"
+#include "timesync.c"
+#include "uart_telem.c"
+#include "blackbox.c"
+#include "ir_estimator.c"
+#include "sop.c"
+#include "trend.c"
+#include "latency.c"
+#include "fault.c"
+#include "peer.c"
+#include "event.c"
+#include "balance.c"
 
 // Kilovac control
 #define KILOVAC_ON        \
@@ -29,69 +41,65 @@
     output_low(RX_LED);   \
     output_low(KVAC_PIN);
 
-// Protection limits
-#define VOLTAGE_MAX            42000 // 4.20V, 1 bit = 0.1 mV
-#define VOLTAGE_MIN            27500 // 2.75V, 1 bit = 0.1 mV
-#define TEMP_WARNING              60 // 60C charge limit
-#define TEMP_CRITICAL             70 // 70C discharge limit
-#define DISCHARGE_LIMIT_AMPS      65 // Current discharge limit (exiting the pack)
-#define CHARGE_LIMIT_AMPS         50 // Current charge limit (entering the pack)
-#define CURRENT_DISCHARGE_LIMIT CURRENT_ZERO+(CURRENT_SLOPE*DISCHARGE_LIMIT_AMPS)
-#define CURRENT_CHARGE_LIMIT    CURRENT_ZERO-(CURRENT_SLOPE*CHARGE_LIMIT_AMPS)
-
 // Delay periods
 #define HEARTBEAT_PERIOD_MS      500 // Status LED blink period
 #define TELEMETRY_PERIOD_MS      200 // Telemetry data sending period
-#define BALANCE_PERIOD_MS       2000 // Balancing discharge period
+#define UART_TELEM_PERIOD_MS      50 // UART telemetry frame period
+#define SOP_PERIOD_MS            100 // State of power limits sending period
 #define PMS_RESPONSE_TIMEOUT_MS 1000 // Timeout period for PMS response
 #define BALANCING_TIMEOUT_MS     500 // Timeout period for the balancing command
 #define MPPT_DELAY_MS            100 // MPPT turn off time
 #define BLINKER_WAIT_TIME_MS     100 // Time the blinker needs to process the trip signal
 
 // Misc defines
-#define BALANCE_THRESHOLD        500 // Voltage threshold for balancing to occur (BALANCE_THRESHOLD / 10) mV
 #define N_BAD_SAMPLES             30 // Number of bad data samples required to trip
 
-// CAN bus defines
-#define TX_PRI 3
-#define TX_EXT 0
-#define TX_RTR 0
+// Updates an 8 bit bad sample counter without branching. keep is 0xFF to
+// hold the count or 0x00 to clear it, bad is 1 to count the sample. The
+// counter holds at 255 instead of wrapping back under N_BAD_SAMPLES.
+#define COUNT_SAMPLE(count, keep, bad) \
+    (count) = ((count) & (keep)) + ((bad) & ((count) != 0xFF))
 
-// Sends a packet of telemetry data over CAN bus
-#define CAN_SEND_DATA_PACKET(i) \
-    can_putd(g_can_id[i],gp_can_data_address[i],g_can_len[i],TX_PRI,TX_EXT,TX_RTR)
+// Returns bit if the count has reached N_BAD_SAMPLES, 0 otherwise
+#define FAULT_BIT(count, bit) \
+    ((bit) & (0 - (unsigned int32)((count) >= N_BAD_SAMPLES)))
 
-// Creates an array of CAN packet IDs
-static int16 g_can_id[N_CAN_ID] =
-{
-    CAN_ID_TABLE(EXPAND_AS_CAN_ID_ARRAY)
-};
+// Returns bit if the count is between 1 and N_BAD_SAMPLES-1, 0 otherwise
+#define WARNING_BIT(count, bit) \
+    ((bit) & (0 - (unsigned int32)((unsigned int8)((count) - 1) < N_BAD_SAMPLES - 1)))
 
-// Creates an array of CAN packet lengths
-static int16 g_can_len[N_CAN_ID] =
-{
-    CAN_ID_TABLE(EXPAND_AS_CAN_LEN_ARRAY)
-};
+// CAN bus defines
+#define TX_SAFETY_RESERVE     1 // Transmit buffers telemetry leaves free for trip commands
 
-// Telemetry data pages
-TELEM_ID_TABLE(EXPAND_AS_TELEM_PAGE_DECLARATIONS)
+// Builds a telemetry payload in place, arguments are the payload, the first
+// cell/thermistor index and the payload length
+typedef void (*telem_fill_t)(unsigned int8 *, int8, int8);
 
-// Creates an array of CAN packet addresses
-static int * gp_can_data_address[N_CAN_ID] =
+typedef struct
 {
-    CAN_ID_TABLE(EXPAND_AS_DATA_ADDRESS_ARRAY)
-};
+    int16        id;
+    int8         len;
+    telem_fill_t fill;
+    int8         first;
+    int8         bus;
+} telem_frame_t;
 
-static cell_t         g_cell[N_CELLS];
-static temperature_t  g_temperature[N_ADC_CHANNELS];
+// A cell voltage sweep and the current sampled with the same trigger
+typedef struct
+{
+    unsigned int16 seq;     // Sweep number
+    unsigned int64 time;    // Time of the trigger, timebase ticks
+    unsigned int16 current; // Raw hall sensor reading
+} sweep_t;
+
+static cells_t        g_cells;
+static temperatures_t g_temperatures;
 static current_t      g_current;
 static int1           gb_connected;
-static int1           gb_balance_enable;
-static int1           gb_pms_response_received;
-static int1           gb_motor_connected;
-static int1           gb_mppt_connected;
 static bps_state_t    g_state;
 static unsigned int8  g_errors[N_ERROR_BYTES];
+static sweep_t        g_sweep;
+static unsigned int64 g_state_time; // Time of the last state transition, timebase ticks
 
 // Initializes voltage and temperature error counts, current, and other flags
 void main_init(void)
@@ -101,41 +109,47 @@ void main_init(void)
     // Resets average voltages and error counts
     for (i = 0 ; i < N_CELLS ; i++)
     {
-        g_cell[i].average_voltage  = 0;
-        g_cell[i].ov_count         = 0;
-        g_cell[i].uv_count         = 0;
+        g_cells.average_voltage[i]  = 0;
+        g_cells.ov_count[i]         = 0;
+        g_cells.uv_count[i]         = 0;
     }
     
     // Resets average temperatures and error counts
     for (i = 0 ; i < N_ADC_CHANNELS ; i++)
     {
-        g_temperature[i].average  = 0;
-        g_temperature[i].ot_count = 0;
-        g_temperature[i].wt_count = 0;
+        g_temperatures.average[i]  = 0;
+        g_temperatures.ot_count[i] = 0;
+        g_temperatures.wt_count[i] = 0;
     }
     
     // Resets average current and error counts
     g_current.average  = 0;
     g_current.oc_count = 0;
     g_current.uc_count = 0;
+    fault_init();
+    balance_init();
     
     gb_connected = false;
     g_state = SAFETY_CHECK;
 }
 
-// Returns the index for the lowest voltage cell
-int get_lowest_voltage_cell_index(void)
+// Starts the cell conversion with one broadcast ADCV and the current
+// conversion in the same instant, then reads back both results
+void sweep_capture(void)
 {
-    int i;
-    int lowest = 0;
-    for (i = 0 ; i < N_CELLS ; i++)
-    {
-        if (g_cell[i].voltage <= g_cell[lowest].voltage)
-        {
-            lowest = i;
-        }
-    }
-    return lowest;
+    hall_sensor_select();
+    
+    ltc6804_start_conversion();
+    hall_sensor_start();
+    g_sweep.time = timebase_ticks();
+    g_sweep.seq++;
+    
+    // Wait 500us for the conversion to complete
+    delay_us(500);
+    
+    g_sweep.current = hall_sensor_result();
+    ltc6804_read_cell_registers(g_cells.voltage);
+    calibration_apply_cells(g_cells.voltage);
 }
 
 // Use the simplified Steinhart-Hart equation to approximate temperatures
@@ -144,7 +158,7 @@ void convert_adc_data_to_temps(void)
     int i;
     for (i = 0; i < N_ADC_CHANNELS; i++)
     {
-        g_temperature[i].converted = thermistor_convert_data(g_temperature[i].average);
+        g_temperatures.converted[i] = thermistor_convert_data(g_temperatures.average[i]);
     }
 }
 
@@ -164,41 +178,54 @@ void disable_balancing(void)
     output_high(CSBI3);
 }
 
+// Replaces the oldest sample in each cell's ring with the latest voltage and
+// averages the cell over its ring
 void average_voltage(void)
 {
     int i;
     int j;
     unsigned int32 sum;
+    unsigned int16 * ring;
+    
     for (i = 0 ; i < N_CELLS ; i++)
     {
+        ring = g_cells.samples[i];
+        ring[g_cells.head] = g_cells.voltage[i];
         sum = 0;
-        for (j = 0 ; j < N_VOLTAGE_SAMPLES-1 ; j++)
+        for (j = 0 ; j < N_VOLTAGE_SAMPLES ; j++)
         {
-            sum += g_cell[i].samples[j];
-            g_cell[i].samples[j] = g_cell[i].samples[j+1];
+            sum += ring[j];
         }
-        sum += g_cell[i].voltage;
-        g_cell[i].samples[N_VOLTAGE_SAMPLES-1] = g_cell[i].voltage;
-        g_cell[i].average_voltage = (unsigned int16) (sum/N_VOLTAGE_SAMPLES);
+        g_cells.average_voltage[i] = (unsigned int16) (sum/N_VOLTAGE_SAMPLES);
+    }
+    if (++g_cells.head >= N_VOLTAGE_SAMPLES)
+    {
+        g_cells.head = 0;
     }
 }
 
+// Same for the thermistor readings
 void average_temperature(void)
 {
     int i;
     int j;
     unsigned int32 sum;
+    unsigned int16 * ring;
+    
     for (i = 0 ; i < N_ADC_CHANNELS ; i++)
     {
+        ring = g_temperatures.samples[i];
+        ring[g_temperatures.head] = g_temperatures.raw[i];
         sum = 0;
-        for (j = 0 ; j < N_TEMPERATURE_SAMPLES-1 ; j++)
+        for (j = 0 ; j < N_TEMPERATURE_SAMPLES ; j++)
         {
-            sum += g_temperature[i].samples[j];
-            g_temperature[i].samples[j] = g_temperature[i].samples[j+1];
+            sum += ring[j];
         }
-        sum += g_temperature[i].raw;
-        g_temperature[i].samples[N_TEMPERATURE_SAMPLES-1] = g_temperature[i].raw;
-        g_temperature[i].average = (unsigned int16) (sum/N_TEMPERATURE_SAMPLES);
+        g_temperatures.average[i] = (unsigned int16) (sum/N_TEMPERATURE_SAMPLES);
+    }
+    if (++g_temperatures.head >= N_TEMPERATURE_SAMPLES)
+    {
+        g_temperatures.head = 0;
     }
 }
 
@@ -216,178 +243,306 @@ void average_current(void)
     g_current.average = (unsigned int16) (sum/N_CURRENT_SAMPLES);
 }
 
-void update_voltage_data(void)
+void telem_fill_voltage(unsigned int8 * payload, int8 first, int8 len)
 {
     int i;
-    for (i = 0 ; i < N_CELLS ; i++)
+    for (i = 0 ; i < len ; i++)
     {
-        g_bps_voltage_page[i]   = (int8)(g_cell[i].average_voltage >> 8);
+        payload[i] = (int8)(g_cells.average_voltage[first+i] >> 8);
     }
 }
 
-void update_temperature_data(void)
+void telem_fill_temperature(unsigned int8 * payload, int8 first, int8 len)
 {
     int i;
-    for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+    for (i = 0 ; i < len ; i++)
     {
-        g_bps_temperature_page[i] = (unsigned int8) (g_temperature[i].converted);
+        payload[i] = (unsigned int8) (g_temperatures.converted[first+i] / 10);
     }
 }
 
-void update_cur_bal_stat_data(void)
+void telem_fill_cur_bal_stat(unsigned int8 * payload, int8 first, int8 len)
 {
-    // Current, balancing bits, and pack status are stored in the same CAN packet and telemetry page
+    // Current, balancing bits, and pack status are stored in the same CAN packet
     
     // BPMS CAN heartbeat bit
     static int1 b_heartbeat = 0;
     
     // Update current data
-    g_bps_cur_bal_stat_page[0] = (int8) ((g_current.average>>8)&0xFF);
-    g_bps_cur_bal_stat_page[1] = (int8) (g_current.average&0xFF);
+    payload[0] = (int8) ((g_current.average>>8)&0xFF);
+    payload[1] = (int8) (g_current.average&0xFF);
     
     // Update balancing bits
     int32 discharge = ((((int32)(g_discharge1))<< 0)&0x00000FFF)
                      |((((int32)(g_discharge2))<<12)&0x00FFF000)
                      |((((int32)(g_discharge3))<<24)&0x3F000000);
-    g_bps_cur_bal_stat_page[2] = (int8) (((int32)(discharge>> 24))&0xFF);
-    g_bps_cur_bal_stat_page[3] = (int8) (((int32)(discharge>> 16))&0xFF);
-    g_bps_cur_bal_stat_page[4] = (int8) (((int32)(discharge>>  8))&0xFF);
-    g_bps_cur_bal_stat_page[5] = (int8) (((int32)(discharge>>  0))&0xFF);
+    payload[2] = (int8) (((int32)(discharge>> 24))&0xFF);
+    payload[3] = (int8) (((int32)(discharge>> 16))&0xFF);
+    payload[4] = (int8) (((int32)(discharge>>  8))&0xFF);
+    payload[5] = (int8) (((int32)(discharge>>  0))&0xFF);
     
     // Update the pack status
-    g_bps_cur_bal_stat_page[6] = gb_connected;
+    payload[6] = gb_connected;
     
     // Update CAN heartbeat bit
-    g_bps_cur_bal_stat_page[7] = b_heartbeat;
+    payload[7] = b_heartbeat;
     b_heartbeat = !b_heartbeat;
 }
 
-int1 check_voltage(void)
+// Cell internal resistance, multiplexed with 3 cells per frame so each cell
+// is sent once every N_CELLS/3 telemetry periods
+// Byte 0: first cell, byte 1: fewest samples behind the three estimates,
+// bytes 2-7: resistance in uOhm, MSB first
+void telem_fill_ir(unsigned int8 * payload, int8 first, int8 len)
 {
+    static int8 group = 0;
+    int8 cell = first + 3*group;
+    unsigned int16 r;
+    unsigned int8 n;
     int i;
     
-    // Read the cell voltages, compute a moving average of each cell voltage
-    ltc6804_read_cell_voltages(g_cell);
-    average_voltage();
-    
-    for (i = 0 ; i < N_CELLS ; i++)
+    payload[0] = cell;
+    payload[1] = 255;
+    for (i = 0 ; i < 3 ; i++)
     {
-        if (g_cell[i].voltage >= VOLTAGE_MAX)
-        {
-            // Voltage is too high, increment the OV count
-            g_cell[i].ov_count++;
-        }
-        else if (g_cell[i].voltage <= VOLTAGE_MIN)
+        r = ir_estimator_get(cell+i);
+        n = ir_estimator_samples(cell+i);
+        if (n < payload[1])
         {
-            // Voltage is too low, increment the UV count
-            g_cell[i].uv_count++;
+            payload[1] = n;
         }
-        else
+        payload[2+2*i] = (unsigned int8) (r >> 8);
+        payload[3+2*i] = (unsigned int8) (r);
+    }
+    
+    if (++group >= N_CELLS/3)
+    {
+        group = 0;
+    }
+}
+
+// Timestamp of the telemetry set
+// Bytes 0-3: time the frame was built on the synchronised clock,
+// bytes 4-5: sweep number, bytes 6-7: age of that sweep, all times in us,
+// MSB first
+void telem_fill_time(unsigned int8 * payload, int8 first, int8 len)
+{
+    unsigned int64 now = timebase_ticks();
+    unsigned int32 now_us = (unsigned int32)(timesync_from_local(now) / TIMEBASE_TICKS_PER_US);
+    unsigned int32 age = (unsigned int32)((now - g_sweep.time) / TIMEBASE_TICKS_PER_US);
+    
+    if (age > 0xFFFF)
+    {
+        age = 0xFFFF;
+    }
+    
+    payload[0] = (unsigned int8) (now_us >> 24);
+    payload[1] = (unsigned int8) (now_us >> 16);
+    payload[2] = (unsigned int8) (now_us >>  8);
+    payload[3] = (unsigned int8) (now_us);
+    payload[4] = (unsigned int8) (g_sweep.seq >> 8);
+    payload[5] = (unsigned int8) (g_sweep.seq);
+    payload[6] = (unsigned int8) (age >> 8);
+    payload[7] = (unsigned int8) (age);
+}
+
+// Command latency histograms, see latency.c
+void telem_fill_latency(unsigned int8 * payload, int8 first, int8 len)
+{
+    latency_fill(payload);
+}
+
+// Receive event counts, see event.c
+void telem_fill_events(unsigned int8 * payload, int8 first, int8 len)
+{
+    event_fill(payload);
+}
+
+// Creates an array of CAN telemetry frames
+static telem_frame_t g_telem_frame[N_CAN_ID] =
+{
+    CAN_ID_TABLE(EXPAND_AS_TELEM_FRAME_ARRAY)
+};
+
+// Builds telemetry frames from frame i on, as many as share its bus and the
+// free transmit buffers allow, directly in buffers claimed together and
+// queues them together. Returns the number queued, 0 if no transmit buffer
+// was available.
+int8 telem_send_batch(int8 i)
+{
+    int8 bus = g_telem_frame[i].bus;
+    unsigned int8 ports;
+    unsigned int8 port;
+    int8 n = 0;
+    
+    while ((i + n < N_CAN_ID) && (g_telem_frame[i + n].bus == bus))
+    {
+        n++;
+    }
+    ports = can_bus_reserve_batch(bus, n, TX_SAFETY_RESERVE);
+    
+    n = 0;
+    for (port = 0 ; port < N_TX_BUFFERS ; port++)
+    {
+        if (ports & (1 << port))
         {
-            // Voltage is within the safe operating range, clear OV and UV counts
-            g_cell[i].ov_count = 0;
-            g_cell[i].uv_count = 0;
+            g_telem_frame[i + n].fill(can_bus_payload(bus, port), g_telem_frame[i + n].first, g_telem_frame[i + n].len);
+            can_bus_load(bus, port, g_telem_frame[i + n].id, g_telem_frame[i + n].len);
+            n++;
         }
+    }
+    can_bus_commit_batch(bus, ports);
+    return n;
+}
+
+// Returns the lowest channel set in a fault bitmap
+int8 first_fault(unsigned int32 faults)
+{
+    int8 i = 0;
+    
+    while (!(faults & 1))
+    {
+        faults >>= 1;
+        i++;
+    }
+    return i;
+}
+
+// Updates the OV and UV counts of every cell in one pass and sets the fault
+// bitmaps, the same work is done whatever the voltages so the cost of a
+// sweep is fixed. The lowest faulted cells are written to the eeprom.
+int1 check_voltage(void)
+{
+    int i;
+    unsigned int16 v;
+    unsigned int8 over;
+    unsigned int8 under;
+    unsigned int8 keep;
+    unsigned int32 bit = 1;
+    unsigned int32 ov_warnings = 0;
+    unsigned int32 uv_warnings = 0;
+    
+    // Read the cell voltages together with the current, compute a moving
+    // average of each cell voltage
+    sweep_capture();
+    average_voltage();
+    
+    g_cells.ov_faults = 0;
+    g_cells.uv_faults = 0;
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        // A sample out of the safe range counts up its counter and holds the
+        // other, one within the range clears both
+        v = g_cells.voltage[i];
+        over = (v >= VOLTAGE_MAX);
+        under = (v <= VOLTAGE_MIN);
+        keep = 0 - (over | under);
+        COUNT_SAMPLE(g_cells.ov_count[i], keep, over);
+        COUNT_SAMPLE(g_cells.uv_count[i], keep, under);
         
-        if (g_cell[i].ov_count >= N_BAD_SAMPLES)
-        {
-            // Too many OV errors, write OV error to eeprom and return false
-            eeprom_set_ov_error(i);
-            output_high(STATUS);
-            return 0;
-        }
-        else if (g_cell[i].uv_count >= N_BAD_SAMPLES)
-        {
-            // Too many UV errors, write UV error to eeprom and return false
-            eeprom_set_uv_error(i);
-            output_high(STATUS);
-            return 0;
-        }
-        else
-        {
-            // The voltage is within the safe range, continue checking cells
-        }
+        g_cells.ov_faults |= FAULT_BIT(g_cells.ov_count[i], bit);
+        g_cells.uv_faults |= FAULT_BIT(g_cells.uv_count[i], bit);
+        ov_warnings |= WARNING_BIT(g_cells.ov_count[i], bit);
+        uv_warnings |= WARNING_BIT(g_cells.uv_count[i], bit);
+        bit <<= 1;
     }
+    fault_update(FAULT_OV, g_cells.ov_faults, ov_warnings);
+    fault_update(FAULT_UV, g_cells.uv_faults, uv_warnings);
     
-    // All cells are within the safe range, return true
-    return 1;
+    if ((g_cells.ov_faults | g_cells.uv_faults) == 0)
+    {
+        // All cells are within the safe range, return true
+        return 1;
+    }
+    
+    // Too many OV or UV errors, write the errors to eeprom and return false
+    if (g_cells.ov_faults)
+    {
+        eeprom_set_ov_error(first_fault(g_cells.ov_faults));
+    }
+    if (g_cells.uv_faults)
+    {
+        eeprom_set_uv_error(first_fault(g_cells.uv_faults));
+    }
+    output_high(STATUS);
+    return 0;
 }
 
+// Same for the thermistors. A warning trips only while the pack is charging,
+// PMS will monitor the battery temperatures and disconnect the array when
+// the battery temperature is approaching the warning point.
 int1 check_temperature(void)
 {
     int i;
+    signed int16 t;
+    unsigned int8 critical;
+    unsigned int8 warning;
+    unsigned int32 bit = 1;
+    unsigned int32 faults;
+    unsigned int32 ot_warnings = 0;
+    unsigned int32 wt_warnings = 0;
     
     // Find highest temperature reading
-    ads7952_read_all_channels(g_temperature);
+    ads7952_read_all_channels(g_temperatures.raw);
+    calibration_apply_thermistors(g_temperatures.raw);
     average_temperature();
     convert_adc_data_to_temps();
     
+    g_temperatures.ot_faults = 0;
+    g_temperatures.wt_faults = 0;
     for (i = 0 ; i < N_ADC_CHANNELS ; i++)
     {
-        if (g_temperature[i].converted >= TEMP_CRITICAL)
-        {
-            // Temperature is critical, increment the OT count
-            g_temperature[i].ot_count++;
-        }
-        else if (g_temperature[i].converted >= TEMP_WARNING)
-        {
-            // Temperature is above the warning threshold, increment the WT count
-            g_temperature[i].wt_count++;
-        }
-        else
-        {
-            // Temperature is within the safe range, clear the error counts
-            g_temperature[i].ot_count = 0;
-            g_temperature[i].wt_count = 0;
-        }
+        // A critical sample counts OT, a warning one WT, either holds the
+        // other counter and one below the warning point clears both
+        t = g_temperatures.converted[i];
+        critical = (t >= TEMP_CRITICAL*10);
+        warning = (t >= TEMP_WARNING*10);
+        COUNT_SAMPLE(g_temperatures.ot_count[i], 0 - warning, critical);
+        COUNT_SAMPLE(g_temperatures.wt_count[i], 0 - warning, warning & !critical);
         
-        if (g_temperature[i].ot_count >= N_BAD_SAMPLES)
-        {
-            // Too many OT errors, write OT error to eeprom and return false
-            eeprom_set_ot_error(i);
-            return 0;
-        }
-        else if ((g_temperature[i].wt_count >= N_BAD_SAMPLES) && (g_current.raw <= CURRENT_ZERO))
-        {
-            // Too many temperature warning errors and the pack is charging
-            // Write OT error to the eeprom and return false
-            // PMS will monitor the battery temperatures and disconnect the array
-            // when the battery temperature is approaching the warning point
-            eeprom_set_ot_error(i);
-            return 0;
-        }
-        else
-        {
-            // The temperature is within the safe range, continue checking
-        }
+        g_temperatures.ot_faults |= FAULT_BIT(g_temperatures.ot_count[i], bit);
+        g_temperatures.wt_faults |= FAULT_BIT(g_temperatures.wt_count[i], bit);
+        ot_warnings |= WARNING_BIT(g_temperatures.ot_count[i], bit);
+        wt_warnings |= WARNING_BIT(g_temperatures.wt_count[i], bit);
+        bit <<= 1;
+    }
+    fault_update(FAULT_OT, g_temperatures.ot_faults, ot_warnings);
+    fault_update(FAULT_WT, g_temperatures.wt_faults, wt_warnings);
+    
+    faults = g_temperatures.ot_faults;
+    if (g_current.raw <= CURRENT_ZERO)
+    {
+        faults |= g_temperatures.wt_faults;
+    }
+    if (faults == 0)
+    {
+        // All temperature values are within the safe range, return true
+        return 1;
     }
     
-    // All temperature values are within the safe range, return true
-    return 1;
+    // Too many OT or charging WT errors, write OT error to eeprom and return false
+    eeprom_set_ot_error(first_fault(faults));
+    return 0;
 }
 
 int1 check_current(void)
 {
-    // Read the pack current
-    g_current.raw = hall_sensor_read_data();
+    unsigned int8 over;
+    unsigned int8 under;
+    unsigned int8 keep;
+    
+    // Use the pack current sampled with the last cell sweep
+    g_current.raw = g_sweep.current;
     average_current();
     
-    if (g_current.raw >= CURRENT_DISCHARGE_LIMIT)
-    {
-        // Current is above the allowed discharge limit
-        g_current.oc_count++;
-    }
-    else if (g_current.raw <= CURRENT_CHARGE_LIMIT)
-    {
-        // Current is below the allowed charge limit
-        g_current.uc_count++;
-    }
-    else
-    {
-        // current is fine
-        g_current.oc_count = 0;
-        g_current.uc_count = 0;
-    }
+    // Current above the discharge limit counts OC, below the charge limit UC
+    over = (g_current.raw >= CURRENT_DISCHARGE_LIMIT);
+    under = (g_current.raw <= CURRENT_CHARGE_LIMIT);
+    keep = 0 - (over | under);
+    COUNT_SAMPLE(g_current.oc_count, keep, over);
+    COUNT_SAMPLE(g_current.uc_count, keep, under);
+    fault_update(FAULT_OC, FAULT_BIT(g_current.oc_count, 1), WARNING_BIT(g_current.oc_count, 1));
+    fault_update(FAULT_UC, FAULT_BIT(g_current.uc_count, 1), WARNING_BIT(g_current.uc_count, 1));
     
     if (g_current.oc_count >= N_BAD_SAMPLES)
     {
@@ -411,7 +566,7 @@ int1 check_current(void)
 // Reads error data from the eeprom and displays it on the lcd
 void display_errors(void)
 {
-    char str[3];
+    char str[4]; // Up to "255"
     
     lcd_init();
     
@@ -446,15 +601,14 @@ void display_errors(void)
     }
 }
 
-// Timer 2 blinks heartbeat LED, checks for status of LCD
-#int_timer2 level = 4
-void isr_timer2(void)
+// Checks for status of LCD, called from the main loop
+// The debounce and the LCD writes take hundreds of milliseconds, far too
+// long for an interrupt on the level of the CAN receive capture
+void update_lcd(void)
 {
-    static int8 i;
+    int8 i;
     static int1 b_lcd_connected = false;
     
-    output_toggle(STATUS);
-    
     // If the LCD is connected, display errors
     if ((input_state(LCD_SIG) == 1) && (b_lcd_connected == false))
     {
@@ -478,32 +632,96 @@ void isr_timer2(void)
     }
 }
 
-// Timer 4 sends telemetry data over CANbus
+// Timer 1 blinks heartbeat LED
+#ifndef HOST_BUILD
+#int_timer1 level = 4
+#endif
+void isr_timer1(void)
+{
+    output_toggle(STATUS);
+}
+
+// Timer 3 extends the 32 bit timebase to 64 bits
+#ifndef HOST_BUILD
+#int_timer3 level = 6
+#endif
+void isr_timer3(void)
+{
+    g_timebase_high++;
+}
+
+// Timer 4 sends the state of power limits and telemetry data over CANbus
+// and the UART
+#ifndef HOST_BUILD
 #int_timer4 level = 4
+#endif
 void isr_timer4(void)
 {
     static int16 ms = 0;
+    static int16 uart_ms = 0;
+    static int16 sop_ms = 0;
+    static int16 peer_ms = 0;
     static int8  i = 0;
+    int8 n;
     
-    if ((ms >= TELEMETRY_PERIOD_MS) && can_tbe())
+    if (sop_ms >= SOP_PERIOD_MS)
     {
-        ms = 0;
-        output_toggle(TX_LED);
-        
-        // Update telemetry data pages
-        update_voltage_data();
-        update_temperature_data();
-        update_cur_bal_stat_data();
+        // If no transmit buffer is free, try again on the next tick
+        if (sop_send(TX_SAFETY_RESERVE))
+        {
+            sop_ms = 0;
+        }
+    }
+    else
+    {
+        sop_ms++;
+    }
+    
+    if (peer_ms >= PEER_CHECK_MS)
+    {
+        // If the status frame is due and no transmit buffer is free, try
+        // again on the next tick
+        if (peer_check(timebase_ticks(), TX_SAFETY_RESERVE))
+        {
+            peer_ms = 0;
+        }
+    }
+    else
+    {
+        peer_ms++;
+    }
+    
+    // Send one changed fault map per tick
+    fault_send(TX_SAFETY_RESERVE);
+    
+    if (++uart_ms >= UART_TELEM_PERIOD_MS)
+    {
+        uart_ms = 0;
+        uart_telem_send(&g_cells, &g_temperatures, &g_current, gb_connected,
+                        g_sweep.time, g_state_time);
+    }
+    
+    if (ms >= TELEMETRY_PERIOD_MS)
+    {
+        if (i == 0)
+        {
+            // Start of a telemetry period
+            output_toggle(TX_LED);
+        }
         
-        // Send a packet of CAN data
-        CAN_SEND_DATA_PACKET(i);
-        if (i == (N_CAN_ID-1))
+        // Queue as much of the telemetry set as the free transmit buffers
+        // allow, a batch per run of frames on one bus, the rest is queued
+        // on the next tick
+        n = 1;
+        while ((i < N_CAN_ID) && (n > 0))
         {
-            i = 0;
+            n = telem_send_batch(i);
+            i += n;
         }
-        else
+        if (i >= N_CAN_ID)
         {
-            i++;
+            i = 0;
+            ms = 0;
         }
     }
     else
@@ -512,35 +730,99 @@ void isr_timer4(void)
     }
 }
 
+// CAN1 event interrupt, returns transmit buffers to the free pool once sent
+#ifndef HOST_BUILD
+#int_can1 level = 5
+#endif
+void isr_can1(void)
+{
+    can_tx_complete();
+}
+
+#if TELEMETRY_ON_CAN2
+// CAN2 event interrupt, returns transmit buffers to the free pool once sent
+#ifndef HOST_BUILD
+#int_can2 level = 5
+#endif
+void isr_can2(void)
+{
+    can2_tx_complete();
+}
+#endif
+
+// Table IDs of the frames isr_c1rx handles, the only ones the CAN1 filters
+// accept
+#define N_CAN_RX_IDS 11
+static int16 g_can_rx_id[N_CAN_RX_IDS] =
+{
+    TIMESYNC_SYNC_ID,
+    TIMESYNC_FOLLOW_UP_ID,
+    COMMAND_ENABLE_BALANCING_ID,
+    COMMAND_CALIBRATION_WRITE_ID,
+    RESPONSE_PMS_DISCONNECT_ARRAY_ID,
+    PMS_HEARTBEAT_ID,
+    COMMAND_EVDC_DRIVE_ID,
+    RESPONSE_MPPT1_ID,
+    RESPONSE_MPPT2_ID,
+    RESPONSE_MPPT3_ID,
+    RESPONSE_MPPT4_ID,
+};
+
 // C1RX triggers when data is received on the CAN bus
+#ifndef HOST_BUILD
 #int_c1rx
+#endif
 void isr_c1rx(void)
 {
     struct rx_stat rxstat;
     int32  rx_id;
     int8   rx_len;
     int8   in_data[8];
+    unsigned int64 rx_time;
     
     if (can_getd(rx_id, in_data, rx_len, rxstat))
     {
-        // Data was received, raise a flag corresponding to the data received
-        switch(rx_id)
+        // Use the hardware capture of the reception when there is a
+        // usable one
+        rx_time = timebase_rx_time(rxstat.stamped, rxstat.timestamp);
+        
+        // Data was received, queue the commands for the main loop and
+        // handle the rest here
+        switch(can_bus_table_id(rx_id))
         {
+            case TIMESYNC_SYNC_ID:
+                timesync_sync(in_data, rx_time);
+                break;
+            case TIMESYNC_FOLLOW_UP_ID:
+                timesync_follow_up(in_data);
+                break;
             case COMMAND_ENABLE_BALANCING_ID:
-                gb_balance_enable = true;
+                event_put(EVENT_BALANCE, in_data, rx_len, rx_time);
+                break;
+            case COMMAND_CALIBRATION_WRITE_ID:
+                event_put(EVENT_CALIBRATION, in_data, rx_len, rx_time);
                 break;
             case RESPONSE_PMS_DISCONNECT_ARRAY_ID:
-                gb_pms_response_received = true;
+                event_put(EVENT_PMS_RESPONSE, in_data, rx_len, rx_time);
+                peer_heard(PEER_PMS, rx_time);
+                break;
+            case PMS_HEARTBEAT_ID:
+                peer_heard(PEER_PMS, rx_time);
                 break;
             case COMMAND_EVDC_DRIVE_ID:
-                gb_motor_connected = true;
+                peer_heard(PEER_MOTOR, rx_time);
                 break;
-            // If any of the MPPTs respond, raise the flag
             case RESPONSE_MPPT1_ID:
+                peer_heard(PEER_MPPT1, rx_time);
+                break;
             case RESPONSE_MPPT2_ID:
+                peer_heard(PEER_MPPT2, rx_time);
+                break;
             case RESPONSE_MPPT3_ID:
+                peer_heard(PEER_MPPT3, rx_time);
+                break;
             case RESPONSE_MPPT4_ID:
-                gb_mppt_connected = true;
+                peer_heard(PEER_MPPT4, rx_time);
                 break;
             default:
                 break;
@@ -548,85 +830,116 @@ void isr_c1rx(void)
     }
 }
 
+// Takes every queued event without acting on it
+void ignore_events(void)
+{
+    while (event_peek() != 0)
+    {
+        event_done(false);
+    }
+}
+
 void safety_check_state(void)
 {
     int1 b_success = true;
+    event_t * event;
+    unsigned int32 now_ms = (unsigned int32)timebase_ms();
     
     b_success &= check_voltage();
     b_success &= check_temperature();
     b_success &= check_current();
     
-    if (b_success == true)
-    {
-        if (gb_balance_enable == true)
-        {
-            // All parameters within safe range, balance the cells
-            gb_balance_enable = false;
-            g_state = BEGIN_BALANCE;
-        }
-        else
-        {
-            // Balancing disabled, continue monitoring cell status
-            g_state = SAFETY_CHECK;
-        }
-    }
-    else
+    blackbox_record(g_cells.voltage, g_temperatures.converted, &g_current, gb_connected,
+                    (unsigned int16)(g_sweep.time / TIMEBASE_TICKS_PER_MS));
+    ir_estimator_update(g_cells.voltage, g_sweep.current);
+    sop_update(g_cells.voltage, g_temperatures.converted, g_sweep.current);
+    
+    // Warn the PMS when a limit is predicted to be reached soon
+    if (trend_update(g_cells.average_voltage, g_temperatures.converted, now_ms) && (g_trend.flags != 0))
     {
-        // Something went wrong, signal PMS to disconnect the array
-        // Wait for response
-        can_putd(COMMAND_PMS_DISCONNECT_ARRAY_ID,0,0,TX_PRI,TX_EXT,TX_RTR);
-        g_state = PMS_RESPONSE_PENDING;
+        trend_send();
     }
-}
-
-void begin_balance_state(void)
-{
-    int i;
-    int lowest = get_lowest_voltage_cell_index();
     
-    for (i = 0 ; i < 12 ; i++)
+    if (b_success == true)
     {
-        if ((g_cell[i].average_voltage - g_cell[lowest].average_voltage)
-            > BALANCE_THRESHOLD)
+        // All parameters within safe range, take the balancing and
+        // calibration commands that came in since the last check
+        while ((event = event_peek()) != 0)
         {
-            g_discharge1 |= 1 << i;
+            if ((event->type == EVENT_BALANCE) && balance_command(event->data, event->len, now_ms))
+            {
+                if (g_balance.status == BALANCE_RUNNING)
+                {
+                    latency_start(LATENCY_BALANCE, event->time);
+                }
+                event_done(true);
+            }
+            else if (event->type == EVENT_CALIBRATION)
+            {
+                event_done(calibration_write(event->data, event->len));
+            }
+            else
+            {
+                // A repeated command or a response nothing is waiting for
+                event_done(false);
+            }
         }
-        else
+        
+        // Run the next cycle of the balancing session when one is due,
+        // otherwise continue monitoring cell status
+        if (fault_warning())
         {
-            g_discharge1 &= ~(1 << i);
+            balance_hold();
         }
-    }
-
-    for (i = 12 ; i < 24 ; i++)
-    {
-        if ((g_cell[i].average_voltage - g_cell[lowest].average_voltage)
-            > BALANCE_THRESHOLD)
+        if (balance_due(g_cells.average_voltage, now_ms))
         {
-            g_discharge2 |= 1 << (i - 12);
+            g_state = BEGIN_BALANCE;
         }
         else
         {
-            g_discharge2 &= ~(1 << (i - 12));
+            g_state = SAFETY_CHECK;
         }
     }
-    
-    for (i = 24 ; i < 30 ; i++)
+    else
     {
-        if ((g_cell[i].average_voltage - g_cell[lowest].average_voltage)
-            > BALANCE_THRESHOLD)
+        // Something went wrong, keep the lead-up in the black box,
+        // signal PMS to disconnect the array and wait for response
+        // A PMS that has stopped sending heartbeats will not answer, so
+        // disconnect the pack straight away
+        blackbox_freeze();
+        CAN_SEND_COMMAND(COMMAND_PMS_DISCONNECT_ARRAY);
+        balance_stop(BALANCE_TRIPPED);
+        if (peer_state(PEER_PMS) == PEER_DEAD)
         {
-            g_discharge3 |= 1 << (i - 24);
+            g_state = DISCONNECT_PACK;
         }
         else
         {
-            g_discharge3 &= ~(1 << (i - 24));
+            g_state = PMS_RESPONSE_PENDING;
         }
     }
+}
+
+// Sets the discharge bits of the cells the balancing session picks and
+// clears the rest
+void balance_update_masks(void)
+{
+    unsigned int32 mask = balance_select(g_cells.average_voltage);
+    
+    g_discharge1 = (int16) (mask & 0x0FFF);
+    g_discharge2 = (int16) ((mask >> 12) & 0x0FFF);
+    g_discharge3 = (int16) ((mask >> 24) & 0x003F);
+}
+
+void begin_balance_state(void)
+{
+    balance_update_masks();
     
     // Enable/disable the discharge pins on the LTC6804
     output_low(CSBI1);
     ltc6804_write_config(g_discharge1);
     output_high(CSBI1);
+    latency_stop(LATENCY_BALANCE);
     output_low(CSBI2);
     ltc6804_write_config(g_discharge2);
     output_high(CSBI2);
@@ -643,9 +956,11 @@ void balancing_state(void)
     
     if (balance_time_ms >= BALANCE_PERIOD_MS)
     {
-        // Balancing period over, disable balancing
+        // Balancing period over, disable balancing and rest before the next
+        // cycle
         balance_time_ms = 0;
         disable_balancing();
+        balance_cycle_done();
         g_state = SAFETY_CHECK;
     }
     else
@@ -660,17 +975,26 @@ void balancing_state(void)
 void pms_response_pending_state(void)
 {
     static int16 timeout_ms = 0;
+    event_t * event;
+    
+    // No balancing while the pack is in fault, take the commands queued
+    // ahead of the response so they cannot hold off the timeout
+    while (((event = event_peek()) != 0) && (event->type != EVENT_PMS_RESPONSE))
+    {
+        event_done(false);
+    }
     
     if (timeout_ms >= PMS_RESPONSE_TIMEOUT_MS)
     {
         // Response timed out, proceed to disconnect pack
         g_state = DISCONNECT_PACK;
     }
-    else if (gb_pms_response_received == true)
+    else if (event != 0)
     {
         // Response received from PMS, disconnect the pack
         timeout_ms = 0;
-        gb_pms_response_received = false;
+        latency_start(LATENCY_DISCONNECT, event->time);
+        event_done(true);
         g_state = DISCONNECT_PACK;
     }
     else
@@ -684,34 +1008,50 @@ void pms_response_pending_state(void)
 
 void disconnect_pack_state(void)
 {
+    ignore_events();
     delay_ms(MPPT_DELAY_MS);
     eeprom_write_errors();
-    can_putd(COMMAND_BPS_TRIP_SIGNAL_ID,0,0,TX_PRI,TX_EXT,TX_RTR);
+    CAN_SEND_COMMAND(COMMAND_BPS_TRIP_SIGNAL);
     delay_ms(BLINKER_WAIT_TIME_MS); // Wait a bit for the blinker to process the trip signal
     KILOVAC_OFF;
+    latency_stop(LATENCY_DISCONNECT);
+    
+    // The contactor is open, dump as much of the black box as the free
+    // transmit buffers take and go on with the rest on the next pass
+    blackbox_dump(TX_SAFETY_RESERVE);
 }
 
 // Main
 void main()
 {
     int8 i;
+    bps_state_t last_state = N_STATES;
     
     // Kilovac is initially disabled
     KILOVAC_OFF;
     
-    // Read back any errors from the eeprom
+    // Read back any errors and the calibration from the eeprom
     eeprom_read(g_errors);
+    calibration_load();
+    
+    // Start the timebase on timers 2 and 3
+    timebase_init();
+    enable_interrupts(INT_TIMER3);
     
-    // Set up and enable timer 2 with a period of HEARTBEAT_PERIOD_MS
-    setup_timer2(TMR_INTERNAL|TMR_DIV_BY_256,39*HEARTBEAT_PERIOD_MS);
-    enable_interrupts(INT_TIMER2);
+    // Set up and enable timer 1 with a period of HEARTBEAT_PERIOD_MS
+    setup_timer1(TMR_INTERNAL|TMR_DIV_BY_256,39*HEARTBEAT_PERIOD_MS);
+    enable_interrupts(INT_TIMER1);
     
     // Set up and enable timer 4 with a period of 1ms
     setup_timer4(TMR_INTERNAL|TMR_DIV_BY_256,39);
     enable_interrupts(INT_TIMER4);
     
-    // Enable CAN receive interrupt
+    // Enable CAN receive and transmit complete interrupts
     enable_interrupts(INT_C1RX);
+    enable_interrupts(INT_CAN1);
+#if TELEMETRY_ON_CAN2
+    enable_interrupts(INT_CAN2);
+#endif
     
     main_init();
     ltc6804_init();
@@ -720,24 +1060,26 @@ void main()
     eeprom_clear_flags();
     output_high(FAN_PIN); // Turn on the fan
     
-    // Initialize CANbus, configure outputs, enable transfer buffers
-    can_init();
-    set_tris_f((*0x02DE&0xFFFD)|0x01); // set F0 to CANRX, F1 to CANTX
-    for (i = 0 ; i < 8 ; i++)
-    {
-        can_enable_b_transfer(1);
-    }
+    // Initialize CANbus on the node set in the eeprom, configure outputs,
+    // enable transfer buffers
+    can_bus_set_node(eeprom_read_node());
+    can_bus_init(g_can_rx_id, N_CAN_RX_IDS);
+    
+    // Point the UART telemetry DMA channel at UART1
+    uart_telem_init();
     
     // Populate running averages
     for (i = 0 ; i < N_VOLTAGE_SAMPLES ; i++)
     {
-        ltc6804_read_cell_voltages(g_cell);
+        ltc6804_read_cell_voltages(g_cells.voltage);
+        calibration_apply_cells(g_cells.voltage);
         average_voltage();
     }
     
     for (i = 0 ; i < N_TEMPERATURE_SAMPLES ; i++)
     {
-        ads7952_read_all_channels(g_temperature);
+        ads7952_read_all_channels(g_temperatures.raw);
+        calibration_apply_thermistors(g_temperatures.raw);
         average_temperature();
     }
     
@@ -759,7 +1101,7 @@ void main()
     {
         // Something went wrong, do not connect the pack
         eeprom_write_errors();
-        can_putd(COMMAND_BPS_TRIP_SIGNAL_ID,0,0,TX_PRI,TX_EXT,TX_RTR);
+        CAN_SEND_COMMAND(COMMAND_BPS_TRIP_SIGNAL);
         delay_ms(BLINKER_WAIT_TIME_MS); // Wait a bit for the blinker to process the trip signal
         KILOVAC_OFF;
     }
@@ -786,6 +1128,15 @@ void main()
             default:
                 break;
         }
+        
+        // Timestamp state transitions
+        if (g_state != last_state)
+        {
+            g_state_time = timebase_ticks();
+            last_state = g_state;
+        }
+        
+        update_lcd();
     }
 }
 
@@ -1,3 +1,7 @@
+#ifdef HOST_BUILD
+// Host build (host/bms_host.c), the CCS built-ins and peripherals are modelled
+#include "bms_hal.h"
+#else
 #include <24HJ256GP610A.h>
 
 #device PASS_STRINGS = IN_RAM
@@ -10,12 +14,21 @@
 
 // Using external oscillator
 #use delay(crystal = 20000000)
+#endif
 
-// UART port (PIC24HJ256GP610A)
-#use rs232(baud = 115200, xmit = PIN_F2, rcv = PIN_F3)
+// UART port (PIC24HJ256GP610A), hardware UART1: U1TX = PIN_F3, U1RX = PIN_F2
+// With Fcy = 10 MHz, 250000, 500000 and 625000 baud have no rate error
+#ifndef UART_TELEM_BAUD
+#define UART_TELEM_BAUD 115200
+#endif
+#ifndef HOST_BUILD
+#use rs232(UART1, baud = UART_TELEM_BAUD, errors)
+#endif
 
 // SPI port 1: LTC6804-1
+#ifndef HOST_BUILD
 #use spi(SPI1, BAUD = 125000, IDLE = 1, SAMPLE_RISE)
+#endif
 #define CSBI1     PIN_D10 // LTC-1 chip select, active low
 #define CSBI2     PIN_A3  // LTC-2 chip select, active low
 #define CSBI3     PIN_A2  // LTC-3 chip select, active low
@@ -23,12 +36,16 @@
 #define MISO_SEL1 PIN_D15 // Selects between 3 MOSI lines
 
 // SPI port 2: ADS7952
+#ifndef HOST_BUILD
 #use spi(SPI2, BAUD = 125000)
+#endif
 #define ADC1_SEL  PIN_B8  // ADC-1, thermistors 0-11
 #define ADC2_SEL  PIN_B9  // ADC-2, thermistors 12-23
 
 // I2C port: CAT24AA02
+#ifndef HOST_BUILD
 #use i2c(MASTER, SCL = PIN_G2, SDA = PIN_G3)
+#endif
 #define WP_PIN    PIN_A6
 
 // LCD interface (4 bit mode)
@@ -52,6 +69,18 @@
 #define KVAC_PIN  PIN_A13 // Kilovac control pin
 #define FAN_PIN   PIN_D7  // Fan PWM signal
 
+// Protection limits
+#define VOLTAGE_MAX            42000 // 4.20V, 1 bit = 0.1 mV
+#define VOLTAGE_MIN            27500 // 2.75V, 1 bit = 0.1 mV
+#define TEMP_WARNING              60 // 60C charge limit
+#define TEMP_CRITICAL             70 // 70C discharge limit
+#define DISCHARGE_LIMIT_AMPS      65 // Current discharge limit (exiting the pack)
+#define CHARGE_LIMIT_AMPS         50 // Current charge limit (entering the pack)
+// Hall sensor codes of the current limits, the offsets rounded up so the
+// integer compares trip where the exact limits lie
+#define CURRENT_DISCHARGE_LIMIT (CURRENT_ZERO + (CURRENT_SLOPE_X100*DISCHARGE_LIMIT_AMPS + 99)/100)
+#define CURRENT_CHARGE_LIMIT    (CURRENT_ZERO - (CURRENT_SLOPE_X100*CHARGE_LIMIT_AMPS + 99)/100)
+
 // State machine states
 typedef enum
 {
@@ -0,0 +1,150 @@
+#ifndef PEER_C
+#define PEER_C
+
+// Peer supervision
+// Every frame received from a peer node counts as a heartbeat. A peer is
+//   unknown: never heard from since start up
+//   alive  : heard from within its timeout
+//   dead   : heard from before but silent for longer than its timeout
+// The PMS is heard through PMS_HEARTBEAT and its disconnect responses, the
+// motor controller through its drive commands. The MPPTs only speak during a
+// trip, so they have no timeout and stay alive once heard from.
+// Frames are stamped in isr_c1rx and the states worked out on timer 4, both
+// at level 4 so neither interrupts the other. The main loop only reads the
+// state bytes.
+//
+// Frame (PEER_STATUS_ID), sent on every change and every PEER_STATUS_PERIOD_MS:
+//   byte 0   : alive peers, bit per peer_t
+//   byte 1   : dead peers, bit per peer_t
+//   bytes 2-7: time since each peer was last heard from, 1 bit = 100 ms,
+//              255 if never or longer
+
+#define PEER_CHECK_MS         100 // Period the states are worked out at
+#define PEER_STATUS_PERIOD_MS 1000
+#define PEER_AGE_MAX          255
+
+typedef enum
+{
+    PEER_PMS = 0,
+    PEER_MOTOR = 1,
+    PEER_MPPT1 = 2,
+    PEER_MPPT2 = 3,
+    PEER_MPPT3 = 4,
+    PEER_MPPT4 = 5,
+    N_PEERS
+} peer_t;
+
+typedef enum
+{
+    PEER_UNKNOWN = 0,
+    PEER_ALIVE = 1,
+    PEER_DEAD = 2,
+} peer_state_t;
+
+typedef struct
+{
+    unsigned int64 last_seen[N_PEERS]; // Timebase ticks of the last frame
+    int1           b_seen[N_PEERS];
+    unsigned int8  state[N_PEERS];     // peer_state_t
+    unsigned int8  age[N_PEERS];       // 100 ms since the last frame
+    int16          status_ms;          // Since the last status frame
+    int1           b_changed;
+} peer_supervision_t;
+
+// Heartbeat timeouts, 0 for peers that are not supervised
+static const unsigned int16 g_peer_timeout_ms[N_PEERS] = {1000, 500, 0, 0, 0, 0};
+
+static peer_supervision_t g_peer;
+
+// Stamps a frame from a peer with its receive time
+void peer_heard(peer_t peer, unsigned int64 rx_time)
+{
+    g_peer.last_seen[peer] = rx_time;
+    g_peer.b_seen[peer] = true;
+}
+
+peer_state_t peer_state(peer_t peer)
+{
+    return g_peer.state[peer];
+}
+
+// Works out the state and age of every peer from the time now
+void peer_update(unsigned int64 now)
+{
+    unsigned int64 age_ms;
+    peer_state_t state;
+    int8 i;
+    
+    for (i = 0 ; i < N_PEERS ; i++)
+    {
+        if (!g_peer.b_seen[i])
+        {
+            state = PEER_UNKNOWN;
+            g_peer.age[i] = PEER_AGE_MAX;
+        }
+        else
+        {
+            age_ms = (now - g_peer.last_seen[i]) / TIMEBASE_TICKS_PER_MS;
+            if ((g_peer_timeout_ms[i] == 0) || (age_ms <= g_peer_timeout_ms[i]))
+            {
+                state = PEER_ALIVE;
+            }
+            else
+            {
+                state = PEER_DEAD;
+            }
+            g_peer.age[i] = (age_ms >= PEER_AGE_MAX*100) ? PEER_AGE_MAX : (unsigned int8)(age_ms / 100);
+        }
+        
+        if (state != g_peer.state[i])
+        {
+            g_peer.state[i] = state;
+            g_peer.b_changed = true;
+        }
+    }
+}
+
+// Updates the states every PEER_CHECK_MS and sends the status frame when
+// one changed or the status period is up. Returns false if the frame was
+// due but no transmit buffer was free.
+int1 peer_check(unsigned int64 now, int8 reserve)
+{
+    unsigned int8 port;
+    unsigned int8 * payload;
+    int8 i;
+    
+    peer_update(now);
+    if (!g_peer.b_changed && (g_peer.status_ms < PEER_STATUS_PERIOD_MS))
+    {
+        g_peer.status_ms += PEER_CHECK_MS;
+        return 1;
+    }
+    
+    port = can_bus_reserve(PEER_STATUS_BUS, reserve);
+    if (port == CAN_TX_NONE)
+    {
+        return 0;
+    }
+    
+    payload = can_bus_payload(PEER_STATUS_BUS, port);
+    payload[0] = 0;
+    payload[1] = 0;
+    for (i = 0 ; i < N_PEERS ; i++)
+    {
+        if (g_peer.state[i] == PEER_ALIVE)
+        {
+            payload[0] |= 1 << i;
+        }
+        else if (g_peer.state[i] == PEER_DEAD)
+        {
+            payload[1] |= 1 << i;
+        }
+        payload[2+i] = g_peer.age[i];
+    }
+    can_bus_commit(PEER_STATUS_BUS, port, PEER_STATUS_ID, 2 + N_PEERS);
+    g_peer.b_changed = false;
+    g_peer.status_ms = 0;
+    return 1;
+}
+
+#endif
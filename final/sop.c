@@ -0,0 +1,188 @@
+#ifndef SOP_C
+#define SOP_C
+
+// State of power
+// Works out how much current the pack can deliver and accept right now so the
+// motor controller and MPPTs can derate before the protection limits trip.
+// Each limit starts at the pack rating and is reduced by:
+//   - cell voltage: linear derate from SOP_*_DERATE_VOLTAGE to the hard limit
+//   - temperature: linear derate over the SOP_TEMP_DERATE_SPAN below the limit
+//   - IR: the current that would pull the weakest cell to the hard limit
+//
+// Frame (SOP_LIMITS_ID):
+//   bytes 0-1: discharge limit, 1 bit = 0.1 A, MSB first
+//   bytes 2-3: charge limit, 1 bit = 0.1 A, MSB first
+//   byte 4   : discharge limiting factor (sop_reason_t)
+//   byte 5   : charge limiting factor (sop_reason_t)
+//   byte 6   : highest temperature, degrees C
+//   byte 7   : frame counter
+
+#define SOP_DISCHARGE_DERATE_VOLTAGE 30000 // 3.00V, 1 bit = 0.1 mV
+#define SOP_CHARGE_DERATE_VOLTAGE    41000 // 4.10V, 1 bit = 0.1 mV
+#define SOP_TEMP_DERATE_SPAN            10 // Degrees C below a limit where derating starts
+#define SOP_TEMP_CHARGE_MIN              0 // No charging at or below 0 degrees C
+#define SOP_DA_PER_COUNT_NUM          1000 // 0.1 A per hall count = 1000 / CURRENT_SLOPE_X100
+#define SOP_DA_PER_COUNT_DEN          CURRENT_SLOPE_X100
+
+typedef enum
+{
+    SOP_REASON_NONE        = 0, // Pack rating
+    SOP_REASON_VOLTAGE     = 1,
+    SOP_REASON_TEMPERATURE = 2,
+    SOP_REASON_IR          = 3,
+} sop_reason_t;
+
+typedef struct
+{
+    signed int16  discharge_limit; // 1 bit = 0.1 A
+    signed int16  charge_limit;    // 1 bit = 0.1 A
+    sop_reason_t  discharge_reason;
+    sop_reason_t  charge_reason;
+    signed int8   max_temperature;
+} sop_t;
+
+static sop_t g_sop;
+
+// Lowers a limit to the given value if it is smaller and remembers why
+void sop_apply(signed int16 * limit, sop_reason_t * reason, signed int32 value, sop_reason_t why)
+{
+    if (value < 0)
+    {
+        value = 0;
+    }
+    if (value < *limit)
+    {
+        *limit = (signed int16) value;
+        *reason = why;
+    }
+}
+
+// Recomputes the discharge and charge limits from the latest sweep
+void sop_update(unsigned int16 * voltage, signed int16 * temperature, unsigned int16 current)
+{
+    signed int16 limit;
+    sop_reason_t reason;
+    signed int16 t;
+    signed int16 t_min = 127;
+    signed int16 t_max = -128;
+    signed int32 i_now;
+    unsigned int16 r;
+    int8 min_cell = 0;
+    int8 max_cell = 0;
+    int i;
+    
+    for (i = 1 ; i < N_CELLS ; i++)
+    {
+        if (voltage[i] < voltage[min_cell])
+        {
+            min_cell = i;
+        }
+        if (voltage[i] > voltage[max_cell])
+        {
+            max_cell = i;
+        }
+    }
+    
+    for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+    {
+        t = temperature[i] / 10;
+        if (t < t_min)
+        {
+            t_min = t;
+        }
+        if (t > t_max)
+        {
+            t_max = t;
+        }
+    }
+    
+    // Pack current in 0.1 A, positive when discharging
+    i_now = ((signed int32)current - CURRENT_ZERO) * SOP_DA_PER_COUNT_NUM / SOP_DA_PER_COUNT_DEN;
+    
+    // Discharge limit
+    limit = DISCHARGE_LIMIT_AMPS * 10;
+    reason = SOP_REASON_NONE;
+    if (voltage[min_cell] < SOP_DISCHARGE_DERATE_VOLTAGE)
+    {
+        sop_apply(&limit, &reason,
+                  (signed int32)limit * ((signed int32)voltage[min_cell] - VOLTAGE_MIN)
+                  / (SOP_DISCHARGE_DERATE_VOLTAGE - VOLTAGE_MIN),
+                  SOP_REASON_VOLTAGE);
+    }
+    if (t_max > TEMP_CRITICAL - SOP_TEMP_DERATE_SPAN)
+    {
+        sop_apply(&limit, &reason,
+                  (signed int32)limit * (TEMP_CRITICAL - t_max) / SOP_TEMP_DERATE_SPAN,
+                  SOP_REASON_TEMPERATURE);
+    }
+    r = ir_estimator_get(min_cell);
+    if ((ir_estimator_samples(min_cell) > 0) && (r > 0))
+    {
+        // 0.1 mV / uOhm = 100 A, so dV * 1000 / R is in 0.1 A
+        sop_apply(&limit, &reason,
+                  i_now + ((signed int32)voltage[min_cell] - VOLTAGE_MIN) * 1000 / r,
+                  SOP_REASON_IR);
+    }
+    g_sop.discharge_limit = limit;
+    g_sop.discharge_reason = reason;
+    
+    // Charge limit
+    limit = CHARGE_LIMIT_AMPS * 10;
+    reason = SOP_REASON_NONE;
+    if (voltage[max_cell] > SOP_CHARGE_DERATE_VOLTAGE)
+    {
+        sop_apply(&limit, &reason,
+                  (signed int32)limit * (VOLTAGE_MAX - (signed int32)voltage[max_cell])
+                  / (VOLTAGE_MAX - SOP_CHARGE_DERATE_VOLTAGE),
+                  SOP_REASON_VOLTAGE);
+    }
+    if (t_max > TEMP_WARNING - SOP_TEMP_DERATE_SPAN)
+    {
+        sop_apply(&limit, &reason,
+                  (signed int32)limit * (TEMP_WARNING - t_max) / SOP_TEMP_DERATE_SPAN,
+                  SOP_REASON_TEMPERATURE);
+    }
+    if (t_min <= SOP_TEMP_CHARGE_MIN)
+    {
+        sop_apply(&limit, &reason, 0, SOP_REASON_TEMPERATURE);
+    }
+    r = ir_estimator_get(max_cell);
+    if ((ir_estimator_samples(max_cell) > 0) && (r > 0))
+    {
+        sop_apply(&limit, &reason,
+                  ((signed int32)VOLTAGE_MAX - voltage[max_cell]) * 1000 / r - i_now,
+                  SOP_REASON_IR);
+    }
+    g_sop.charge_limit = limit;
+    g_sop.charge_reason = reason;
+    
+    g_sop.max_temperature = (signed int8) t_max;
+}
+
+// Sends the latest limits, returns false if no transmit buffer was available
+int1 sop_send(int8 reserve)
+{
+    static unsigned int8 counter = 0;
+    unsigned int8 port;
+    unsigned int8 * payload;
+    
+    port = can_bus_reserve(SOP_LIMITS_BUS, reserve);
+    if (port == CAN_TX_NONE)
+    {
+        return 0;
+    }
+    
+    payload = can_bus_payload(SOP_LIMITS_BUS, port);
+    payload[0] = (unsigned int8) (g_sop.discharge_limit >> 8);
+    payload[1] = (unsigned int8) (g_sop.discharge_limit);
+    payload[2] = (unsigned int8) (g_sop.charge_limit >> 8);
+    payload[3] = (unsigned int8) (g_sop.charge_limit);
+    payload[4] = g_sop.discharge_reason;
+    payload[5] = g_sop.charge_reason;
+    payload[6] = g_sop.max_temperature;
+    payload[7] = counter++;
+    can_bus_commit(SOP_LIMITS_BUS, port, SOP_LIMITS_ID, 8);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef TIMEBASE_C
+#define TIMEBASE_C
+
+// System timebase
+// Timers 2 and 3 run as one free-running 32 bit timer at Fcy (10 MHz), so one
+// tick is 0.1 us. The 32 bit count wraps every 429 s, the timer 3 interrupt
+// counts the wraps to extend it to 64 bits.
+
+#define TIMEBASE_TICKS_PER_US 10
+#define TIMEBASE_TICKS_PER_MS 10000
+#define TIMEBASE_CAPTURE_MAX_AGE 0x8000 // Oldest receive capture used, 3.3 ms
+
+static unsigned int32 g_timebase_high = 0; // Timer 2/3 wraps since reset
+static unsigned int64 g_timebase_rx = 0;   // Time the last receive capture was taken
+
+// Starts the 32 bit timer, the timer 3 interrupt must be enabled separately
+void timebase_init(void)
+{
+    setup_timer2(TMR_INTERNAL|TMR_DIV_BY_1|TMR_32_BIT, 0xFFFFFFFF);
+    set_timer23(0);
+}
+
+// Returns the ticks since reset
+unsigned int64 timebase_ticks(void)
+{
+    unsigned int32 high;
+    unsigned int32 low;
+    
+    // The wrap count may change between the two reads
+    do
+    {
+        high = g_timebase_high;
+        low = get_timer23();
+    } while (high != g_timebase_high);
+    
+    // If the caller is holding off the timer 3 interrupt a wrap may be pending
+    if (interrupt_active(INT_TIMER3) && (low < 0x80000000))
+    {
+        high++;
+    }
+    
+    return ((unsigned int64)high << 32) | low;
+}
+
+// Returns the receive time of a frame read with can_getd, called once per
+// frame read. A capture holds only the low 16 bits of timer 2, so it is
+// extended to a full time only if it is newer than the frames read before
+// (can_getd empties the capture FIFO, so an older one is left over from
+// them) and no more than TIMEBASE_CAPTURE_MAX_AGE old, well past the
+// interrupt latency the WCET budgets allow. Otherwise, or with no capture,
+// the frame gets the current time.
+unsigned int64 timebase_rx_time(int1 b_stamped, unsigned int16 capture)
+{
+    unsigned int64 now = timebase_ticks();
+    unsigned int16 age = (unsigned int16)now - capture;
+    unsigned int64 since = now - g_timebase_rx;
+    
+    g_timebase_rx = now;
+    if (b_stamped && (age <= TIMEBASE_CAPTURE_MAX_AGE) && (age <= since))
+    {
+        return now - age;
+    }
+    return now;
+}
+
+// Returns the microseconds since reset
+unsigned int64 timebase_us(void)
+{
+    return timebase_ticks() / TIMEBASE_TICKS_PER_US;
+}
+
+// Returns the milliseconds since reset
+unsigned int64 timebase_ms(void)
+{
+    return timebase_ticks() / TIMEBASE_TICKS_PER_MS;
+}
+
+#endif
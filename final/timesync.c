@@ -0,0 +1,132 @@
+#ifndef TIMESYNC_C
+#define TIMESYNC_C
+
+// CAN time synchronisation
+// The ground station (master) broadcasts SYNC with a sequence number, then
+// FOLLOW_UP with the time it finished sending that SYNC. The BMS timestamps
+// SYNC when it is received and steers a synchronised clock towards the master
+// with a fixed point PI loop on the timebase. The stamp is the newest IC2
+// capture when isr_c1rx read SYNC (see timebase_rx_time), the end of SYNC on
+// the bus unless another frame followed it first, in which case it is late
+// by that frame. With no usable capture it is the time isr_c1rx read SYNC,
+// late by the interrupt latency. Either shows as phase error, which the loop
+// filters.
+//
+// SYNC      (TIMESYNC_SYNC_ID)     : byte 0 = sequence
+// FOLLOW_UP (TIMESYNC_FOLLOW_UP_ID): byte 0 = sequence,
+//                                    bytes 1-7 = master time in us, MSB first
+//
+// Both messages are handled in the CAN receive interrupt, the synchronised
+// clock must only be read from the same interrupt priority.
+
+#define TIMESYNC_RATE_SHIFT      24 // Rate correction in 2^-24 (0.06 ppb)
+#define TIMESYNC_KP_SHIFT         1 // Phase gain of 1/2
+#define TIMESYNC_KI_SHIFT         3 // Frequency gain of 1/8
+#define TIMESYNC_STEP_TICKS   10000 // Errors above 1 ms step the clock
+#define TIMESYNC_MAX_RATE     16777 // Rate correction limit, about 1000 ppm
+#define TIMESYNC_LOCK_TICKS    1000 // Errors below 100 us count as locked
+
+typedef struct
+{
+    signed int64   offset;  // Master minus local time at ref, ticks
+    signed int32   rate;    // Frequency correction, 2^-24
+    unsigned int64 ref;     // Local time the offset was last updated
+    unsigned int64 sync_rx; // Local time the last SYNC was received
+    unsigned int8  sync_seq;
+    signed int32   error;   // Last measured error in ticks, saturated
+    int1           b_sync_pending;
+    int1           b_valid; // The clock has been set at least once
+} timesync_t;
+
+static timesync_t g_timesync;
+
+// Converts a local timebase time to master time in ticks
+unsigned int64 timesync_from_local(unsigned int64 local)
+{
+    signed int64 elapsed = (signed int64)(local - g_timesync.ref);
+    
+    return local + g_timesync.offset + ((elapsed * g_timesync.rate) >> TIMESYNC_RATE_SHIFT);
+}
+
+// Returns true if the clock follows the master within TIMESYNC_LOCK_TICKS
+int1 timesync_locked(void)
+{
+    return g_timesync.b_valid
+        && (g_timesync.error < TIMESYNC_LOCK_TICKS)
+        && (g_timesync.error > -TIMESYNC_LOCK_TICKS);
+}
+
+// Remembers when a SYNC arrived, rx_time is the local receive time
+void timesync_sync(int8 * data, unsigned int64 rx_time)
+{
+    g_timesync.sync_seq = data[0];
+    g_timesync.sync_rx = rx_time;
+    g_timesync.b_sync_pending = true;
+}
+
+// Compares the master send time of the last SYNC with its local receive time
+// and corrects the clock
+void timesync_follow_up(int8 * data)
+{
+    unsigned int64 master = 0;
+    signed int64 error;
+    signed int64 interval;
+    signed int64 rate;
+    int i;
+    
+    if (!g_timesync.b_sync_pending || ((unsigned int8)data[0] != g_timesync.sync_seq))
+    {
+        // FOLLOW_UP without its SYNC
+        return;
+    }
+    g_timesync.b_sync_pending = false;
+    
+    for (i = 1 ; i < 8 ; i++)
+    {
+        master = (master << 8) | (unsigned int8)data[i];
+    }
+    master *= TIMEBASE_TICKS_PER_US;
+    
+    error = (signed int64)(master - timesync_from_local(g_timesync.sync_rx));
+    
+    // Fold the rate correction since the last update into the offset
+    interval = (signed int64)(g_timesync.sync_rx - g_timesync.ref);
+    g_timesync.offset += (interval * g_timesync.rate) >> TIMESYNC_RATE_SHIFT;
+    g_timesync.ref = g_timesync.sync_rx;
+    
+    if (!g_timesync.b_valid || (error > TIMESYNC_STEP_TICKS) || (error < -TIMESYNC_STEP_TICKS))
+    {
+        // First sync or lost track, step the clock and keep the rate
+        g_timesync.offset += error;
+        g_timesync.b_valid = true;
+    }
+    else
+    {
+        g_timesync.offset += error >> TIMESYNC_KP_SHIFT;
+        if (interval > 0)
+        {
+            rate = g_timesync.rate + (((error << TIMESYNC_RATE_SHIFT) / interval) >> TIMESYNC_KI_SHIFT);
+            if (rate > TIMESYNC_MAX_RATE)
+            {
+                rate = TIMESYNC_MAX_RATE;
+            }
+            else if (rate < -TIMESYNC_MAX_RATE)
+            {
+                rate = -TIMESYNC_MAX_RATE;
+            }
+            g_timesync.rate = (signed int32) rate;
+        }
+    }
+    
+    if (error > 0x7FFFFFFF)
+    {
+        error = 0x7FFFFFFF;
+    }
+    else if (error < -0x7FFFFFFF)
+    {
+        error = -0x7FFFFFFF;
+    }
+    g_timesync.error = (signed int32) error;
+}
+
+#endif
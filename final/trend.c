@@ -0,0 +1,151 @@
+#ifndef TREND_C
+#define TREND_C
+
+// Trend based early warnings
+// Keeps the last N_TREND_SAMPLES cell voltages and temperatures, taken every
+// TREND_SAMPLE_S seconds, and fits a least squares line through each channel.
+// The cell voltages are the running averages, so a single reading taken
+// during a current spike, with the IR drop it brings, does not tilt the line.
+// When a channel is predicted to reach its protection limit within
+// TREND_HORIZON_S a warning frame is sent so the PMS can shed power before the
+// BMS has to trip.
+//
+// With 8 samples at k = 0..7 the slope is sum((2k-7) * y[k]) / 84 per sample.
+//
+// Frame (TREND_WARNING_ID):
+//   byte 0   : warnings (trend_warning_t bits)
+//   byte 1   : channel with the soonest predicted limit, cells 0-29,
+//              thermistors 0x80-0x97
+//   bytes 2-3: seconds to that limit, MSB first
+
+#define N_TREND_SAMPLES          8 // Must be a power of 2
+#define TREND_WEIGHT_SUM        84 // sum((2k-7)^2) / 2
+#define TREND_SAMPLE_S           1 // Seconds between samples
+#define TREND_HORIZON_S         60 // Warn when a limit is predicted within this time
+#define TREND_TEMP_CHANNEL    0x80 // Added to a thermistor index in the frame
+
+// Temperatures are kept in 0.1 K so every sample is positive
+#define TREND_KELVIN_X10      2731
+#define TREND_TEMP_LIMIT      (TEMP_WARNING*10 + TREND_KELVIN_X10)
+
+typedef enum
+{
+    TREND_OV = 0x01, // Cell voltage rising towards VOLTAGE_MAX
+    TREND_UV = 0x02, // Cell voltage falling towards VOLTAGE_MIN
+    TREND_OT = 0x04, // Temperature rising towards TEMP_WARNING
+} trend_warning_t;
+
+typedef struct
+{
+    unsigned int8  flags;
+    unsigned int8  channel;
+    unsigned int16 seconds;
+} trend_t;
+
+static unsigned int16 g_trend_voltage[N_CELLS][N_TREND_SAMPLES];
+static unsigned int16 g_trend_temperature[N_ADC_CHANNELS][N_TREND_SAMPLES];
+static unsigned int8  g_trend_head = 0;  // Oldest sample, next one to overwrite
+static unsigned int8  g_trend_count = 0;
+static unsigned int32 g_trend_last_ms = 0;
+static trend_t        g_trend;
+
+// Returns the slope of a channel times TREND_WEIGHT_SUM, in units per sample
+signed int32 trend_slope(unsigned int16 * y)
+{
+    signed int32 sum = 0;
+    int8 k;
+    
+    for (k = 0 ; k < N_TREND_SAMPLES ; k++)
+    {
+        sum += (signed int32)(2*k - (N_TREND_SAMPLES-1)) * y[(g_trend_head + k) & (N_TREND_SAMPLES-1)];
+    }
+    return sum;
+}
+
+// Checks whether a channel reaches a limit margin away within the horizon
+// The slope must point towards the limit (positive) and keeps the soonest
+// prediction in g_trend
+void trend_predict(signed int32 margin, signed int32 slope, trend_warning_t warning, unsigned int8 channel)
+{
+    signed int32 seconds;
+    
+    if (slope <= 0)
+    {
+        return;
+    }
+    if (margin < 0)
+    {
+        margin = 0;
+    }
+    
+    seconds = margin * TREND_WEIGHT_SUM * TREND_SAMPLE_S / slope;
+    if (seconds <= TREND_HORIZON_S)
+    {
+        if ((g_trend.flags == 0) || (seconds < g_trend.seconds))
+        {
+            g_trend.channel = channel;
+            g_trend.seconds = (unsigned int16) seconds;
+        }
+        g_trend.flags |= warning;
+    }
+}
+
+// Takes a sample every TREND_SAMPLE_S and refreshes the predictions
+// Returns true when new predictions are available in g_trend
+int1 trend_update(unsigned int16 * voltage, signed int16 * temperature, unsigned int32 now_ms)
+{
+    unsigned int8 last;
+    signed int32 slope;
+    int i;
+    
+    if ((now_ms - g_trend_last_ms) < (TREND_SAMPLE_S * 1000))
+    {
+        return 0;
+    }
+    g_trend_last_ms = now_ms;
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_trend_voltage[i][g_trend_head] = voltage[i];
+    }
+    for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+    {
+        g_trend_temperature[i][g_trend_head] = (unsigned int16) (temperature[i] + TREND_KELVIN_X10);
+    }
+    last = g_trend_head;
+    g_trend_head = (g_trend_head + 1) & (N_TREND_SAMPLES-1);
+    
+    if (g_trend_count < N_TREND_SAMPLES)
+    {
+        g_trend_count++;
+        return 0;
+    }
+    
+    g_trend.flags = 0;
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        slope = trend_slope(g_trend_voltage[i]);
+        trend_predict((signed int32)VOLTAGE_MAX - g_trend_voltage[i][last], slope, TREND_OV, i);
+        trend_predict((signed int32)g_trend_voltage[i][last] - VOLTAGE_MIN, -slope, TREND_UV, i);
+    }
+    for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+    {
+        slope = trend_slope(g_trend_temperature[i]);
+        trend_predict((signed int32)TREND_TEMP_LIMIT - g_trend_temperature[i][last], slope, TREND_OT, TREND_TEMP_CHANNEL + i);
+    }
+    return 1;
+}
+
+// Sends the current predictions, returns false if no transmit buffer was free
+int1 trend_send(void)
+{
+    int8 data[4];
+    
+    data[0] = g_trend.flags;
+    data[1] = g_trend.channel;
+    data[2] = (int8) (g_trend.seconds >> 8);
+    data[3] = (int8) (g_trend.seconds);
+    return can_bus_putd(TREND_WARNING_BUS, TREND_WARNING_ID, data, 4);
+}
+
+#endif
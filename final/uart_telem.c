@@ -0,0 +1,196 @@
+#ifndef UART_TELEM_C
+#define UART_TELEM_C
+
+// UART telemetry stream for the LabVIEW GUI / radio link
+// A whole pack snapshot is built into one frame and handed to DMA channel 4,
+// which feeds UART1 one byte per transmit request with no CPU involvement.
+//
+// Frame: 0xAA 0x55 SEQ LEN [packets] CRC_HI CRC_LO
+// The packets use the LabVIEW test code IDs, the CRC16 (CCITT, init 0xFFFF)
+// covers SEQ, LEN and the packets.
+//
+// The GUI in labview/ parses the packets back to back with no wrapper and
+// knows neither TEMP_RAW_ID nor TIME_ID. UART_TELEM_LEGACY sends that layout:
+// the voltage, temperature, current, balance and status packets only, with
+// no sync bytes, sequence number, length or CRC. It is the default until the
+// GUI decodes the framed layout, build with UART_TELEM_LEGACY 0 for the frame.
+#ifndef UART_TELEM_LEGACY
+#define UART_TELEM_LEGACY 1
+#endif
+
+#define UART_TELEM_SYNC0       0xAA
+#define UART_TELEM_SYNC1       0x55
+
+// LabVIEW packet IDs
+#define VOLTAGE_ID             0x5A // 30 x 16 bit cell voltage, MSB first, 1 bit = 0.1 mV
+#define TEMP_ID                0x69 // 24 x 8 bit temperature, 1 bit = 1 degree C
+#define TEMP_RAW_ID            0x6A // 24 x 16 bit averaged thermistor ADC counts, MSB first
+#define CURRENT_ID             0xE7 // 16 bit averaged hall sensor ADC counts, MSB first
+#define BALANCE_ID             0x41 // 32 bit discharge bits, LSB first
+#define STATUS_ID              0x77 // 1 if the pack is connected
+#define TIME_ID                0x54 // Frame, sweep and last state change time,
+                                    // 3 x 32 bit us since reset, MSB first
+
+#if UART_TELEM_LEGACY
+#define UART_TELEM_HEADER_LEN  0
+#define UART_TELEM_PAYLOAD_LEN ((1+2*N_CELLS)+(1+N_ADC_CHANNELS)+3+5+2)
+#define UART_TELEM_FRAME_LEN   UART_TELEM_PAYLOAD_LEN
+#else
+#define UART_TELEM_HEADER_LEN  4
+#define UART_TELEM_PAYLOAD_LEN ((1+2*N_CELLS)+(1+N_ADC_CHANNELS)+(1+2*N_ADC_CHANNELS)+3+5+2+13)
+#define UART_TELEM_FRAME_LEN   (UART_TELEM_HEADER_LEN+UART_TELEM_PAYLOAD_LEN+2)
+#endif
+
+// DMA channel 4 feeds UART1 transmit
+#define UART_TELEM_DMA_IRQ     12 // UART1TX DMA request
+#ifndef HOST_BUILD
+#word UART_TELEM_DMA4CON = getenv("SFR:DMA4CON")
+#word UART_TELEM_DMA4REQ = getenv("SFR:DMA4REQ")
+#word UART_TELEM_DMA4STA = getenv("SFR:DMA4STA")
+#word UART_TELEM_DMA4PAD = getenv("SFR:DMA4PAD")
+#word UART_TELEM_DMA4CNT = getenv("SFR:DMA4CNT")
+#word UART_TELEM_U1TXREG = getenv("SFR:U1TXREG")
+#bit  UART_TELEM_DMA_BUSY = UART_TELEM_DMA4CON.15
+#endif
+
+// DMAxSTA holds an offset into DMA RAM, not an address
+#define UART_TELEM_DMA_RAM     0x7800
+
+// DMA control: enabled, byte transfers, RAM to peripheral, one-shot
+#define UART_TELEM_DMA_CON     0xE001
+
+#ifndef HOST_BUILD
+#BANK_DMA
+#endif
+static unsigned int8 g_uart_telem_frame[UART_TELEM_FRAME_LEN];
+
+#if !UART_TELEM_LEGACY
+static unsigned int8 g_uart_telem_seq = 0;
+
+// CRC16 CCITT lookup table, one entry per nibble
+const unsigned int16 uart_telem_crc_table[16] =
+{
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+unsigned int16 uart_telem_crc16(unsigned int8 * data, int16 len)
+{
+    unsigned int16 crc = 0xFFFF;
+    int16 i;
+    
+    for (i = 0 ; i < len ; i++)
+    {
+        crc = (crc << 4) ^ uart_telem_crc_table[(crc >> 12) ^ (data[i] >> 4)];
+        crc = (crc << 4) ^ uart_telem_crc_table[(crc >> 12) ^ (data[i] & 0x0F)];
+    }
+    return crc;
+}
+#endif
+
+// Points DMA channel 4 at the UART1 transmit register
+void uart_telem_init(void)
+{
+    UART_TELEM_DMA4CON = UART_TELEM_DMA_CON & 0x7FFF;
+    UART_TELEM_DMA4REQ = UART_TELEM_DMA_IRQ;
+    UART_TELEM_DMA4PAD = &UART_TELEM_U1TXREG;
+    UART_TELEM_DMA4STA = (unsigned int16)&g_uart_telem_frame[0] - UART_TELEM_DMA_RAM;
+}
+
+// Writes the low 32 bits of a timebase time in us
+unsigned int8 * uart_telem_put_time(unsigned int8 * p, unsigned int64 ticks)
+{
+    unsigned int32 us = (unsigned int32)(ticks / TIMEBASE_TICKS_PER_US);
+    
+    *p++ = (unsigned int8) (us >> 24);
+    *p++ = (unsigned int8) (us >> 16);
+    *p++ = (unsigned int8) (us >>  8);
+    *p++ = (unsigned int8) (us);
+    return p;
+}
+
+// Builds a frame from the pack data and starts the DMA transfer
+// Returns false if the previous frame is still being sent and the frame is
+// skipped. The framed layout shows a skipped frame as a gap in the sequence
+// number, the legacy layout has no sequence number so the GUI only sees a
+// longer wait for the next snapshot.
+int1 uart_telem_send(cells_t * cells, temperatures_t * temperatures, current_t * current, int1 b_connected,
+                     unsigned int64 sweep_time, unsigned int64 state_time)
+{
+    unsigned int8 * p = &g_uart_telem_frame[UART_TELEM_HEADER_LEN];
+#if !UART_TELEM_LEGACY
+    unsigned int16 crc;
+#endif
+    int32 discharge;
+    int i;
+    
+    if (UART_TELEM_DMA_BUSY)
+    {
+        return 0;
+    }
+    
+#if !UART_TELEM_LEGACY
+    g_uart_telem_frame[0] = UART_TELEM_SYNC0;
+    g_uart_telem_frame[1] = UART_TELEM_SYNC1;
+    g_uart_telem_frame[2] = g_uart_telem_seq++;
+    g_uart_telem_frame[3] = UART_TELEM_PAYLOAD_LEN;
+#endif
+    
+    *p++ = VOLTAGE_ID;
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        *p++ = (unsigned int8) (cells->average_voltage[i] >> 8);
+        *p++ = (unsigned int8) (cells->average_voltage[i]);
+    }
+    
+    *p++ = TEMP_ID;
+    for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+    {
+        *p++ = (unsigned int8) (temperatures->converted[i] / 10);
+    }
+    
+#if !UART_TELEM_LEGACY
+    *p++ = TEMP_RAW_ID;
+    for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+    {
+        *p++ = (unsigned int8) (temperatures->average[i] >> 8);
+        *p++ = (unsigned int8) (temperatures->average[i]);
+    }
+#endif
+    
+    *p++ = CURRENT_ID;
+    *p++ = (unsigned int8) (current->average >> 8);
+    *p++ = (unsigned int8) (current->average);
+    
+    discharge = ((((int32)(g_discharge1))<< 0)&0x00000FFF)
+               |((((int32)(g_discharge2))<<12)&0x00FFF000)
+               |((((int32)(g_discharge3))<<24)&0x3F000000);
+    *p++ = BALANCE_ID;
+    *p++ = (unsigned int8) (discharge&0xFF);
+    *p++ = (unsigned int8) ((discharge>> 8)&0xFF);
+    *p++ = (unsigned int8) ((discharge>>16)&0xFF);
+    *p++ = (unsigned int8) ((discharge>>24)&0x3F);
+    
+    *p++ = STATUS_ID;
+    *p++ = b_connected;
+    
+#if !UART_TELEM_LEGACY
+    *p++ = TIME_ID;
+    p = uart_telem_put_time(p, timebase_ticks());
+    p = uart_telem_put_time(p, sweep_time);
+    p = uart_telem_put_time(p, state_time);
+    
+    crc = uart_telem_crc16(&g_uart_telem_frame[2], UART_TELEM_HEADER_LEN-2+UART_TELEM_PAYLOAD_LEN);
+    *p++ = (unsigned int8) (crc >> 8);
+    *p   = (unsigned int8) (crc);
+#endif
+    
+    // One-shot block transfer, the first byte is forced and the UART pulls
+    // the rest as its transmit buffer empties
+    UART_TELEM_DMA4CNT = UART_TELEM_FRAME_LEN-1;
+    UART_TELEM_DMA4CON = UART_TELEM_DMA_CON;
+    UART_TELEM_DMA4REQ |= 0x8000;
+    return 1;
+}
+
+#endif
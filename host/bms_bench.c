@@ -0,0 +1,736 @@
+// Micro-benchmarks of the BMS firmware kernels
+// Builds final/main.c for the host as bms_host does and times the hot kernels
+// unchanged, in the style of Google Benchmark: each one runs for a doubling
+// number of iterations until a run takes the minimum time, and the time per
+// iteration of that run is reported. The ECAN frame packing of the CCS
+// driver (can_load_header, can_load_buffer) needs the PIC's DMA buffers, so
+// the Makefile cuts the two functions out of final/can_PIC24.c unchanged into
+// can_pack.c and they are built here writing to a host array in their place.
+// With -l the PIC24 cost of each kernel is also estimated from the listing
+// CCS writes next to the hex file (main.lst). Every instruction of the
+// function is costed with the PIC24H instruction timings, once for a
+// straight pass and again weighted by the trip counts of its loops (backward
+// branches, outermost and first loop first). Calls count as the call
+// instruction only, so kernels that call library code (floating point) are
+// under-estimated; compare them between builds rather than take them as is.
+// With -m the RAM taken by the firmware state is listed instead. Sizes are
+// those of the host build, PCD aligns to 2 bytes so structures holding 32 bit
+// members can come out a little smaller on the PIC24.
+// With -e the fixed point conversions (final/fixed.c) are checked against
+// double precision instead, and the exit status is 1 if any error is over
+// its bound. The internal resistance estimates are checked the same way,
+// against the cell resistances of the pack model after BENCH_IR_SWEEPS
+// sweeps with the current stepping between every two, and the UART frames
+// are checked against the layout of the build: the packet IDs and lengths,
+// and for the framed layout the sync bytes, sequence number, length and CRC
+// (worked out bit by bit, not with the table of uart_telem_crc16). The
+// default build sends the legacy layout, bms_bench_framed is built with
+// UART_TELEM_LEGACY 0 to check the framed one.
+// Usage: bms_bench [-f name filter] [-t min time s] [-l main.lst] [-m] [-e]
+
+#include <stdlib.h>
+#include <regex.h>
+#include <getopt.h>
+#include "host_can.c"
+
+#define main bms_main
+#include "main.c"
+#undef main
+
+#include "bms_devices.c"
+#include "bms_hal.c"
+
+// The frame packing of can_PIC24.c, renamed so it does not clash with the
+// host ECAN model
+#define make16(hi, lo)  ((uint16_t)(((uint16_t)(hi) << 8) | (uint8_t)(lo)))
+#define can_load_header bench_can_load_header
+#define can_load_buffer bench_can_load_buffer
+static uint16_t ecan1_message_buffer[N_TX_BUFFERS][8]; // Stands in for the CAN1 DMA buffers
+#include "can_pack.c"
+#undef can_load_header
+#undef can_load_buffer
+
+#define N_BENCH_LOOPS  4    // Loop trip counts a kernel can give
+#define N_LIST_INSTR   8192 // Instructions kept of one function
+#define N_LIST_LOOPS   32
+#define BENCH_IR_SWEEPS 32
+#define BENCH_IR_STEP_TICKS (HOST_TICKS_PER_S / 50) // 20 ms
+
+// Keeps the compiler from optimising a result or memory writes away, as
+// benchmark::DoNotOptimize and ClobberMemory do
+#define BENCH_KEEP(value) __asm__ volatile("" : : "g"(value) : "memory")
+
+#define BENCH_RAM(variable) {#variable, sizeof(variable)}
+
+typedef struct
+{
+    const char * name;
+    const char * function;             // Function in the CCS listing
+    void (*setup)(void);
+    void (*run)(void);
+    int          loops[N_BENCH_LOOPS]; // Trip counts, 0 ends the list
+} bench_t;
+
+typedef struct
+{
+    const char * name;
+    size_t       size;
+} bench_ram_t;
+
+typedef struct
+{
+    const char * name;
+    const char * unit;
+    double       bound;
+    double       worst;
+    double       at;        // Input of the worst error
+} bench_error_t;
+
+typedef struct
+{
+    int id;
+    int len;
+} bench_uart_packet_t;
+
+typedef struct
+{
+    unsigned long address;
+    int           cycles;
+    unsigned long target;  // Branch target, 0 if not a branch
+} list_instr_t;
+
+typedef struct
+{
+    unsigned long start;
+    unsigned long end;
+} list_loop_t;
+
+//////////////////////////
+// Kernels ///////////////
+//////////////////////////
+
+static unsigned int8 g_bench_ltc_group[6] = {0x12, 0x34, 0x56, 0x78, 0x9A, 0xBC}; // One register group
+static unsigned int8 g_bench_payload[8];
+static unsigned int16 g_bench_raw = 1000;
+static unsigned int16 g_bench_cells[N_CELLS];
+
+void bench_setup_cells(void)
+{
+    int i;
+    int j;
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_cells.voltage[i] = 37000 + 40*i;
+        for (j = 0 ; j < N_VOLTAGE_SAMPLES ; j++)
+        {
+            g_cells.samples[i][j] = g_cells.voltage[i];
+        }
+        g_cells.average_voltage[i] = g_cells.voltage[i];
+    }
+}
+
+// Trims every channel, so no correction is skipped
+void bench_setup_calibration(void)
+{
+    int i;
+    
+    bench_setup_cells();
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_cal.cell_gain[i] = (i & 1) ? 33 : -33;
+        g_cal.cell_offset[i] = i - N_CELLS/2;
+    }
+}
+
+// The session of a command without payload
+void bench_setup_balance(void)
+{
+    bench_setup_cells();
+    balance_init();
+}
+
+void bench_setup_pec(void)
+{
+    init_PEC15_Table();
+}
+
+void bench_average_voltage(void)
+{
+    average_voltage();
+    BENCH_KEEP(g_cells);
+}
+
+// Corrects a fresh copy of the cells each time so they do not drift
+void bench_calibration_apply(void)
+{
+    memcpy(g_bench_cells, g_cells.voltage, sizeof(g_bench_cells));
+    calibration_apply_cells(g_bench_cells);
+    BENCH_KEEP(g_bench_cells);
+}
+
+void bench_pec15(void)
+{
+    BENCH_KEEP(pec15((char *)g_bench_ltc_group, 6));
+}
+
+void bench_thermistor_convert_data(void)
+{
+    g_bench_raw = (g_bench_raw + 37) & 0x0FFF;
+    BENCH_KEEP(thermistor_convert_data(g_bench_raw));
+}
+
+void bench_cur_bal_stat(void)
+{
+    telem_fill_cur_bal_stat(g_bench_payload, 0, CAN_BPS_CUR_BAL_STAT_LEN);
+    BENCH_KEEP(g_bench_payload);
+}
+
+void bench_balance_masks(void)
+{
+    balance_update_masks();
+    BENCH_KEEP(g_discharge1);
+}
+
+// Packs the ID, length and payload of a frame into the words of an ECAN
+// buffer, as can_putd does on the PIC
+void bench_can_pack(void)
+{
+    bench_can_load_buffer(0, TREND_WARNING_ID, g_bench_payload, 8, TX_EXT, TX_RTR);
+    BENCH_KEEP(ecan1_message_buffer);
+}
+
+static bench_t g_bench[] =
+{
+    {"average_voltage",         "average_voltage",         bench_setup_cells,       bench_average_voltage,         {N_CELLS, N_VOLTAGE_SAMPLES}},
+    {"calibration_apply",       "calibration_apply",       bench_setup_calibration, bench_calibration_apply,       {N_CELLS}},
+    {"pec15/6",                 "pec15",                   bench_setup_pec,         bench_pec15,                   {6}},
+    {"thermistor_convert_data", "thermistor_convert_data", 0,                       bench_thermistor_convert_data, {0}},
+    {"telem_fill_cur_bal_stat", "telem_fill_cur_bal_stat", 0,                       bench_cur_bal_stat,            {0}},
+    {"balance_update_masks",    "balance_update_masks",    bench_setup_balance,     bench_balance_masks,           {N_CELLS, N_CELLS}},
+    {"can_load_buffer",         "can_load_buffer",         0,                       bench_can_pack,                {4}},
+};
+#define N_BENCH (sizeof(g_bench) / sizeof(g_bench[0]))
+
+// Firmware state listed by -m, pack state first
+static const bench_ram_t g_bench_ram[] =
+{
+    BENCH_RAM(g_cells),
+    BENCH_RAM(g_temperatures),
+    BENCH_RAM(g_current),
+    BENCH_RAM(g_errors),
+    BENCH_RAM(g_blackbox_summary),
+    BENCH_RAM(g_blackbox_cells),
+    BENCH_RAM(g_trend_voltage),
+    BENCH_RAM(g_trend_temperature),
+    BENCH_RAM(g_ir),
+    BENCH_RAM(g_cal),
+    BENCH_RAM(g_ir_voltage),
+    BENCH_RAM(g_latency),
+    BENCH_RAM(g_event),
+    BENCH_RAM(g_balance),
+    BENCH_RAM(g_uart_telem_frame),
+    BENCH_RAM(pec15Table),
+};
+#define N_BENCH_RAM (sizeof(g_bench_ram) / sizeof(g_bench_ram[0]))
+
+//////////////////////////
+// Timing ////////////////
+//////////////////////////
+
+double bench_now(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Returns the time per iteration in ns and the iterations of the last run
+double bench_time(bench_t * bench, double min_s, unsigned long * iterations)
+{
+    unsigned long n = 1;
+    unsigned long i;
+    double start;
+    double elapsed;
+    
+    while (true)
+    {
+        start = bench_now();
+        for (i = 0 ; i < n ; i++)
+        {
+            bench->run();
+        }
+        elapsed = bench_now() - start;
+        if ((elapsed >= min_s) || (n >= (1UL << 40)))
+        {
+            *iterations = n;
+            return elapsed * 1e9 / n;
+        }
+        n *= 2;
+    }
+}
+
+//////////////////////////
+// Listing ///////////////
+//////////////////////////
+
+// Returns the PIC24H cycles of an instruction, branches as not taken
+int list_cycles(const char * mnemonic, const char * operands, unsigned long * target)
+{
+    static const char * two[] = {"CALL", "RCALL", "MOV.D", "TBLRDL", "TBLRDH", "TBLWTL", "TBLWTH", "PUSH.D", "POP.D"};
+    static const char * three[] = {"RETURN", "RETLW", "RETFIE"};
+    const char * comma;
+    unsigned int i;
+    
+    *target = 0;
+    if ((strcmp(mnemonic, "BRA") == 0) || (strcmp(mnemonic, "GOTO") == 0))
+    {
+        // BRA cond,addr or BRA addr
+        comma = strchr(operands, ',');
+        *target = strtoul(comma ? comma + 1 : operands, 0, 16);
+        return comma ? 1 : 2;
+    }
+    for (i = 0 ; i < sizeof(two) / sizeof(two[0]) ; i++)
+    {
+        if (strcmp(mnemonic, two[i]) == 0)
+        {
+            return 2;
+        }
+    }
+    for (i = 0 ; i < sizeof(three) / sizeof(three[0]) ; i++)
+    {
+        if (strcmp(mnemonic, three[i]) == 0)
+        {
+            return 3;
+        }
+    }
+    return 1;
+}
+
+// Reads the instructions of a function from a CCS listing, returns how many
+// or -1 if the function is not in it
+int list_read(const char * path, const char * function, list_instr_t * instr, int * n_calls)
+{
+    FILE * file = fopen(path, "r");
+    char line[512];
+    char mnemonic[16];
+    char operands[128];
+    char pattern[160];
+    regex_t source;
+    regex_t definition;
+    regex_t wanted;
+    regex_t code;
+    regmatch_t match[4];
+    unsigned long address;
+    int repeat = 0;
+    int b_inside = false;
+    int b_found = false;
+    int n = 0;
+    
+    if (!file)
+    {
+        perror(path);
+        return -1;
+    }
+    // Source lines are echoed after dots, code lines start with an address
+    snprintf(pattern, sizeof(pattern), "^[a-zA-Z_][a-zA-Z0-9_ *]*[ *]%s *\\([^;]*$", function);
+    regcomp(&source, "^\\.{10,} ?(.*)$", REG_EXTENDED);
+    regcomp(&definition, "^[a-zA-Z_][a-zA-Z0-9_ *]*[ *][a-zA-Z_][a-zA-Z0-9_]* *\\([^;]*$", REG_EXTENDED);
+    regcomp(&wanted, pattern, REG_EXTENDED);
+    regcomp(&code, "^([0-9A-F]{4,6}): +([A-Z][A-Z.]*) *([^ ;]*)", REG_EXTENDED);
+    *n_calls = 0;
+    
+    while (fgets(line, sizeof(line), file) && (n < N_LIST_INSTR))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (regexec(&source, line, 2, match, 0) == 0)
+        {
+            // A function definition starts or ends the one we want
+            if (regexec(&definition, line + match[1].rm_so, 0, 0, 0) == 0)
+            {
+                b_inside = (regexec(&wanted, line + match[1].rm_so, 0, 0, 0) == 0);
+                b_found |= b_inside;
+            }
+            continue;
+        }
+        if (!b_inside || (regexec(&code, line, 4, match, 0) != 0))
+        {
+            continue;
+        }
+        
+        address = strtoul(line + match[1].rm_so, 0, 16);
+        snprintf(mnemonic, sizeof(mnemonic), "%.*s", (int)(match[2].rm_eo - match[2].rm_so), line + match[2].rm_so);
+        snprintf(operands, sizeof(operands), "%.*s", (int)(match[3].rm_eo - match[3].rm_so), line + match[3].rm_so);
+        if (strcmp(mnemonic, "DATA") == 0)
+        {
+            continue;
+        }
+        instr[n].address = address;
+        instr[n].cycles = list_cycles(mnemonic, operands, &instr[n].target);
+        if (repeat)
+        {
+            // REPEAT #n runs the next instruction n+1 times (DIV takes 18)
+            instr[n].cycles *= repeat;
+            repeat = 0;
+        }
+        if (strcmp(mnemonic, "REPEAT") == 0)
+        {
+            repeat = (operands[0] == '#') ? strtoul(operands + 1, 0, 16) + 1 : 1;
+        }
+        if ((strcmp(mnemonic, "CALL") == 0) || (strcmp(mnemonic, "RCALL") == 0))
+        {
+            (*n_calls)++;
+        }
+        n++;
+    }
+    
+    regfree(&source);
+    regfree(&definition);
+    regfree(&wanted);
+    regfree(&code);
+    fclose(file);
+    return b_found ? n : -1;
+}
+
+int list_loop_compare(const void * a, const void * b)
+{
+    const list_loop_t * x = a;
+    const list_loop_t * y = b;
+    
+    if (x->start != y->start)
+    {
+        return (x->start < y->start) ? -1 : 1;
+    }
+    return (x->end > y->end) ? -1 : (x->end < y->end);
+}
+
+// Prints the cycle estimate of a kernel from the listing
+void list_estimate(const char * path, bench_t * bench)
+{
+    static list_instr_t instr[N_LIST_INSTR];
+    list_loop_t loop[N_LIST_LOOPS];
+    unsigned long straight = 0;
+    double weighted = 0.0;
+    double weight;
+    int n_loops = 0;
+    int n_trips = 0;
+    int n_calls;
+    int n;
+    int i;
+    int k;
+    
+    n = list_read(path, bench->function, instr, &n_calls);
+    if (n < 0)
+    {
+        printf("%-28s not in listing\n", "");
+        return;
+    }
+    
+    for (i = 0 ; i < n ; i++)
+    {
+        straight += instr[i].cycles;
+        if (instr[i].target && (instr[i].target <= instr[i].address) && (instr[i].target >= instr[0].address)
+            && (n_loops < N_LIST_LOOPS))
+        {
+            loop[n_loops].start = instr[i].target;
+            loop[n_loops].end = instr[i].address;
+            n_loops++;
+        }
+    }
+    qsort(loop, n_loops, sizeof(loop[0]), list_loop_compare);
+    while ((n_trips < N_BENCH_LOOPS) && bench->loops[n_trips])
+    {
+        n_trips++;
+    }
+    
+    printf("%-28s %5d instr %6lu cycles/pass", "", n, straight);
+    if (n_loops != n_trips)
+    {
+        printf("   %d loops in listing, %d trip counts given", n_loops, n_trips);
+    }
+    else
+    {
+        for (i = 0 ; i < n ; i++)
+        {
+            weight = 1.0;
+            for (k = 0 ; k < n_loops ; k++)
+            {
+                if ((instr[i].address >= loop[k].start) && (instr[i].address <= loop[k].end))
+                {
+                    weight *= bench->loops[k];
+                }
+            }
+            weighted += instr[i].cycles * weight;
+        }
+        printf(" %9.0f cycles/call %8.1f us", weighted, weighted * 1e6 / HOST_TICKS_PER_S);
+    }
+    printf("%s\n", n_calls ? "   +calls" : "");
+}
+
+// Lists the size of the firmware state and its total
+void bench_ram(void)
+{
+    size_t total = 0;
+    unsigned int i;
+    
+    printf("%-28s %8s\n", "State", "Bytes");
+    printf("-------------------------------------\n");
+    for (i = 0 ; i < N_BENCH_RAM ; i++)
+    {
+        printf("%-28s %8zu\n", g_bench_ram[i].name, g_bench_ram[i].size);
+        total += g_bench_ram[i].size;
+    }
+    printf("%-28s %8zu\n", "total", total);
+}
+
+//////////////////////////
+// Error bounds //////////
+//////////////////////////
+
+// Keeps the worst error of a conversion and the input it was at
+void bench_error(bench_error_t * e, double error, double at)
+{
+    error = fabs(error);
+    if (error > e->worst)
+    {
+        e->worst = error;
+        e->at = at;
+    }
+}
+
+// Temperature of a thermistor code in C as thermistor_convert_data worked it
+// out in float
+double bench_thermistor_c(double raw)
+{
+    double r = THERMISTOR_SERIES * raw / (LSBS_PER_VOLT * THERMISTOR_SUPPLY - raw);
+    
+    return 1.0 / (log(r / THERMISTOR_NOMINAL) / B_COEFF + 1.0 / (TEMPERATURE_NOMINAL + 273.15)) - 273.15;
+}
+
+// Runs the internal resistance estimator on sweeps of the pack model, one
+// sweep in the middle of every current step, and keeps the worst error of
+// the estimates
+void bench_ir(bench_error_t * e)
+{
+    int k;
+    int i;
+    
+    g_pack.step_ticks = BENCH_IR_STEP_TICKS;
+    for (k = 0 ; k < BENCH_IR_SWEEPS ; k++)
+    {
+        host_wait((host_ticks() / BENCH_IR_STEP_TICKS + 1) * BENCH_IR_STEP_TICKS + BENCH_IR_STEP_TICKS / 2);
+        sweep_capture();
+        ir_estimator_update(g_cells.voltage, g_sweep.current);
+    }
+    g_pack.step_ticks = 0;
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        bench_error(e, ir_estimator_get(i) - pack_cell_ohms(i) * 1e6, i);
+    }
+}
+
+// Packets of the UART frame in the order uart_telem_send writes them
+static const bench_uart_packet_t g_bench_uart_packet[] =
+{
+    {VOLTAGE_ID,  2 * N_CELLS},
+    {TEMP_ID,     N_ADC_CHANNELS},
+#if !UART_TELEM_LEGACY
+    {TEMP_RAW_ID, 2 * N_ADC_CHANNELS},
+#endif
+    {CURRENT_ID,  2},
+    {BALANCE_ID,  4},
+    {STATUS_ID,   1},
+#if !UART_TELEM_LEGACY
+    {TIME_ID,     12},
+#endif
+};
+
+// CRC16 CCITT (init 0xFFFF) worked out bit by bit
+unsigned int16 bench_crc16(const unsigned int8 * data, int len)
+{
+    unsigned int16 crc = 0xFFFF;
+    int i;
+    int b;
+    
+    for (i = 0 ; i < len ; i++)
+    {
+        crc ^= (unsigned int16)data[i] << 8;
+        for (b = 0 ; b < 8 ; b++)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Sends a few UART frames and keeps the most bytes of one that break the
+// layout of the build
+void bench_uart(bench_error_t * e)
+{
+    const unsigned int8 * f = g_uart_telem_frame;
+    int n_packets = sizeof(g_bench_uart_packet) / sizeof(g_bench_uart_packet[0]);
+    int bad;
+    int p;
+    int k;
+    int i;
+#if !UART_TELEM_LEGACY
+    unsigned int8 seq = g_uart_telem_seq;
+    unsigned int16 crc;
+#endif
+    
+    for (k = 0 ; k < 3 ; k++)
+    {
+        // The previous transfer is over
+        UART_TELEM_DMA4CON &= 0x7FFF;
+        UART_TELEM_DMA4REQ &= 0x7FFF;
+        bad = !uart_telem_send(&g_cells, &g_temperatures, &g_current, gb_connected, g_sweep.time, g_state_time);
+        
+        p = UART_TELEM_HEADER_LEN;
+        for (i = 0 ; i < n_packets ; i++)
+        {
+            bad += (f[p] != g_bench_uart_packet[i].id);
+            p += 1 + g_bench_uart_packet[i].len;
+        }
+        bad += (p != UART_TELEM_HEADER_LEN + UART_TELEM_PAYLOAD_LEN);
+        bad += (UART_TELEM_DMA4CNT + 1 != UART_TELEM_FRAME_LEN);
+#if !UART_TELEM_LEGACY
+        bad += (f[0] != UART_TELEM_SYNC0);
+        bad += (f[1] != UART_TELEM_SYNC1);
+        bad += (f[2] != (unsigned int8)(seq + k));
+        bad += (f[3] != UART_TELEM_PAYLOAD_LEN);
+        crc = bench_crc16(&f[2], p - 2);
+        bad += (f[p] != (unsigned int8)(crc >> 8));
+        bad += (f[p + 1] != (unsigned int8)crc);
+#endif
+        bench_error(e, bad, k);
+    }
+    UART_TELEM_DMA4CON &= 0x7FFF;
+    UART_TELEM_DMA4REQ &= 0x7FFF;
+}
+
+// Checks the fixed point conversions over their ranges, returns the number
+// of bounds exceeded. The math functions are compared at their Q16.16
+// inputs, so the rounding of the input is not counted against them.
+int bench_errors(void)
+{
+    bench_error_t e[] =
+    {
+        {"fix_ln 2^-12..2^14",             "",      1e-3, 0, 0},
+        {"fix_exp -2..10",                 "rel",   1e-3, 0, 0},
+        {"fix_mul/fix_div",                "",      2.0 / FIX_ONE, 0, 0},
+        {"thermistor_convert_data -20..100 C", "C", 0.1, 0, 0},
+        {"hall_sensor_adjust_current",     "mA",    0.5, 0, 0},
+        {"ltc6804_cell_mv",                "mV",    0.5, 0, 0},
+        {"ir_estimator_update",            "uOhm",  20.0, 0, 0},
+        {UART_TELEM_LEGACY ? "uart_telem_send legacy layout" : "uart_telem_send framed layout", "bytes", 0.0, 0, 0},
+    };
+    int n_e = sizeof(e) / sizeof(e[0]);
+    int n_exceeded = 0;
+    double x;
+    double y;
+    double q;
+    int raw;
+    int i;
+    
+    for (x = 1.0 / 4096 ; x < 16384.0 ; x *= 1.001)
+    {
+        q = FIX_CONST(x) / 65536.0;
+        bench_error(&e[0], fix_ln(FIX_CONST(x)) / 65536.0 - log(q), x);
+    }
+    for (x = -2.0 ; x <= 10.0 ; x += 0.001)
+    {
+        q = FIX_CONST(x) / 65536.0;
+        bench_error(&e[1], (fix_exp(FIX_CONST(x)) / 65536.0 - exp(q)) / exp(q), x);
+    }
+    for (x = -100.0 ; x <= 100.0 ; x += 0.37)
+    {
+        q = FIX_CONST(x) / 65536.0;
+        y = FIX_CONST(3.0 - x / 50.0) / 65536.0;
+        bench_error(&e[2], fix_mul(FIX_CONST(q), FIX_CONST(y)) / 65536.0 - q * y, x);
+        bench_error(&e[2], fix_div(FIX_CONST(q), FIX_CONST(y)) / 65536.0 - q / y, x);
+    }
+    for (raw = ads_model_counts(100.0) ; raw <= ads_model_counts(-20.0) ; raw++)
+    {
+        bench_error(&e[3], thermistor_convert_data(raw) / 10.0 - bench_thermistor_c(raw), raw);
+    }
+    for (raw = 0 ; raw < 4096 ; raw++)
+    {
+        bench_error(&e[4], hall_sensor_adjust_current(raw) - (raw - CURRENT_ZERO) * 100000.0 / CURRENT_SLOPE_X100, raw);
+    }
+    for (raw = 0 ; raw < 65536 ; raw++)
+    {
+        bench_error(&e[5], ltc6804_cell_mv(raw) - raw / 10.0, raw);
+    }
+    bench_ir(&e[6]);
+    bench_uart(&e[7]);
+    
+    printf("%-36s %12s %12s %12s\n", "Conversion", "Worst error", "Bound", "At");
+    printf("-----------------------------------------------------------------------------\n");
+    for (i = 0 ; i < n_e ; i++)
+    {
+        printf("%-36s %12.6f %12.6f %12.4f %s%s\n", e[i].name, e[i].worst, e[i].bound, e[i].at, e[i].unit,
+               (e[i].worst > e[i].bound) ? "   EXCEEDED" : "");
+        n_exceeded += (e[i].worst > e[i].bound);
+    }
+    return n_exceeded;
+}
+
+int main(int argc, char ** argv)
+{
+    const char * filter = 0;
+    const char * listing = 0;
+    double min_s = 0.5;
+    unsigned long iterations;
+    double ns;
+    unsigned int i;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "f:t:l:me")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f': filter = optarg; break;
+            case 't': min_s = atof(optarg); break;
+            case 'l': listing = optarg; break;
+            case 'm':
+                bench_ram();
+                return 0;
+            case 'e':
+                if (host_hal_init(0.0) < 0)
+                {
+                    return 1;
+                }
+                return (bench_errors() > 0) ? 1 : 0;
+            default:
+                fprintf(stderr, "usage: %s [-f name filter] [-t min time s] [-l main.lst] [-m] [-e]\n", argv[0]);
+                return 1;
+        }
+    }
+    
+    if (host_hal_init(0.0) < 0)
+    {
+        return 1;
+    }
+    printf("%-28s %12s %14s\n", "Benchmark", "Time", "Iterations");
+    printf("----------------------------------------------------------\n");
+    for (i = 0 ; i < N_BENCH ; i++)
+    {
+        if (filter && !strstr(g_bench[i].name, filter))
+        {
+            continue;
+        }
+        if (g_bench[i].setup)
+        {
+            g_bench[i].setup();
+        }
+        ns = bench_time(&g_bench[i], min_s, &iterations);
+        printf("%-28s %9.1f ns %14lu\n", g_bench[i].name, ns, iterations);
+        if (listing)
+        {
+            list_estimate(listing, &g_bench[i]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,617 @@
+#ifndef BMS_DEVICES_C
+#define BMS_DEVICES_C
+
+// Device models for the host build of the BMS
+// A simple pack (cell voltages, thermistor temperatures and pack current)
+// feeds models of the three LTC6804s on SPI1, the two ADS7952s on SPI2, the
+// hall sensor on the internal ADC and the CAT24AA02 eeprom on I2C. A fault
+// can be injected into the pack at a set time to exercise the trip sequence.
+// The pack can also be driven from a replay file, one sample per line:
+//   <time s> <signal> <value>
+// where the signal is cell1-cell30 (V), temp1-temp24 (C), current (A,
+// positive when discharging), cells or temps for all of them. Lines starting
+// with # are comments. A sample holds until the next one for its signal,
+// signals never replayed keep their default and an injected fault still
+// applies on top.
+// Cells whose LTC6804 discharge bit is set lose PACK_BLEED_VOLTS_PER_S, far
+// faster than a real bleed resistor so balancing sessions finish in seconds.
+// Every cell has its own internal resistance (pack_cell_ohms), the modelled
+// cell voltages drop by it times the pack current. With step_ticks set the
+// current steps up by PACK_STEP_A every other step_ticks, which gives
+// ir_estimator.c the steps it needs.
+
+#include <math.h>
+
+#define PACK_CELL_VOLTS      3.70 // Healthy cell voltage
+#define PACK_CELL_SPREAD   0.0005 // Added per cell index so the cells differ
+#define PACK_TEMP_C          25.0
+#define PACK_CURRENT_A       10.0 // Positive when discharging
+#define PACK_FAULT_CELL         0 // Cell or thermistor the fault is applied to
+#define PACK_BLEED_VOLTS_PER_S 0.001
+#define PACK_CELL_OHMS     0.0015 // Internal resistance of cell 0
+#define PACK_CELL_OHMS_SPREAD 0.00002 // Added per cell index
+#define PACK_STEP_A          30.0 // Current step, see step_ticks
+
+// Replayed signals, cells then thermistors then the current
+#define PACK_SIGNAL_TEMP     N_CELLS
+#define PACK_SIGNAL_CURRENT  (N_CELLS + N_ADC_CHANNELS)
+#define N_PACK_SIGNALS       (PACK_SIGNAL_CURRENT + 1)
+#define PACK_SIGNAL_CELLS    (-1)
+#define PACK_SIGNAL_TEMPS    (-2)
+
+typedef enum
+{
+    PACK_FAULT_NONE,
+    PACK_FAULT_OV,  // Cell over VOLTAGE_MAX
+    PACK_FAULT_UV,  // Cell under VOLTAGE_MIN
+    PACK_FAULT_OT,  // Thermistor over TEMP_CRITICAL
+    PACK_FAULT_OC,  // Discharge current over DISCHARGE_LIMIT_AMPS
+    N_PACK_FAULTS
+} pack_fault_t;
+
+const char * g_pack_fault_name[N_PACK_FAULTS] = {"none", "ov", "uv", "ot", "oc"};
+
+typedef struct
+{
+    unsigned long long ticks;  // Host time the sample applies from
+    int                signal; // PACK_SIGNAL_x or a signal index
+    double             value;
+} pack_sample_t;
+
+typedef struct
+{
+    pack_fault_t       fault;
+    unsigned long long fault_ticks; // Host time the fault appears
+    pack_sample_t *    replay;
+    int                n_replay;
+    int                replay_next; // First sample not applied yet
+    int1               b_replayed[N_PACK_SIGNALS];
+    double             value[N_PACK_SIGNALS];
+    unsigned long      discharge;         // Cells being bled, bit per cell
+    unsigned long long bleed_ticks;       // Host time the bleed was last applied
+    double             bleed[N_CELLS];    // Volts lost to bleeding
+    unsigned long long step_ticks;        // Current step period, 0 for none
+} pack_model_t;
+
+static pack_model_t g_pack;
+
+// Returns the signal index of a replay signal name, N_PACK_SIGNALS if unknown
+int pack_signal(const char * name)
+{
+    int n;
+    
+    if (strcmp(name, "current") == 0)
+    {
+        return PACK_SIGNAL_CURRENT;
+    }
+    if (strcmp(name, "cells") == 0)
+    {
+        return PACK_SIGNAL_CELLS;
+    }
+    if (strcmp(name, "temps") == 0)
+    {
+        return PACK_SIGNAL_TEMPS;
+    }
+    if ((sscanf(name, "cell%d", &n) == 1) && (n >= 1) && (n <= N_CELLS))
+    {
+        return n - 1;
+    }
+    if ((sscanf(name, "temp%d", &n) == 1) && (n >= 1) && (n <= N_ADC_CHANNELS))
+    {
+        return PACK_SIGNAL_TEMP + n - 1;
+    }
+    return N_PACK_SIGNALS;
+}
+
+// Loads a replay file, returns -1 with a message on error
+int pack_replay_load(const char * path)
+{
+    FILE * file = fopen(path, "r");
+    char line[128];
+    char name[32];
+    double time_s;
+    double value;
+    double last_s = 0.0;
+    int line_n = 0;
+    int signal;
+    
+    if (!file)
+    {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file))
+    {
+        line_n++;
+        if ((line[0] == '#') || (sscanf(line, "%lf %31s %lf", &time_s, name, &value) != 3))
+        {
+            if ((line[0] != '#') && (strspn(line, " \t\r\n") != strlen(line)))
+            {
+                fprintf(stderr, "%s:%d: expected <time s> <signal> <value>\n", path, line_n);
+                fclose(file);
+                return -1;
+            }
+            continue;
+        }
+        signal = pack_signal(name);
+        if (signal == N_PACK_SIGNALS)
+        {
+            fprintf(stderr, "%s:%d: unknown signal %s\n", path, line_n, name);
+            fclose(file);
+            return -1;
+        }
+        if (time_s < last_s)
+        {
+            fprintf(stderr, "%s:%d: time goes backwards\n", path, line_n);
+            fclose(file);
+            return -1;
+        }
+        last_s = time_s;
+        
+        g_pack.replay = realloc(g_pack.replay, (g_pack.n_replay + 1) * sizeof(pack_sample_t));
+        g_pack.replay[g_pack.n_replay].ticks = (unsigned long long)(time_s * HOST_TICKS_PER_S);
+        g_pack.replay[g_pack.n_replay].signal = signal;
+        g_pack.replay[g_pack.n_replay].value = value;
+        g_pack.n_replay++;
+    }
+    fclose(file);
+    return 0;
+}
+
+void pack_replay_set(int first, int n, double value)
+{
+    int i;
+    
+    for (i = first ; i < first + n ; i++)
+    {
+        g_pack.value[i] = value;
+        g_pack.b_replayed[i] = true;
+    }
+}
+
+// Applies the replay samples that have come due
+void pack_replay_update(void)
+{
+    unsigned long long now = host_ticks();
+    pack_sample_t * sample;
+    
+    while ((g_pack.replay_next < g_pack.n_replay) && (g_pack.replay[g_pack.replay_next].ticks <= now))
+    {
+        sample = &g_pack.replay[g_pack.replay_next++];
+        if (sample->signal == PACK_SIGNAL_CELLS)
+        {
+            pack_replay_set(0, N_CELLS, sample->value);
+        }
+        else if (sample->signal == PACK_SIGNAL_TEMPS)
+        {
+            pack_replay_set(PACK_SIGNAL_TEMP, N_ADC_CHANNELS, sample->value);
+        }
+        else
+        {
+            pack_replay_set(sample->signal, 1, sample->value);
+        }
+        if (g_pack.replay_next == g_pack.n_replay)
+        {
+            host_log("replay finished");
+        }
+    }
+}
+
+// Applies the bleed since the last call and sets the cells being bled from
+// now on
+void pack_bleed(unsigned long discharge)
+{
+    unsigned long long now = host_ticks();
+    double dt = g_pack.bleed_ticks ? (double)(now - g_pack.bleed_ticks) / HOST_TICKS_PER_S : 0.0;
+    int i;
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        if (g_pack.discharge & (1UL << i))
+        {
+            g_pack.bleed[i] += PACK_BLEED_VOLTS_PER_S * dt;
+        }
+    }
+    g_pack.discharge = discharge;
+    g_pack.bleed_ticks = now;
+}
+
+// Returns the pack current in amps, positive when discharging
+double pack_current_a(void)
+{
+    pack_replay_update();
+    if ((g_pack.fault == PACK_FAULT_OC) && (host_ticks() >= g_pack.fault_ticks))
+    {
+        return DISCHARGE_LIMIT_AMPS + 15.0;
+    }
+    if (g_pack.b_replayed[PACK_SIGNAL_CURRENT])
+    {
+        return g_pack.value[PACK_SIGNAL_CURRENT];
+    }
+    if (g_pack.step_ticks && ((host_ticks() / g_pack.step_ticks) & 1))
+    {
+        return PACK_CURRENT_A + PACK_STEP_A;
+    }
+    return PACK_CURRENT_A;
+}
+
+// Returns the internal resistance of a cell in ohms
+double pack_cell_ohms(int i)
+{
+    return PACK_CELL_OHMS + PACK_CELL_OHMS_SPREAD * i;
+}
+
+// Returns the cell voltage in volts
+double pack_cell_volts(int i)
+{
+    pack_replay_update();
+    pack_bleed(g_pack.discharge);
+    if ((g_pack.fault != PACK_FAULT_NONE) && (host_ticks() >= g_pack.fault_ticks) && (i == PACK_FAULT_CELL))
+    {
+        if (g_pack.fault == PACK_FAULT_OV)
+        {
+            return VOLTAGE_MAX / 10000.0 + 0.05;
+        }
+        if (g_pack.fault == PACK_FAULT_UV)
+        {
+            return VOLTAGE_MIN / 10000.0 - 0.05;
+        }
+    }
+    if (g_pack.b_replayed[i])
+    {
+        return g_pack.value[i] - g_pack.bleed[i];
+    }
+    return PACK_CELL_VOLTS + PACK_CELL_SPREAD * i - pack_current_a() * pack_cell_ohms(i) - g_pack.bleed[i];
+}
+
+// Returns a thermistor temperature in degrees C
+double pack_temp_c(int i)
+{
+    pack_replay_update();
+    if ((g_pack.fault == PACK_FAULT_OT) && (host_ticks() >= g_pack.fault_ticks) && (i == PACK_FAULT_CELL))
+    {
+        return TEMP_CRITICAL + 5.0;
+    }
+    if (g_pack.b_replayed[PACK_SIGNAL_TEMP + i])
+    {
+        return g_pack.value[PACK_SIGNAL_TEMP + i];
+    }
+    return PACK_TEMP_C;
+}
+
+//////////////////////////
+// LTC6804 (SPI1) ////////
+//////////////////////////
+
+#define LTC_MODEL_BYTE_TICKS  640 // 8 bits at 125 kHz
+#define N_LTC_MODELS            3
+
+typedef struct
+{
+    int            cs_pin;
+    int            first_cell;
+    int            n_cells;
+    unsigned int8  rx[12];        // Bytes clocked in since CS fell
+    int            rx_n;
+    unsigned int8  tx[8];         // Response to a read command
+    int            tx_n;
+    int            tx_len;
+    unsigned int16 cell[12];      // Cell voltage registers, 0.1 mV
+    unsigned int16 discharge;     // DCC bits from the configuration
+} ltc_model_t;
+
+static ltc_model_t g_ltc_model[N_LTC_MODELS] =
+{
+    {CSBI1,  0, 12},
+    {CSBI2, 12, 12},
+    {CSBI3, 24,  6},
+};
+
+// Returns the LTC6804 routed to MISO by the mux, -1 if none
+int ltc_model_selected(int1 sel0, int1 sel1)
+{
+    // See SELECT_LTC_x in ltc6804.c, LTC-1 = 10, LTC-2 = 01, LTC-3 = 00
+    switch ((sel1 << 1) | sel0)
+    {
+        case 2:
+            return 0;
+        case 1:
+            return 1;
+        case 0:
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+// Handles a command once its 4 bytes (command and PEC) have been clocked in
+void ltc_model_command(ltc_model_t * ltc)
+{
+    unsigned int16 command = ((ltc->rx[0] << 8) | ltc->rx[1]) & 0x07FF;
+    unsigned int16 pec;
+    int group;
+    int i;
+    
+    if (pec15((char *)ltc->rx, 2) != ((ltc->rx[2] << 8) | ltc->rx[3]))
+    {
+        // The LTC6804 ignores commands with a bad PEC
+        return;
+    }
+    
+    if (command == ADCV)
+    {
+        for (i = 0 ; i < ltc->n_cells ; i++)
+        {
+            ltc->cell[i] = (unsigned int16)(pack_cell_volts(ltc->first_cell + i) * 10000.0 + 0.5);
+        }
+    }
+    else if ((command >= RDCVA) && (command <= RDCVD) && !(command & 1))
+    {
+        group = (command - RDCVA) / 2;
+        for (i = 0 ; i < 3 ; i++)
+        {
+            ltc->tx[2*i]   = (unsigned int8)(ltc->cell[3*group + i]);
+            ltc->tx[2*i+1] = (unsigned int8)(ltc->cell[3*group + i] >> 8);
+        }
+        pec = pec15((char *)ltc->tx, 6);
+        ltc->tx[6] = (unsigned int8)(pec >> 8);
+        ltc->tx[7] = (unsigned int8)(pec);
+        ltc->tx_n = 0;
+        ltc->tx_len = 8;
+    }
+}
+
+// Clocks a byte into every LTC6804 with its chip select low
+void ltc_model_write(unsigned int8 data)
+{
+    ltc_model_t * ltc;
+    unsigned int16 discharge;
+    unsigned long mask;
+    int k;
+    
+    for (k = 0 ; k < N_LTC_MODELS ; k++)
+    {
+        ltc = &g_ltc_model[k];
+        if (input_state(ltc->cs_pin) || (ltc->rx_n >= 12))
+        {
+            continue;
+        }
+        ltc->rx[ltc->rx_n++] = data;
+        if (ltc->rx_n == 4)
+        {
+            ltc_model_command(ltc);
+        }
+        else if ((ltc->rx_n == 12) && ((((ltc->rx[0] << 8) | ltc->rx[1]) & 0x07FF) == WRCFG)
+                 && (pec15((char *)&ltc->rx[4], 6) == ((ltc->rx[10] << 8) | ltc->rx[11])))
+        {
+            discharge = ((ltc->rx[9] & 0x0F) << 8) | ltc->rx[8];
+            if (discharge != ltc->discharge)
+            {
+                host_log("LTC-%d discharge 0x%03X", k+1, discharge);
+                ltc->discharge = discharge;
+                mask = ((1UL << ltc->n_cells) - 1) << ltc->first_cell;
+                pack_bleed((g_pack.discharge & ~mask) | (((unsigned long)discharge << ltc->first_cell) & mask));
+            }
+        }
+    }
+    host_busy(LTC_MODEL_BYTE_TICKS);
+}
+
+// Returns the next response byte of the LTC6804 selected by the MISO mux
+unsigned int8 ltc_model_read(void)
+{
+    ltc_model_t * ltc;
+    int k = ltc_model_selected(input_state(MISO_SEL0), input_state(MISO_SEL1));
+    
+    host_busy(LTC_MODEL_BYTE_TICKS);
+    if (k < 0)
+    {
+        return 0xFF;
+    }
+    ltc = &g_ltc_model[k];
+    if (input_state(ltc->cs_pin) || (ltc->tx_n >= ltc->tx_len))
+    {
+        return 0xFF;
+    }
+    return ltc->tx[ltc->tx_n++];
+}
+
+// Chip select edges start and end a transfer
+void ltc_model_pin(int pin, int1 value)
+{
+    int k;
+    
+    for (k = 0 ; k < N_LTC_MODELS ; k++)
+    {
+        if ((g_ltc_model[k].cs_pin == pin) && value)
+        {
+            g_ltc_model[k].rx_n = 0;
+            g_ltc_model[k].tx_n = 0;
+            g_ltc_model[k].tx_len = 0;
+        }
+    }
+}
+
+//////////////////////////
+// ADS7952 (SPI2) ////////
+//////////////////////////
+
+#define ADS_MODEL_BYTE_TICKS 640 // 8 bits at 125 kHz
+#define N_ADS_MODELS           2
+
+typedef struct
+{
+    int             sel_pin;
+    unsigned int8 * channel_map; // Thermistor of each ADC channel
+    int             channel;     // Auto-1 sequence position
+    int             n_bytes;     // Bytes in the current frame
+    unsigned int16  frame;       // Output word of the current frame
+} ads_model_t;
+
+static ads_model_t g_ads_model[N_ADS_MODELS] =
+{
+    {ADC1_SEL, g_channel_map1},
+    {ADC2_SEL, g_channel_map2},
+};
+
+// Returns the ADC reading of a thermistor, inverse of thermistor_convert_data
+unsigned int16 ads_model_counts(double temp_c)
+{
+    double r = THERMISTOR_NOMINAL * exp(B_COEFF * (1.0 / (temp_c + 273.15) - 1.0 / (TEMPERATURE_NOMINAL + 273.15)));
+    
+    return (unsigned int16)(LSBS_PER_VOLT * THERMISTOR_SUPPLY * r / (r + THERMISTOR_SERIES) + 0.5);
+}
+
+// Clocks a byte through the selected ADS7952, programming frames restart the
+// Auto-1 sequence
+unsigned int8 ads_model_transfer(unsigned int8 data, int1 b_program)
+{
+    ads_model_t * ads;
+    unsigned int8 out = 0xFF;
+    int k;
+    
+    host_busy(ADS_MODEL_BYTE_TICKS);
+    for (k = 0 ; k < N_ADS_MODELS ; k++)
+    {
+        ads = &g_ads_model[k];
+        if (input_state(ads->sel_pin))
+        {
+            continue;
+        }
+        if (b_program)
+        {
+            ads->channel = 0;
+        }
+        else if (ads->n_bytes == 0)
+        {
+            ads->frame = (ads->channel << 12)
+                       | ads_model_counts(pack_temp_c(ads->channel_map[ads->channel]));
+            out = (unsigned int8)(ads->frame >> 8);
+        }
+        else
+        {
+            out = (unsigned int8)(ads->frame);
+        }
+        ads->n_bytes++;
+    }
+    return out;
+}
+
+// The end of a frame moves the Auto-1 sequence to the next channel
+void ads_model_pin(int pin, int1 value)
+{
+    ads_model_t * ads;
+    int k;
+    
+    for (k = 0 ; k < N_ADS_MODELS ; k++)
+    {
+        ads = &g_ads_model[k];
+        if ((ads->sel_pin == pin) && value)
+        {
+            if (ads->n_bytes >= 2)
+            {
+                ads->channel = (ads->channel + 1) % 12;
+            }
+            ads->n_bytes = 0;
+        }
+    }
+}
+
+//////////////////////////
+// Hall sensor (ADC) /////
+//////////////////////////
+
+static int            g_adc_channel;
+static unsigned int16 g_adc_result;
+
+// Samples the selected channel
+void adc_model_convert(void)
+{
+    if (g_adc_channel == HALL_ADC_CHANNEL)
+    {
+        g_adc_result = (unsigned int16)(CURRENT_ZERO + CURRENT_SLOPE_X100 / 100.0 * pack_current_a() + 0.5);
+    }
+    else
+    {
+        g_adc_result = 2048;
+    }
+}
+
+//////////////////////////
+// CAT24AA02 (I2C) ///////
+//////////////////////////
+
+#define EEPROM_MODEL_BYTE_TICKS 900 // 9 bits at 100 kHz
+#define EEPROM_MODEL_SIZE       256
+
+typedef enum
+{
+    EEPROM_MODEL_IDLE,
+    EEPROM_MODEL_ADDRESS, // Next write is the word address
+    EEPROM_MODEL_WRITE,   // Writes store data
+    EEPROM_MODEL_READ,    // Reads return data
+} eeprom_model_state_t;
+
+static unsigned int8        g_eeprom_model[EEPROM_MODEL_SIZE];
+static unsigned int8        g_eeprom_model_address;
+static eeprom_model_state_t g_eeprom_model_state;
+static int1                 gb_eeprom_model_start;
+
+void eeprom_model_init(void)
+{
+    memset(g_eeprom_model, 0xFF, sizeof(g_eeprom_model));
+}
+
+void eeprom_model_start(void)
+{
+    gb_eeprom_model_start = true;
+}
+
+void eeprom_model_stop(void)
+{
+    g_eeprom_model_state = EEPROM_MODEL_IDLE;
+}
+
+int1 eeprom_model_write(unsigned int8 data)
+{
+    host_busy(EEPROM_MODEL_BYTE_TICKS);
+    if (gb_eeprom_model_start)
+    {
+        // Device address after a start
+        gb_eeprom_model_start = false;
+        if ((data & 0xFE) != DEVICE_ADDRESS)
+        {
+            g_eeprom_model_state = EEPROM_MODEL_IDLE;
+            return 1; // NACK
+        }
+        g_eeprom_model_state = (data & I2C_READ_BIT) ? EEPROM_MODEL_READ : EEPROM_MODEL_ADDRESS;
+        return 0;
+    }
+    switch (g_eeprom_model_state)
+    {
+        case EEPROM_MODEL_ADDRESS:
+            g_eeprom_model_address = data;
+            g_eeprom_model_state = EEPROM_MODEL_WRITE;
+            return 0;
+        case EEPROM_MODEL_WRITE:
+            // The address wraps within the page, as on the device
+            g_eeprom_model[g_eeprom_model_address] = data;
+            g_eeprom_model_address = (g_eeprom_model_address & ~(EEPROM_PAGE_LEN - 1)) |
+                                     ((g_eeprom_model_address + 1) & (EEPROM_PAGE_LEN - 1));
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+unsigned int8 eeprom_model_read(void)
+{
+    host_busy(EEPROM_MODEL_BYTE_TICKS);
+    if (g_eeprom_model_state != EEPROM_MODEL_READ)
+    {
+        return 0xFF;
+    }
+    return g_eeprom_model[g_eeprom_model_address++];
+}
+
+#endif
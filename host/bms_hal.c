@@ -0,0 +1,593 @@
+#ifndef BMS_HAL_C
+#define BMS_HAL_C
+
+// Host implementation of bms_hal.h, included after the firmware so it can
+// call the interrupt handlers.
+// Time runs on CLOCK_MONOTONIC in Fcy ticks (0.1 us). The firmware main loop
+// runs until it delays, and while it waits host_service() runs the interrupt
+// handlers that have become due: the timers at their programmed periods, the
+// CAN1 event and receive interrupts, and the end of a UART DMA transfer.
+// Handlers do not nest, delays inside a handler only wait. SPI and I2C
+// transfers add their bus time to the next delay so a sweep takes as long as
+// it does on the PIC.
+// Waits sleep on a timerfd armed for the next event together with the CAN
+// socket. How late the timer handlers and CAN receptions are dispatched is
+// kept as jitter statistics, reported every report period and on SIGINT or
+// SIGTERM.
+// With gb_host_no_wait set nothing is serviced and nothing waits, delays only
+// add up the time they would have blocked for. The WCET harness uses this to
+// run the handlers one at a time.
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define HOST_JITTER_BINS 24 // log2 bins of 1 us, the last one open ended
+
+typedef struct
+{
+    const char *       name;
+    unsigned long long n;
+    unsigned long long missed;                 // Periods lost to late dispatch
+    unsigned long long sum;                    // Ticks
+    unsigned long long max;                    // Ticks
+    unsigned long long bins[HOST_JITTER_BINS]; // Bin 0 under 1 us, bin k under 2^k us
+} host_jitter_t;
+
+typedef struct
+{
+    unsigned long long period; // Ticks, 0 when the timer is off
+    unsigned long long next;   // Host time of the next period match
+    host_jitter_t      jitter; // Dispatch delay after the match
+} host_timer_t;
+
+static struct timespec    g_host_start;
+static int1               g_host_pin[N_HOST_PINS];
+static unsigned int16     g_host_tris_f = 0xFFFF;
+static unsigned int16     g_host_tris_g = 0xFFFF;
+static int1               gb_host_int_enabled[N_HOST_INTS];
+static int1               gb_host_in_isr = false;
+static unsigned long long g_host_busy = 0;         // Bus time owed by SPI and I2C transfers
+static host_timer_t       g_host_timer1 = {0, 0, {"timer1"}};
+static host_timer_t       g_host_timer4 = {0, 0, {"timer4"}};
+static host_jitter_t      g_host_rx_jitter = {"c1rx"}; // Kernel receive to isr_c1rx
+static int                g_host_timerfd = -1;
+static unsigned long long g_host_report_period = 0; // Ticks between jitter reports, 0 for none
+static unsigned long long g_host_report_next = 0;
+static volatile sig_atomic_t gb_host_stop = false;
+static unsigned long long g_host_blocked = 0;      // Delay time skipped with gb_host_no_wait
+static unsigned long long g_host_timer23_base = 0; // Host time timer 2/3 was zero
+static unsigned int32     g_host_timer23_wraps = 0;
+static unsigned long long g_host_uart_end = 0;     // End of the UART DMA transfer, 0 if idle
+static int                g_host_uart_fd = -1;     // UART output, -1 to discard
+
+unsigned int16 UART_TELEM_DMA4CON;
+unsigned int16 UART_TELEM_DMA4REQ;
+unsigned int16 UART_TELEM_DMA4STA;
+unsigned int16 UART_TELEM_DMA4CNT;
+unsigned int16 UART_TELEM_U1TXREG;
+void *         UART_TELEM_DMA4PAD;
+int1           gb_host_no_wait = false;
+
+unsigned long long host_ticks(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)(now.tv_sec - g_host_start.tv_sec) * HOST_TICKS_PER_S
+         + (now.tv_nsec - g_host_start.tv_nsec) / 100;
+}
+
+// Prints a line stamped with CLOCK_MONOTONIC so it lines up with netsim
+void host_log(const char * format, ...)
+{
+    struct timespec now;
+    va_list args;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("%6ld.%06ld %-8s", (long)now.tv_sec, now.tv_nsec / 1000, "bms");
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    fflush(stdout);
+}
+
+void host_busy(unsigned long long ticks)
+{
+    g_host_busy += ticks;
+}
+
+//////////////////////////
+// Jitter ////////////////
+//////////////////////////
+
+void host_jitter_add(host_jitter_t * jitter, unsigned long long ticks)
+{
+    unsigned long long us = ticks / (HOST_TICKS_PER_S / 1000000);
+    int bin = 0;
+    
+    while ((us != 0) && (bin < HOST_JITTER_BINS - 1))
+    {
+        us >>= 1;
+        bin++;
+    }
+    jitter->bins[bin]++;
+    jitter->n++;
+    jitter->sum += ticks;
+    if (ticks > jitter->max)
+    {
+        jitter->max = ticks;
+    }
+}
+
+void host_rx_latency(unsigned long long ticks)
+{
+    host_jitter_add(&g_host_rx_jitter, ticks);
+}
+
+// Returns the upper bound in us of the bin holding the given fraction
+unsigned long long host_jitter_percentile(host_jitter_t * jitter, double fraction)
+{
+    unsigned long long count = 0;
+    int bin;
+    
+    for (bin = 0 ; bin < HOST_JITTER_BINS - 1 ; bin++)
+    {
+        count += jitter->bins[bin];
+        if (count >= fraction * jitter->n)
+        {
+            break;
+        }
+    }
+    return 1ULL << bin;
+}
+
+void host_jitter_print(host_jitter_t * jitter)
+{
+    if (jitter->n == 0)
+    {
+        host_log("jitter %-6s none", jitter->name);
+        return;
+    }
+    host_log("jitter %-6s n %llu mean %.1f us p50 <%llu us p99 <%llu us max %.1f us missed %llu",
+             jitter->name, jitter->n, jitter->sum / 10.0 / jitter->n,
+             host_jitter_percentile(jitter, 0.50), host_jitter_percentile(jitter, 0.99),
+             jitter->max / 10.0, jitter->missed);
+}
+
+void host_jitter_report(void)
+{
+    host_jitter_print(&g_host_timer4.jitter);
+    host_jitter_print(&g_host_timer1.jitter);
+    host_jitter_print(&g_host_rx_jitter);
+}
+
+void host_signal(int sig)
+{
+    gb_host_stop = true;
+}
+
+//////////////////////////
+// Pins //////////////////
+//////////////////////////
+
+void output_bit(int pin, int value)
+{
+    value = (value != 0);
+    if (value == g_host_pin[pin])
+    {
+        return;
+    }
+    g_host_pin[pin] = value;
+    
+    ltc_model_pin(pin, value);
+    ads_model_pin(pin, value);
+    if (pin == KVAC_PIN)
+    {
+        host_log("kilovac %s", value ? "closed" : "open");
+    }
+}
+
+void output_low(int pin)
+{
+    output_bit(pin, 0);
+}
+
+void output_high(int pin)
+{
+    output_bit(pin, 1);
+}
+
+void output_toggle(int pin)
+{
+    output_bit(pin, !g_host_pin[pin]);
+}
+
+// Outputs read back their latch, the LCD is never connected
+int1 input_state(int pin)
+{
+    return g_host_pin[pin];
+}
+
+void set_tris_f(unsigned int16 tris)
+{
+    g_host_tris_f = tris;
+}
+
+void set_tris_g(unsigned int16 tris)
+{
+    g_host_tris_g = tris;
+}
+
+unsigned int16 get_tris_f(void)
+{
+    return g_host_tris_f;
+}
+
+unsigned int16 get_tris_g(void)
+{
+    return g_host_tris_g;
+}
+
+//////////////////////////
+// Buses /////////////////
+//////////////////////////
+
+void spi_write(unsigned int8 data)
+{
+    ltc_model_write(data);
+}
+
+unsigned int8 spi_read(unsigned int8 data)
+{
+    return ltc_model_read();
+}
+
+void spi_write2(unsigned int8 data)
+{
+    ads_model_transfer(data, true);
+}
+
+unsigned int8 spi_read2(unsigned int8 data)
+{
+    return ads_model_transfer(data, false);
+}
+
+void i2c_start(void)
+{
+    eeprom_model_start();
+}
+
+void i2c_stop(void)
+{
+    eeprom_model_stop();
+}
+
+int1 i2c_write(unsigned int8 data)
+{
+    return eeprom_model_write(data);
+}
+
+unsigned int8 i2c_read(int1 ack)
+{
+    return eeprom_model_read();
+}
+
+//////////////////////////
+// ADC ///////////////////
+//////////////////////////
+
+void setup_adc(int mode)
+{
+}
+
+void setup_adc_ports(long ports)
+{
+}
+
+void set_adc_channel(int channel)
+{
+    g_adc_channel = channel;
+}
+
+unsigned int16 host_read_adc(int mode)
+{
+    if (mode != ADC_READ_ONLY)
+    {
+        adc_model_convert();
+    }
+    return g_adc_result;
+}
+
+//////////////////////////
+// Timers ////////////////
+//////////////////////////
+
+// Returns the length of a timer period in ticks
+unsigned long long host_timer_period(unsigned int16 mode, unsigned long long period)
+{
+    static const unsigned int16 prescale[4] = {1, 8, 64, 256};
+    
+    return (period + 1) * prescale[(mode >> 4) & 0x03];
+}
+
+void setup_timer1(unsigned int16 mode, unsigned int16 period)
+{
+    g_host_timer1.period = host_timer_period(mode, period);
+    g_host_timer1.next = host_ticks() + g_host_timer1.period;
+}
+
+void setup_timer2(unsigned int16 mode, unsigned int32 period)
+{
+    // Only the free running 32 bit timebase is modelled
+    g_host_timer23_base = host_ticks();
+}
+
+void setup_timer4(unsigned int16 mode, unsigned int16 period)
+{
+    g_host_timer4.period = host_timer_period(mode, period);
+    g_host_timer4.next = host_ticks() + g_host_timer4.period;
+}
+
+void set_timer23(unsigned int32 value)
+{
+    g_host_timer23_base = host_ticks() - value;
+    g_host_timer23_wraps = 0;
+}
+
+unsigned int32 get_timer23(void)
+{
+    return (unsigned int32)(host_ticks() - g_host_timer23_base);
+}
+
+void enable_interrupts(host_int_t irq)
+{
+    gb_host_int_enabled[irq] = true;
+}
+
+void disable_interrupts(host_int_t irq)
+{
+    gb_host_int_enabled[irq] = false;
+}
+
+// Only the timer 3 flag is read by the firmware
+int1 interrupt_active(host_int_t irq)
+{
+    if (irq == INT_TIMER3)
+    {
+        return ((host_ticks() - g_host_timer23_base) >> 32) > g_host_timer23_wraps;
+    }
+    return false;
+}
+
+char * itoa(signed int32 value, int base, char * str)
+{
+    sprintf(str, (base == 16) ? "%X" : "%d", value);
+    return str;
+}
+
+//////////////////////////
+// Interrupts ////////////
+//////////////////////////
+
+// Returns true once per period when a timer matches, ticks missed while
+// the handler was held off are lost as on the PIC
+int1 host_timer_due(host_timer_t * timer, unsigned long long now)
+{
+    if ((timer->period == 0) || (now < timer->next))
+    {
+        return false;
+    }
+    host_jitter_add(&timer->jitter, now - timer->next);
+    timer->next += timer->period;
+    if (timer->next <= now)
+    {
+        timer->jitter.missed += (now - timer->next) / timer->period + 1;
+        timer->next = now + timer->period;
+    }
+    return true;
+}
+
+// Runs every interrupt handler that is due
+void host_service(void)
+{
+    unsigned long long now;
+    struct pollfd pfd;
+    
+    if (gb_host_in_isr)
+    {
+        return;
+    }
+    gb_host_in_isr = true;
+    now = host_ticks();
+    
+    if (gb_host_stop)
+    {
+        host_jitter_report();
+        exit(0);
+    }
+    if (g_host_report_period && (now >= g_host_report_next))
+    {
+        host_jitter_report();
+        g_host_report_next += g_host_report_period;
+    }
+    
+    if (interrupt_active(INT_TIMER3))
+    {
+        g_host_timer23_wraps++;
+        if (gb_host_int_enabled[INT_TIMER3])
+        {
+            isr_timer3();
+        }
+    }
+    
+    host_ecan_transmit();
+    if (host_ecan_done && gb_host_int_enabled[INT_CAN1])
+    {
+        isr_can1();
+    }
+    
+    pfd.fd = host_ecan_socket;
+    pfd.events = POLLIN;
+    while (gb_host_int_enabled[INT_C1RX] && (poll(&pfd, 1, 0) > 0) && (pfd.revents & POLLIN))
+    {
+        isr_c1rx();
+    }
+    
+    if (host_timer_due(&g_host_timer4, now) && gb_host_int_enabled[INT_TIMER4])
+    {
+        isr_timer4();
+    }
+    if (host_timer_due(&g_host_timer1, now) && gb_host_int_enabled[INT_TIMER1])
+    {
+        isr_timer1();
+    }
+    
+    // A forced request starts the DMA block, the channel turns off once the
+    // UART has shifted it out
+    if (UART_TELEM_DMA4REQ & 0x8000)
+    {
+        UART_TELEM_DMA4REQ &= 0x7FFF;
+        g_host_uart_end = now + (UART_TELEM_DMA4CNT + 1ULL) * 10 * HOST_TICKS_PER_S / UART_TELEM_BAUD;
+    }
+    if (g_host_uart_end && (now >= g_host_uart_end))
+    {
+        g_host_uart_end = 0;
+        if (g_host_uart_fd >= 0)
+        {
+            if (write(g_host_uart_fd, g_uart_telem_frame, UART_TELEM_DMA4CNT + 1) < 0)
+            {
+                perror("uart");
+                g_host_uart_fd = -1;
+            }
+        }
+        UART_TELEM_DMA4CON &= 0x7FFF;
+    }
+    
+    gb_host_in_isr = false;
+}
+
+// Returns the earlier of two host times, 0 meaning none
+unsigned long long host_earliest(unsigned long long a, unsigned long long b)
+{
+    if ((a == 0) || ((b != 0) && (b < a)))
+    {
+        return b;
+    }
+    return a;
+}
+
+// Arms the timerfd for a host time
+void host_arm(unsigned long long ticks)
+{
+    struct itimerspec when;
+    
+    memset(&when, 0, sizeof(when));
+    ticks += g_host_start.tv_nsec / 100;
+    when.it_value.tv_sec = g_host_start.tv_sec + ticks / HOST_TICKS_PER_S;
+    when.it_value.tv_nsec = (ticks % HOST_TICKS_PER_S) * 100;
+    timerfd_settime(g_host_timerfd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+// Waits until a host time, servicing interrupts and CAN receptions
+void host_wait(unsigned long long until)
+{
+    unsigned long long now;
+    unsigned long long next;
+    unsigned long long expirations;
+    struct pollfd pfd[2];
+    
+    while (true)
+    {
+        host_service();
+        now = host_ticks();
+        if (now >= until)
+        {
+            return;
+        }
+        
+        next = until;
+        if (!gb_host_in_isr)
+        {
+            next = host_earliest(next, g_host_timer1.period ? g_host_timer1.next : 0);
+            next = host_earliest(next, g_host_timer4.period ? g_host_timer4.next : 0);
+            next = host_earliest(next, host_ecan_next_event());
+            next = host_earliest(next, g_host_uart_end);
+            next = host_earliest(next, g_host_report_period ? g_host_report_next : 0);
+        }
+        if (next <= now)
+        {
+            continue;
+        }
+        
+        host_arm(next);
+        pfd[0].fd = g_host_timerfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = host_ecan_socket;
+        pfd[1].events = (!gb_host_in_isr && gb_host_int_enabled[INT_C1RX]) ? POLLIN : 0;
+        poll(pfd, 2, -1);
+        if (pfd[0].revents & POLLIN)
+        {
+            if (read(g_host_timerfd, &expirations, sizeof(expirations)) < 0)
+            {
+                perror("timerfd");
+            }
+        }
+    }
+}
+
+void delay_us(unsigned int32 us)
+{
+    unsigned long long ticks = (unsigned long long)us * (HOST_TICKS_PER_S / 1000000) + g_host_busy;
+    
+    g_host_busy = 0;
+    if (gb_host_no_wait)
+    {
+        g_host_blocked += ticks;
+        return;
+    }
+    host_wait(host_ticks() + ticks);
+}
+
+void delay_ms(unsigned int32 ms)
+{
+    delay_us(ms * 1000);
+}
+
+// Returns the ticks delays and bus transfers have blocked for since the last
+// call, with gb_host_no_wait set
+unsigned long long host_blocked(void)
+{
+    unsigned long long ticks = g_host_blocked + g_host_busy;
+    
+    g_host_blocked = 0;
+    g_host_busy = 0;
+    return ticks;
+}
+
+// Starts the host clock, call before the firmware. Jitter is reported every
+// report_s seconds if it is not 0.
+int host_hal_init(double report_s)
+{
+    g_host_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (g_host_timerfd < 0)
+    {
+        perror("timerfd_create");
+        return -1;
+    }
+    signal(SIGINT, host_signal);
+    signal(SIGTERM, host_signal);
+    
+    clock_gettime(CLOCK_MONOTONIC, &g_host_start);
+    g_host_report_period = (unsigned long long)(report_s * HOST_TICKS_PER_S);
+    g_host_report_next = g_host_report_period;
+    eeprom_model_init();
+    return 0;
+}
+
+#endif
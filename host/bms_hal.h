@@ -0,0 +1,139 @@
+#ifndef BMS_HAL_H
+#define BMS_HAL_H
+
+// Host stand-ins for the CCS built-ins and PIC24 peripherals used by the BMS
+// firmware, included by final/main.h when HOST_BUILD is defined.
+// Interrupts are delivered at delays only (delay_ms, delay_us and the time
+// taken by SPI and I2C transfers), see bms_hal.c.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "ccs_host.h"
+
+#define TRUE  1
+#define FALSE 0
+
+// Pins, numbered port * 16 + bit
+#define PIN_A2  (0*16 +  2)
+#define PIN_A3  (0*16 +  3)
+#define PIN_A6  (0*16 +  6)
+#define PIN_A13 (0*16 + 13)
+#define PIN_B8  (1*16 +  8)
+#define PIN_B9  (1*16 +  9)
+#define PIN_C1  (2*16 +  1)
+#define PIN_C2  (2*16 +  2)
+#define PIN_C3  (2*16 +  3)
+#define PIN_C4  (2*16 +  4)
+#define PIN_D7  (3*16 +  7)
+#define PIN_D10 (3*16 + 10)
+#define PIN_D14 (3*16 + 14)
+#define PIN_D15 (3*16 + 15)
+#define PIN_E0  (4*16 +  0)
+#define PIN_E1  (4*16 +  1)
+#define PIN_E2  (4*16 +  2)
+#define PIN_E3  (4*16 +  3)
+#define PIN_E4  (4*16 +  4)
+#define PIN_E5  (4*16 +  5)
+#define PIN_E6  (4*16 +  6)
+#define PIN_E7  (4*16 +  7)
+#define PIN_G13 (6*16 + 13)
+#define N_HOST_PINS (7*16)
+
+// Timers, mode bits as in TxCON
+#define TMR_INTERNAL   0x8000
+#define TMR_32_BIT     0x0008
+#define TMR_DIV_BY_1   0x0000
+#define TMR_DIV_BY_8   0x0010
+#define TMR_DIV_BY_64  0x0020
+#define TMR_DIV_BY_256 0x0030
+
+// Interrupts
+typedef enum
+{
+    GLOBAL,
+    INT_TIMER1,
+    INT_TIMER3,
+    INT_TIMER4,
+    INT_CAN1,
+    INT_CAN2,
+    INT_C1RX,
+    N_HOST_INTS
+} host_int_t;
+
+// ADC
+#define ADC_CLOCK_INTERNAL 0
+#define sAN24              (1L << 24)
+#define sAN25              (1L << 25)
+#define ADC_START_AND_READ 0
+#define ADC_START_ONLY     1
+#define ADC_READ_ONLY      2
+
+// DMA channel 4 and UART1 registers used by uart_telem.c, a forced DMA
+// request sends the frame after the time the UART needs for it
+extern unsigned int16 UART_TELEM_DMA4CON;
+extern unsigned int16 UART_TELEM_DMA4REQ;
+extern unsigned int16 UART_TELEM_DMA4STA;
+extern unsigned int16 UART_TELEM_DMA4CNT;
+extern unsigned int16 UART_TELEM_U1TXREG;
+extern void *         UART_TELEM_DMA4PAD;
+#define UART_TELEM_DMA_BUSY ((UART_TELEM_DMA4CON & 0x8000) != 0)
+
+// Pins
+void output_low(int pin);
+void output_high(int pin);
+void output_toggle(int pin);
+void output_bit(int pin, int value);
+int1 input_state(int pin);
+void set_tris_f(unsigned int16 tris);
+void set_tris_g(unsigned int16 tris);
+unsigned int16 get_tris_f(void);
+unsigned int16 get_tris_g(void);
+
+// Delays, pending interrupts are serviced while waiting
+void delay_ms(unsigned int32 ms);
+void delay_us(unsigned int32 us);
+
+// SPI1 (LTC6804), SPI2 (ADS7952) and I2C (CAT24AA02)
+void spi_write(unsigned int8 data);
+unsigned int8 spi_read(unsigned int8 data);
+void spi_write2(unsigned int8 data);
+unsigned int8 spi_read2(unsigned int8 data);
+void i2c_start(void);
+void i2c_stop(void);
+int1 i2c_write(unsigned int8 data);
+unsigned int8 i2c_read(int1 ack);
+
+// ADC, read_adc() takes an optional mode
+void setup_adc(int mode);
+void setup_adc_ports(long ports);
+void set_adc_channel(int channel);
+unsigned int16 host_read_adc(int mode);
+#define read_adc(...) host_read_adc(ADC_START_AND_READ __VA_OPT__(+ __VA_ARGS__))
+
+// Timers and interrupts
+void setup_timer1(unsigned int16 mode, unsigned int16 period);
+void setup_timer2(unsigned int16 mode, unsigned int32 period);
+void setup_timer4(unsigned int16 mode, unsigned int16 period);
+void set_timer23(unsigned int32 value);
+unsigned int32 get_timer23(void);
+void enable_interrupts(host_int_t irq);
+void disable_interrupts(host_int_t irq);
+int1 interrupt_active(host_int_t irq);
+
+char * itoa(signed int32 value, int base, char * str);
+
+// Host side
+#define HOST_TICKS_PER_S 10000000ULL // One tick per instruction cycle (Fcy)
+unsigned long long host_ticks(void);
+void host_busy(unsigned long long ticks);
+void host_rx_latency(unsigned long long ticks);
+void host_log(const char * format, ...);
+
+// Set by the WCET harness: delays return at once and CAN frames are sent as
+// soon as they are committed, the time delays and bus transfers would have
+// blocked for is added up for host_blocked()
+extern int1 gb_host_no_wait;
+unsigned long long host_blocked(void);
+
+#endif
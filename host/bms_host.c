@@ -0,0 +1,168 @@
+// Host build of the BMS firmware
+// Runs final/main.c in real time as a virtual ECU, with CAN1 on a SocketCAN
+// interface and the sensors from the device models in bms_devices.c, so the
+// stand-in nodes of netsim, ground station software or other ECUs can be run
+// against it at real bus rates. Kilovac and balancing changes are logged with
+// CLOCK_MONOTONIC stamps, interrupt and CAN receive jitter is reported on
+// exit (SIGINT or SIGTERM) and every -j seconds.
+// Usage: bms_host [-f none|ov|uv|ot|oc] [-t fault time s] [-r replay file]
+//                 [-u uart file] [-R realtime priority] [-j report s]
+//                 [-n CAN node] [-c calibration block] [interface]
+// The CAN node is programmed into the eeprom model, left erased the build
+// default CAN_NODE_ID is used. A calibration block written by calfit is
+// programmed at CAL_ADDRESS, left erased every channel is uncorrected.
+// A realtime priority runs the process SCHED_FIFO with its memory locked,
+// which needs CAP_SYS_NICE and CAP_IPC_LOCK.
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "host_can.c"
+
+#define main bms_main
+#include "main.c"
+#undef main
+
+#include "bms_devices.c"
+#include "bms_hal.c"
+
+// Runs the process SCHED_FIFO at a priority with its memory locked
+int bms_host_realtime(int priority)
+{
+    struct sched_param param;
+    
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+    {
+        perror("sched_setscheduler");
+        return -1;
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+        perror("mlockall");
+        return -1;
+    }
+    return 0;
+}
+
+// Programs a calibration block into the eeprom model
+int bms_host_calibration(const char * path)
+{
+    FILE * f = fopen(path, "rb");
+    size_t n;
+    
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+    n = fread(&g_eeprom_model[CAL_ADDRESS], 1, CAL_BLOCK_LEN, f);
+    fclose(f);
+    if (n != CAL_BLOCK_LEN)
+    {
+        fprintf(stderr, "%s: expected a %d byte calibration block\n", path, CAL_BLOCK_LEN);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    const char * interface = HOST_CAN_DEFAULT_INTERFACE;
+    const char * replay = 0;
+    const char * calibration = 0;
+    double fault_s = 5.0;
+    double report_s = 0.0;
+    int priority = 0;
+    int node = -1;
+    int opt;
+    int s;
+    int i;
+    
+    g_pack.fault = PACK_FAULT_NONE;
+    while ((opt = getopt(argc, argv, "f:t:r:u:R:j:n:c:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':
+                for (i = 0 ; i < N_PACK_FAULTS ; i++)
+                {
+                    if (strcmp(optarg, g_pack_fault_name[i]) == 0)
+                    {
+                        g_pack.fault = i;
+                        break;
+                    }
+                }
+                if (i == N_PACK_FAULTS)
+                {
+                    fprintf(stderr, "unknown fault %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't': fault_s = atof(optarg); break;
+            case 'r': replay = optarg; break;
+            case 'c': calibration = optarg; break;
+            case 'u':
+                g_host_uart_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (g_host_uart_fd < 0)
+                {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            case 'R': priority = atoi(optarg); break;
+            case 'j': report_s = atof(optarg); break;
+            case 'n':
+                node = atoi(optarg);
+                if ((node < 0) || (node >= N_CAN_NODES))
+                {
+                    fprintf(stderr, "node %s out of range\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f fault] [-t s] [-r replay file] [-u uart file] [-R priority] [-j s] [-n node] [-c block file] [interface]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc)
+    {
+        interface = argv[optind];
+    }
+    g_pack.fault_ticks = (unsigned long long)(fault_s * HOST_TICKS_PER_S);
+    if (replay && (pack_replay_load(replay) < 0))
+    {
+        return 1;
+    }
+    if ((priority > 0) && (bms_host_realtime(priority) < 0))
+    {
+        return 1;
+    }
+    
+    s = host_can_open(interface);
+    if (s < 0)
+    {
+        return 1;
+    }
+    host_ecan_open(s, HOST_CAN_DEFAULT_BITRATE);
+    if (host_hal_init(report_s) < 0)
+    {
+        return 1;
+    }
+    if (node >= 0)
+    {
+        g_eeprom_model[NODE_ADDRESS] = node;
+    }
+    if (calibration && (bms_host_calibration(calibration) < 0))
+    {
+        return 1;
+    }
+    host_log("start, node %d, fault %s at %.3f s, %d replay samples, %s", (node >= 0) ? node : CAN_NODE_ID,
+             g_pack_fault_name[g_pack.fault], fault_s, g_pack.n_replay, (priority > 0) ? "SCHED_FIFO" : "SCHED_OTHER");
+    
+    bms_main();
+    return 0;
+}
@@ -0,0 +1,315 @@
+// BMS telemetry monitor
+// Decodes the CAN telemetry of every BMS node on a SocketCAN interface,
+// demultiplexed by node (see CAN_NODE_STRIDE in can_telem.h), and prints a
+// summary line per node every interval. Commands and warnings to or from a
+// node are printed as they arrive, fault summary maps (see final/fault.c)
+// and balancing progress (see final/balance.c) decoded. Receive events (see
+// final/event.c) are summarised per type as handled/ignored/dropped.
+// The trip signal has a shared ID, so it is printed without a node.
+// Usage: bms_monitor [-i interval s] [-n node] [interface]
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include "host_can.c"
+#include "can_telem.h"
+
+#define N_MONITOR_CELLS 30
+#define N_MONITOR_TEMPS 24
+#define N_MONITOR_FAULT_STATES  3
+#define N_MONITOR_FAULT_CLASSES 6
+#define N_MONITOR_EVENT_TYPES   3
+#define N_MONITOR_BALANCE_STATUS 7
+
+#define EXPAND_AS_MONITOR_ID_ARRAY(a,b,c,d,e,f)   b,
+#define EXPAND_AS_MONITOR_MISC_NAME(a,b,c,d)     #a,
+
+typedef struct
+{
+    bool          b_seen;
+    unsigned long frames;                // Since the last summary
+    unsigned char cell[N_MONITOR_CELLS]; // 1 bit = 25.6 mV
+    unsigned char temp[N_MONITOR_TEMPS]; // Degrees C
+    unsigned      current;               // Raw hall sensor reading
+    unsigned long discharge;             // Balancing bits
+    bool          b_connected;
+    uint32_t      time_us;               // Synchronised time of the last telemetry set
+    int           discharge_limit;       // 0.1 A
+    int           charge_limit;          // 0.1 A
+    unsigned char peers_alive;           // Bit per peer, see final/peer.c
+    unsigned char peers_dead;
+    unsigned char event_depth;           // Most receive events queued at once
+    // Handled, ignored and dropped receive events per type, see final/event.c
+    unsigned      event_count[N_MONITOR_EVENT_TYPES][3];
+} monitor_node_t;
+
+static const unsigned g_telem_id[N_CAN_ID]   = {CAN_ID_TABLE(EXPAND_AS_MONITOR_ID_ARRAY)};
+static const unsigned g_misc_id[N_CAN_MISC]  = {CAN_MISC_TABLE(EXPAND_AS_MISC_ID_ARRAY)};
+static const int      g_misc_node[N_CAN_MISC] = {CAN_MISC_TABLE(EXPAND_AS_MISC_NODE_ARRAY)};
+static const char *   g_misc_name[N_CAN_MISC] = {CAN_MISC_TABLE(EXPAND_AS_MONITOR_MISC_NAME)};
+static const char *   g_fault_state[N_MONITOR_FAULT_STATES]   = {"active", "latched", "warning"};
+static const char *   g_fault_class[N_MONITOR_FAULT_CLASSES] = {"OV", "UV", "OT", "WT", "OC", "UC"};
+static const char *   g_event_type[N_MONITOR_EVENT_TYPES]    = {"balance", "pms", "calibration"};
+static const char *   g_balance_status[N_MONITOR_BALANCE_STATUS] = {"idle", "running", "done", "timeout", "stopped", "tripped", "cycle done"};
+
+static monitor_node_t g_node[N_CAN_NODES];
+static int            g_only_node = -1; // Node to show, -1 for all
+
+// Returns true if the ID is a node local table ID
+bool monitor_is_local(unsigned id)
+{
+    int i;
+    
+    for (i = 0 ; i < N_CAN_ID ; i++)
+    {
+        if (g_telem_id[i] == id)
+        {
+            return true;
+        }
+    }
+    for (i = 0 ; i < N_CAN_MISC ; i++)
+    {
+        if ((g_misc_id[i] == id) && (g_misc_node[i] == CAN_NODE_LOCAL))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Splits a bus ID into its node and table ID, returns -1 for shared and
+// unknown IDs. The stride keeps the nodes' ID sets apart so at most one node
+// matches.
+int monitor_split(unsigned id, unsigned * table_id)
+{
+    int node;
+    
+    for (node = 0 ; node < N_CAN_NODES ; node++)
+    {
+        if ((id >= (unsigned)node * CAN_NODE_STRIDE) && monitor_is_local(id - node * CAN_NODE_STRIDE))
+        {
+            *table_id = id - node * CAN_NODE_STRIDE;
+            return node;
+        }
+    }
+    return -1;
+}
+
+void monitor_log(int node, const char * text)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (node < 0)
+    {
+        printf("%6ld.%06ld shared %s\n", (long)now.tv_sec, now.tv_nsec / 1000, text);
+    }
+    else
+    {
+        printf("%6ld.%06ld node %d %s\n", (long)now.tv_sec, now.tv_nsec / 1000, node, text);
+    }
+    fflush(stdout);
+}
+
+void monitor_receive(const struct can_frame * frame)
+{
+    const unsigned char * d = frame->data;
+    monitor_node_t * n;
+    unsigned id;
+    int node = monitor_split(frame->can_id, &id);
+    char text[96];
+    int i;
+    
+    // The trip signal has a shared ID and does not tell which node sent it
+    if ((node < 0) && (frame->can_id == COMMAND_BPS_TRIP_SIGNAL_ID))
+    {
+        monitor_log(node, "COMMAND_BPS_TRIP_SIGNAL");
+    }
+    if ((node < 0) || ((g_only_node >= 0) && (node != g_only_node)))
+    {
+        return;
+    }
+    n = &g_node[node];
+    n->b_seen = true;
+    n->frames++;
+    
+    switch (id)
+    {
+        case CAN_BPS_VOLTAGE1_ID:
+        case CAN_BPS_VOLTAGE2_ID:
+        case CAN_BPS_VOLTAGE3_ID:
+        case CAN_BPS_VOLTAGE4_ID:
+            for (i = 0 ; (i < frame->can_dlc) && (8*(id - CAN_BPS_VOLTAGE1_ID) + i < N_MONITOR_CELLS) ; i++)
+            {
+                n->cell[8*(id - CAN_BPS_VOLTAGE1_ID) + i] = d[i];
+            }
+            break;
+        case CAN_BPS_TEMPERATURE1_ID:
+        case CAN_BPS_TEMPERATURE2_ID:
+        case CAN_BPS_TEMPERATURE3_ID:
+            for (i = 0 ; i < frame->can_dlc ; i++)
+            {
+                n->temp[8*(id - CAN_BPS_TEMPERATURE1_ID) + i] = d[i];
+            }
+            break;
+        case CAN_BPS_CUR_BAL_STAT_ID:
+            n->current = (d[0] << 8) | d[1];
+            n->discharge = ((unsigned long)d[2] << 24) | (d[3] << 16) | (d[4] << 8) | d[5];
+            n->b_connected = d[6];
+            break;
+        case CAN_BPS_TIME_ID:
+            n->time_us = ((uint32_t)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+            break;
+        case SOP_LIMITS_ID:
+            n->discharge_limit = (short)((d[0] << 8) | d[1]);
+            n->charge_limit = (short)((d[2] << 8) | d[3]);
+            break;
+        case FAULT_SUMMARY_ID:
+            if ((frame->can_dlc >= 6) && (d[0] < N_MONITOR_FAULT_STATES) && (d[1] < N_MONITOR_FAULT_CLASSES))
+            {
+                snprintf(text, sizeof(text), "FAULT_SUMMARY %s %s 0x%08lX", g_fault_state[d[0]], g_fault_class[d[1]],
+                         ((unsigned long)d[2] << 24) | (d[3] << 16) | (d[4] << 8) | d[5]);
+                monitor_log(node, text);
+            }
+            break;
+        case PEER_STATUS_ID:
+            n->peers_alive = d[0];
+            n->peers_dead = d[1];
+            break;
+        case BALANCE_PROGRESS_ID:
+            if ((frame->can_dlc >= 8) && (d[0] < N_MONITOR_BALANCE_STATUS))
+            {
+                snprintf(text, sizeof(text), "BALANCE_PROGRESS %s, %d bled, spread %.1f mV, %u s left after %u s",
+                         g_balance_status[d[0]], d[1], ((d[2] << 8) | d[3]) / 10.0, (d[4] << 8) | d[5], (d[6] << 8) | d[7]);
+                monitor_log(node, text);
+            }
+            break;
+        case CAN_BPS_EVENTS_ID:
+            if (d[0] < N_MONITOR_EVENT_TYPES)
+            {
+                n->event_depth = d[1];
+                for (i = 0 ; i < 3 ; i++)
+                {
+                    n->event_count[d[0]][i] = (d[2+2*i] << 8) | d[3+2*i];
+                }
+            }
+            break;
+        case BLACKBOX_DUMP_ID:
+            break;
+        default:
+            for (i = 0 ; i < N_CAN_MISC ; i++)
+            {
+                if (g_misc_id[i] == id)
+                {
+                    monitor_log(node, g_misc_name[i]);
+                }
+            }
+            break;
+    }
+}
+
+// Prints a line for every node heard from, frames are per second
+void monitor_summary(double interval_s)
+{
+    monitor_node_t * n;
+    char text[384];
+    int lo;
+    int hi;
+    int node;
+    int i;
+    
+    for (node = 0 ; node < N_CAN_NODES ; node++)
+    {
+        n = &g_node[node];
+        if (!n->b_seen)
+        {
+            continue;
+        }
+        lo = 255;
+        hi = 0;
+        for (i = 0 ; i < N_MONITOR_CELLS ; i++)
+        {
+            lo = (n->cell[i] < lo) ? n->cell[i] : lo;
+            hi = (n->cell[i] > hi) ? n->cell[i] : hi;
+        }
+        snprintf(text, sizeof(text), "%5.0f frames/s cells %.3f-%.3f V",
+                 n->frames / interval_s, lo * 0.0256, hi * 0.0256);
+        lo = 255;
+        hi = 0;
+        for (i = 0 ; i < N_MONITOR_TEMPS ; i++)
+        {
+            lo = (n->temp[i] < lo) ? n->temp[i] : lo;
+            hi = (n->temp[i] > hi) ? n->temp[i] : hi;
+        }
+        snprintf(text + strlen(text), sizeof(text) - strlen(text),
+                 " temps %d-%d C current %u balance 0x%08lX limits %.1f/%.1f A %s t %.6f s peers alive 0x%02X dead 0x%02X",
+                 lo, hi, n->current, n->discharge, n->discharge_limit / 10.0, n->charge_limit / 10.0,
+                 n->b_connected ? "connected" : "open", n->time_us / 1e6, n->peers_alive, n->peers_dead);
+        for (i = 0 ; i < N_MONITOR_EVENT_TYPES ; i++)
+        {
+            snprintf(text + strlen(text), sizeof(text) - strlen(text), " %s %u/%u/%u", g_event_type[i],
+                     n->event_count[i][0], n->event_count[i][1], n->event_count[i][2]);
+        }
+        snprintf(text + strlen(text), sizeof(text) - strlen(text), " depth %u", n->event_depth);
+        monitor_log(node, text);
+        n->frames = 0;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    const char * interface = HOST_CAN_DEFAULT_INTERFACE;
+    struct can_frame frame;
+    struct pollfd pfd;
+    struct timespec now;
+    double interval_s = 1.0;
+    double next_s;
+    double now_s;
+    int opt;
+    int s;
+    
+    while ((opt = getopt(argc, argv, "i:n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i': interval_s = atof(optarg); break;
+            case 'n': g_only_node = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-i interval s] [-n node] [interface]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc)
+    {
+        interface = argv[optind];
+    }
+    
+    s = host_can_open(interface);
+    if (s < 0)
+    {
+        return 1;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    next_s = now.tv_sec + now.tv_nsec / 1e9 + interval_s;
+    while (true)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        now_s = now.tv_sec + now.tv_nsec / 1e9;
+        if (now_s >= next_s)
+        {
+            monitor_summary(interval_s);
+            next_s += interval_s;
+            continue;
+        }
+        
+        pfd.fd = s;
+        pfd.events = POLLIN;
+        if ((poll(&pfd, 1, (int)((next_s - now_s) * 1000) + 1) > 0) && host_can_receive(s, &frame))
+        {
+            monitor_receive(&frame);
+        }
+    }
+}
@@ -0,0 +1,754 @@
+// Worst-case execution time of the BMS interrupt handlers and states
+// Builds final/main.c for the host as bms_host does and drives every
+// interrupt handler and main loop state through its input classes, one call
+// at a time with gb_host_no_wait set. A forked child runs the handlers while
+// the parent single steps it with ptrace and counts the instructions executed
+// in the firmware (final/*.c, with host_ecan.c standing in for can_PIC24.c);
+// the device models, the HAL and the C library count as the call only.
+// Delays and SPI and I2C transfers are reported apart as blocking time.
+// For each handler the worst class is reported with its path, the firmware
+// functions it ran through with their calls and instructions. Handlers with a
+// budget (the interrupt handlers by default, see g_wcet) fail the run if a
+// class exceeds it, with exit status 1, as does blocking on level 4 and
+// above that adds up past the deadline of timer 4 and the CAN receive
+// capture. -b sets or replaces a budget.
+// The counts are x86 instructions of the host build, not PIC24 cycles: use
+// them to catch paths that grow between builds and bms_bench -l for cycles.
+// Usage: bms_wcet [-b handler=instructions[,blocking us]] [-f handler] [-v]
+
+#include <stdlib.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/user.h>
+#include "host_can.c"
+
+// Firmware code lies between these labels, the build keeps functions in
+// source order and does not inline (see the Makefile)
+__asm__(".text\nwcet_firmware_start:\n");
+
+#define main bms_main
+#include "main.c"
+#undef main
+
+__asm__(".text\nwcet_firmware_end:\n");
+
+#include "bms_devices.c"
+#include "bms_hal.c"
+
+#define N_WCET_FUNCTIONS 64 // Firmware functions on one path
+#define N_WCET_CLASS     64 // Length of a class name
+#define WCET_TIMER4_TICKS (2*(TELEMETRY_PERIOD_MS + 1))
+
+extern const char wcet_firmware_start[];
+extern const char wcet_firmware_end[];
+
+typedef struct
+{
+    unsigned long address; // Entry point
+    const char *  name;
+    unsigned long calls;
+    unsigned long instructions;
+} wcet_function_t;
+
+// Written by the tracer, read by the child, shared across the fork
+typedef struct
+{
+    unsigned long   instructions;
+    int             n_functions;
+    wcet_function_t function[N_WCET_FUNCTIONS];
+} wcet_trace_t;
+
+typedef struct
+{
+    const char *    name;
+    int             level;       // Interrupt priority, 0 for a main loop state
+    void (*drive)(void);         // Runs the handler through its classes
+    unsigned long   budget;      // Instructions, 0 for none
+    double          budget_us;   // Blocking time, negative for none
+    int             n_classes;
+    unsigned long   worst;
+    char            worst_class[N_WCET_CLASS];
+    double          blocked_us;  // Worst blocking time
+    char            blocked_class[N_WCET_CLASS];
+    int1            b_failed;
+    wcet_trace_t    path;        // Of the worst class
+} wcet_handler_t;
+
+static wcet_trace_t *   g_trace;
+static wcet_handler_t * g_handler;      // Handler being driven
+static int1             gb_verbose = false;
+static int              g_rx_socket = -1; // Sending end of the CAN1 socket pair
+
+//////////////////////////
+// Tracer ////////////////
+//////////////////////////
+
+// Adds an instruction at rip to the trace if it is firmware code
+void wcet_count(unsigned long rip)
+{
+    wcet_function_t * f;
+    Dl_info info;
+    int i;
+    
+    if ((rip < (unsigned long)wcet_firmware_start) || (rip >= (unsigned long)wcet_firmware_end))
+    {
+        return;
+    }
+    g_trace->instructions++;
+    if (!dladdr((void *)rip, &info) || !info.dli_sname)
+    {
+        return;
+    }
+    for (i = 0 ; i < g_trace->n_functions ; i++)
+    {
+        if (g_trace->function[i].address == (unsigned long)info.dli_saddr)
+        {
+            break;
+        }
+    }
+    if (i == g_trace->n_functions)
+    {
+        if (i == N_WCET_FUNCTIONS)
+        {
+            return;
+        }
+        f = &g_trace->function[i];
+        f->address = (unsigned long)info.dli_saddr;
+        f->name = info.dli_sname;
+        f->calls = 0;
+        f->instructions = 0;
+        g_trace->n_functions++;
+    }
+    f = &g_trace->function[i];
+    f->instructions++;
+    if (rip == f->address)
+    {
+        f->calls++;
+    }
+}
+
+// Single steps the child between its SIGSTOP marks, returns its exit status
+int wcet_trace(pid_t pid)
+{
+    struct user_regs_struct regs;
+    int1 b_counting = false;
+    int status;
+    int sig = 0;
+    
+    // The child stops itself once it is traced
+    if ((waitpid(pid, &status, 0) < 0) || !WIFSTOPPED(status))
+    {
+        return 1;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_EXITKILL);
+    
+    while (true)
+    {
+        if (ptrace(b_counting ? PTRACE_SINGLESTEP : PTRACE_CONT, pid, 0, sig) < 0)
+        {
+            perror("ptrace");
+            return 1;
+        }
+        sig = 0;
+        if (waitpid(pid, &status, 0) < 0)
+        {
+            perror("waitpid");
+            return 1;
+        }
+        if (WIFEXITED(status))
+        {
+            return WEXITSTATUS(status);
+        }
+        if (WIFSIGNALED(status))
+        {
+            fprintf(stderr, "harness killed by signal %d\n", WTERMSIG(status));
+            return 1;
+        }
+        
+        if (WSTOPSIG(status) == SIGSTOP)
+        {
+            // Start or end of a measured call
+            b_counting = !b_counting;
+            if (b_counting)
+            {
+                g_trace->instructions = 0;
+                g_trace->n_functions = 0;
+            }
+        }
+        else if (b_counting && (WSTOPSIG(status) == SIGTRAP))
+        {
+            ptrace(PTRACE_GETREGS, pid, 0, &regs);
+            wcet_count(regs.rip);
+        }
+        else
+        {
+            sig = WSTOPSIG(status);
+        }
+    }
+}
+
+//////////////////////////
+// Measurement ///////////
+//////////////////////////
+
+int wcet_function_compare(const void * a, const void * b)
+{
+    const wcet_function_t * x = a;
+    const wcet_function_t * y = b;
+    
+    return (x->instructions < y->instructions) - (x->instructions > y->instructions);
+}
+
+// Runs one call of a handler under the tracer, returns the time it blocked
+// for in us, the trace is left in g_trace
+double wcet_call(void (*handler)(void))
+{
+    host_blocked();
+    raise(SIGSTOP);
+    handler();
+    raise(SIGSTOP);
+    return host_blocked() * 1e6 / HOST_TICKS_PER_S;
+}
+
+// Keeps the last call if it is the worst of the handler so far
+void wcet_keep(const char * class, double blocked_us)
+{
+    wcet_handler_t * h = g_handler;
+    
+    h->n_classes++;
+    if (gb_verbose)
+    {
+        printf("  %-26s %-44s %8lu %10.1f\n", h->name, class, g_trace->instructions, blocked_us);
+    }
+    if (g_trace->instructions > h->worst)
+    {
+        h->worst = g_trace->instructions;
+        snprintf(h->worst_class, N_WCET_CLASS, "%s", class);
+        h->path = *g_trace;
+    }
+    if (blocked_us > h->blocked_us)
+    {
+        h->blocked_us = blocked_us;
+        snprintf(h->blocked_class, N_WCET_CLASS, "%s", class);
+    }
+}
+
+void wcet_measure(const char * class, void (*handler)(void))
+{
+    wcet_keep(class, wcet_call(handler));
+}
+
+//////////////////////////
+// Input classes /////////
+//////////////////////////
+
+// Queues a frame for isr_c1rx on the CAN1 socket
+void wcet_receive(unsigned int32 table_id, unsigned int8 * data, int len)
+{
+    struct can_frame frame;
+    
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = can_bus_node_id(table_id);
+    frame.can_dlc = len;
+    if (len > 0)
+    {
+        memcpy(frame.data, data, len);
+    }
+    if (write(g_rx_socket, &frame, sizeof(frame)) != sizeof(frame))
+    {
+        perror("wcet_receive");
+    }
+}
+
+// Lets a stalled bus send the waiting frames, the buffers return to the pool
+// as isr_can1 returns them
+void wcet_free_buffers(void)
+{
+    host_ecan_bus_free = 0;
+    host_ecan_transmit();
+    can_tx_reclaim();
+}
+
+void wcet_timer1(void)
+{
+    wcet_measure("heartbeat", isr_timer1);
+}
+
+void wcet_timer3(void)
+{
+    wcet_measure("timebase wrap", isr_timer3);
+}
+
+// Names a timer 4 tick after the fact by what it queued
+void wcet_timer4_tick(const char * variant, int tick)
+{
+    char class[N_WCET_CLASS];
+    unsigned long frames = host_ecan_frames;
+    unsigned int8 inflight = can_tx_inflight;
+    double blocked_us;
+    
+    blocked_us = wcet_call(isr_timer4);
+    
+    // Frames on a stalled bus stay in flight
+    frames = host_ecan_frames - frames + __builtin_popcount(can_tx_inflight & ~inflight);
+    snprintf(class, sizeof(class), "%s tick %d: %lu frames%s", variant, tick, frames,
+             (UART_TELEM_DMA4REQ & 0x8000) ? ", uart" : "");
+    wcet_keep(class, blocked_us);
+    
+    // The UART is done with the frame by the next tick
+    UART_TELEM_DMA4REQ &= 0x7FFF;
+    UART_TELEM_DMA4CON &= 0x7FFF;
+}
+
+void wcet_timer4(void)
+{
+    int tick;
+    
+    // A free bus through two telemetry periods, every tick in turn
+    for (tick = 0 ; tick < WCET_TIMER4_TICKS ; tick++)
+    {
+        wcet_timer4_tick("bus free", tick);
+    }
+    
+    // A stalled bus: the buffers run out and the work waits
+    host_ecan_bus_free = ~0ULL;
+    for (tick = 0 ; tick < 16 ; tick++)
+    {
+        wcet_timer4_tick("bus stalled", tick);
+    }
+    
+    // Held on a stalled bus until the SOP limits and the telemetry set are
+    // both waiting, the bus frees up on the tick the UART frame is due
+    for (tick = 0 ; (tick < WCET_TIMER4_TICKS) || !(UART_TELEM_DMA4REQ & 0x8000) ; tick++)
+    {
+        UART_TELEM_DMA4REQ &= 0x7FFF;
+        UART_TELEM_DMA4CON &= 0x7FFF;
+        isr_timer4();
+    }
+    for (tick = 1 ; tick < UART_TELEM_PERIOD_MS ; tick++)
+    {
+        UART_TELEM_DMA4REQ &= 0x7FFF;
+        UART_TELEM_DMA4CON &= 0x7FFF;
+        isr_timer4();
+    }
+    UART_TELEM_DMA4REQ &= 0x7FFF;
+    UART_TELEM_DMA4CON &= 0x7FFF;
+    wcet_free_buffers();
+    wcet_timer4_tick("backlog released", 0);
+}
+
+void wcet_can1(void)
+{
+    wcet_measure("nothing sent", isr_can1);
+    can_tx_free = 0;
+    can_tx_inflight = 0xFF;
+    host_ecan_done = 0xFF;
+    wcet_measure("all buffers sent", isr_can1);
+}
+
+void wcet_c1rx(void)
+{
+    unsigned int8 data[8];
+    unsigned int64 master = timebase_ticks() / TIMEBASE_TICKS_PER_US;
+    int i;
+    
+    data[0] = 1;
+    wcet_receive(TIMESYNC_SYNC_ID, data, 1);
+    wcet_measure("TIMESYNC_SYNC", isr_c1rx);
+    for (i = 7 ; i > 0 ; i--)
+    {
+        data[i] = (unsigned int8)master;
+        master >>= 8;
+    }
+    wcet_receive(TIMESYNC_FOLLOW_UP_ID, data, 8);
+    wcet_measure("TIMESYNC_FOLLOW_UP after its SYNC", isr_c1rx);
+    wcet_receive(TIMESYNC_FOLLOW_UP_ID, data, 8);
+    wcet_measure("TIMESYNC_FOLLOW_UP without SYNC", isr_c1rx);
+    
+    wcet_receive(COMMAND_ENABLE_BALANCING_ID, 0, 0);
+    wcet_measure("COMMAND_ENABLE_BALANCING", isr_c1rx);
+    wcet_receive(COMMAND_CALIBRATION_WRITE_ID, 0, 0);
+    wcet_measure("COMMAND_CALIBRATION_WRITE", isr_c1rx);
+    wcet_receive(RESPONSE_PMS_DISCONNECT_ARRAY_ID, 0, 0);
+    wcet_measure("RESPONSE_PMS_DISCONNECT_ARRAY", isr_c1rx);
+    wcet_receive(PMS_HEARTBEAT_ID, 0, 0);
+    wcet_measure("PMS_HEARTBEAT", isr_c1rx);
+    wcet_receive(COMMAND_EVDC_DRIVE_ID, 0, 0);
+    wcet_measure("COMMAND_EVDC_DRIVE", isr_c1rx);
+    wcet_receive(RESPONSE_MPPT4_ID, 0, 0);
+    wcet_measure("RESPONSE_MPPT4", isr_c1rx);
+    wcet_receive(0x7FF, 0, 0);
+    wcet_measure("unknown ID", isr_c1rx);
+    wcet_measure("no frame", isr_c1rx);
+    
+    // Fill the event queue for a command that is dropped
+    while (event_put(EVENT_BALANCE, 0, 0, 0))
+    {
+    }
+    wcet_receive(COMMAND_ENABLE_BALANCING_ID, 0, 0);
+    wcet_measure("COMMAND_ENABLE_BALANCING on a full queue", isr_c1rx);
+    ignore_events();
+}
+
+void wcet_safety_check(void)
+{
+    unsigned int8 data[BALANCE_COMMAND_LEN] = {0, 0, 0, 0, 1};
+    unsigned int8 piece[8] = {0};
+    
+    wcet_measure("healthy", safety_check_state);
+    
+    // A calibration piece, then the last one that reloads the tables. The
+    // eeprom block is rewritten as it was.
+    eeprom_read_bytes(CAL_ADDRESS, piece + 1, 7);
+    event_put(EVENT_CALIBRATION, piece, 8, timebase_ticks());
+    wcet_measure("calibration piece written", safety_check_state);
+    piece[0] = CAL_BLOCK_LEN - 7;
+    eeprom_read_bytes(CAL_ADDRESS + piece[0], piece + 1, 7);
+    event_put(EVENT_CALIBRATION, piece, 8, timebase_ticks());
+    wcet_measure("calibration block completed", safety_check_state);
+    
+    event_put(EVENT_BALANCE, 0, 0, timebase_ticks());
+    wcet_measure("balancing requested", safety_check_state);
+    while (event_put(EVENT_BALANCE, 0, 0, timebase_ticks()))
+    {
+    }
+    wcet_measure("event queue full", safety_check_state);
+    
+    // A session of an hour down to no spread, one cell at a time
+    data[2] = 0x0E;
+    data[3] = 0x10;
+    event_put(EVENT_BALANCE, data, BALANCE_COMMAND_LEN, timebase_ticks());
+    wcet_measure("balancing session started", safety_check_state);
+    
+    // A fault on its last bad sample trips this call
+    g_pack.fault = PACK_FAULT_OT;
+    g_pack.fault_ticks = 0;
+    g_temperatures.ot_count[PACK_FAULT_CELL] = N_BAD_SAMPLES - 1;
+    wcet_measure("OT trip", safety_check_state);
+    g_pack.fault = PACK_FAULT_OC;
+    g_current.oc_count = N_BAD_SAMPLES - 1;
+    wcet_measure("OC trip", safety_check_state);
+    g_pack.fault = PACK_FAULT_OV;
+    g_cells.ov_count[PACK_FAULT_CELL] = N_BAD_SAMPLES - 1;
+    wcet_measure("OV trip", safety_check_state);
+    g_pack.fault = PACK_FAULT_NONE;
+    main_init();
+}
+
+void wcet_begin_balance(void)
+{
+    int i;
+    
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_cells.average_voltage[i] = 37000;
+    }
+    wcet_measure("cells balanced", begin_balance_state);
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        g_cells.average_voltage[i] = 37000 + 2*BALANCE_THRESHOLD*i;
+    }
+    wcet_measure("cells spread", begin_balance_state);
+    g_balance.target = 0;
+    g_balance.max_bleeders = 1;
+    wcet_measure("cells spread, one bleeder", begin_balance_state);
+    balance_init();
+}
+
+void wcet_balancing(void)
+{
+    int i;
+    
+    wcet_measure("balancing", balancing_state);
+    for (i = 1 ; i < BALANCE_PERIOD_MS ; i++)
+    {
+        balancing_state();
+    }
+    wcet_measure("period over", balancing_state);
+}
+
+void wcet_pms_response_pending(void)
+{
+    int i;
+    
+    wcet_measure("waiting", pms_response_pending_state);
+    event_put(EVENT_PMS_RESPONSE, 0, 0, timebase_ticks());
+    wcet_measure("response", pms_response_pending_state);
+    for (i = 0 ; i < N_EVENTS - 1 ; i++)
+    {
+        event_put(EVENT_BALANCE, 0, 0, timebase_ticks());
+    }
+    event_put(EVENT_PMS_RESPONSE, 0, 0, timebase_ticks());
+    wcet_measure("response behind balancing commands", pms_response_pending_state);
+    for (i = 0 ; i < PMS_RESPONSE_TIMEOUT_MS ; i++)
+    {
+        pms_response_pending_state();
+    }
+    wcet_measure("timeout", pms_response_pending_state);
+}
+
+void wcet_disconnect_pack(void)
+{
+    blackbox_freeze();
+    wcet_measure("black box frozen", disconnect_pack_state);
+}
+
+void wcet_lcd(void)
+{
+    g_host_pin[LCD_SIG] = 0;
+    wcet_measure("LCD absent", update_lcd);
+    g_host_pin[LCD_SIG] = 1;
+    wcet_measure("LCD connected", update_lcd);
+    wcet_measure("LCD stays connected", update_lcd);
+    g_host_pin[LCD_SIG] = 0;
+    wcet_measure("LCD removed", update_lcd);
+}
+
+// Deadlines of the level 4 handlers: timer 4 ticks every millisecond and
+// isr_c1rx must read a frame while its receive capture is still young enough
+// to be used (see timebase_rx_time). A handler on level 4 or above can hold
+// off both, so none may block for longer than the tightest of them, and
+// neither may the handlers on level 4 and above together (the combined check
+// below).
+#define WCET_TIMER4_DEADLINE_US  1000.0
+#define WCET_CAPTURE_DEADLINE_US ((double)TIMEBASE_CAPTURE_MAX_AGE / TIMEBASE_TICKS_PER_US)
+#define WCET_DEADLINE_US         ((WCET_TIMER4_DEADLINE_US < WCET_CAPTURE_DEADLINE_US) ? WCET_TIMER4_DEADLINE_US : WCET_CAPTURE_DEADLINE_US)
+#define WCET_DEADLINE_LEVEL      4
+
+// Instruction budgets hold the current build with room to spare and catch
+// paths that grow, the blocking budgets are the deadline above.
+static wcet_handler_t g_wcet[] =
+{
+    {"isr_timer3",                 6, wcet_timer3,               100,   WCET_DEADLINE_US},
+    {"isr_can1",                   5, wcet_can1,                 100,   WCET_DEADLINE_US},
+    {"isr_timer1",                 4, wcet_timer1,               100,   WCET_DEADLINE_US},
+    {"isr_timer4",                 4, wcet_timer4,               10000, WCET_DEADLINE_US},
+    {"isr_c1rx",                   4, wcet_c1rx,                 1000,  WCET_DEADLINE_US},
+    {"safety_check_state",         0, wcet_safety_check,         0,     -1.0},
+    {"begin_balance_state",        0, wcet_begin_balance,        0,     -1.0},
+    {"balancing_state",            0, wcet_balancing,            0,     -1.0},
+    {"pms_response_pending_state", 0, wcet_pms_response_pending, 0,     -1.0},
+    {"disconnect_pack_state",      0, wcet_disconnect_pack,      0,     -1.0},
+    {"update_lcd",                 0, wcet_lcd,                  0,     -1.0},
+};
+#define N_WCET (sizeof(g_wcet) / sizeof(g_wcet[0]))
+
+//////////////////////////
+// Harness ///////////////
+//////////////////////////
+
+// Brings the firmware up as main() does, with CAN1 on a socket pair
+int wcet_setup(void)
+{
+    int sv[2];
+    int i;
+    
+    if ((socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) || (host_hal_init(0.0) < 0))
+    {
+        perror("wcet_setup");
+        return -1;
+    }
+    g_rx_socket = sv[1];
+    host_ecan_open(sv[0], HOST_CAN_DEFAULT_BITRATE);
+    gb_host_no_wait = true;
+    g_pack.fault = PACK_FAULT_NONE;
+    
+    eeprom_read(g_errors);
+    timebase_init();
+    main_init();
+    ltc6804_init();
+    ads7952_init();
+    hall_sensor_init();
+    eeprom_clear_flags();
+    can_init();
+    for (i = 0 ; i < N_TX_BUFFERS ; i++)
+    {
+        can_enable_b_transfer(i);
+    }
+    uart_telem_init();
+    for (i = 0 ; i < N_VOLTAGE_SAMPLES ; i++)
+    {
+        ltc6804_read_cell_voltages(g_cells.voltage);
+        average_voltage();
+    }
+    for (i = 0 ; i < N_TEMPERATURE_SAMPLES ; i++)
+    {
+        ads7952_read_all_channels(g_temperatures.raw);
+        average_temperature();
+    }
+    for (i = 0 ; i < N_CURRENT_SAMPLES ; i++)
+    {
+        g_current.raw = hall_sensor_read_data();
+        average_current();
+    }
+    return 0;
+}
+
+void wcet_print_path(wcet_handler_t * h)
+{
+    int i;
+    
+    qsort(h->path.function, h->path.n_functions, sizeof(h->path.function[0]), wcet_function_compare);
+    for (i = 0 ; i < h->path.n_functions ; i++)
+    {
+        printf("    %-34s %6lu calls %8lu instructions\n", h->path.function[i].name,
+               h->path.function[i].calls, h->path.function[i].instructions);
+    }
+}
+
+// Drives every handler and reports, returns 1 if a budget is exceeded
+int wcet_run(const char * filter)
+{
+    wcet_handler_t * h;
+    unsigned long level_sum;
+    double level_us;
+    int1 b_failed = false;
+    unsigned int i;
+    int level;
+    
+    if (wcet_setup() < 0)
+    {
+        return 1;
+    }
+    for (i = 0 ; i < N_WCET ; i++)
+    {
+        if (filter && !strstr(g_wcet[i].name, filter))
+        {
+            continue;
+        }
+        g_handler = &g_wcet[i];
+        g_handler->drive();
+    }
+    
+    for (i = 0 ; i < N_WCET ; i++)
+    {
+        h = &g_wcet[i];
+        if (h->n_classes == 0)
+        {
+            continue;
+        }
+        h->b_failed = (h->budget && (h->worst > h->budget)) || ((h->budget_us >= 0.0) && (h->blocked_us > h->budget_us));
+        b_failed |= h->b_failed;
+        printf("%-26s level %d %4d classes %8lu instructions %10.1f us blocked", h->name, h->level,
+               h->n_classes, h->worst, h->blocked_us);
+        if (h->budget || (h->budget_us >= 0.0))
+        {
+            printf("   budget %lu/%.1f us %s", h->budget, h->budget_us, h->b_failed ? "EXCEEDED" : "ok");
+        }
+        printf("\n  worst: %s\n", h->worst_class);
+        if (h->blocked_us > 0.0)
+        {
+            printf("  most blocked: %s\n", h->blocked_class);
+        }
+        wcet_print_path(h);
+    }
+    
+    // Handlers on one level do not preempt each other, one can wait for all
+    // the others on its level to finish
+    for (level = 7 ; level > 0 ; level--)
+    {
+        level_sum = 0;
+        level_us = 0.0;
+        for (i = 0 ; i < N_WCET ; i++)
+        {
+            if ((g_wcet[i].level == level) && g_wcet[i].n_classes)
+            {
+                level_sum += g_wcet[i].worst;
+                level_us += g_wcet[i].blocked_us;
+            }
+        }
+        if (level_sum)
+        {
+            printf("level %d combined worst %8lu instructions %10.1f us blocked\n", level, level_sum, level_us);
+        }
+    }
+    
+    // Everything on the deadline level and above can run between a timer 4
+    // tick or a receive capture and its handler
+    level_us = 0.0;
+    for (i = 0 ; i < N_WCET ; i++)
+    {
+        if (g_wcet[i].level >= WCET_DEADLINE_LEVEL)
+        {
+            level_us += g_wcet[i].blocked_us;
+        }
+    }
+    printf("level %d and above %10.1f us blocked   deadline %.1f us %s\n", WCET_DEADLINE_LEVEL, level_us,
+           WCET_DEADLINE_US, (level_us > WCET_DEADLINE_US) ? "EXCEEDED" : "ok");
+    b_failed |= (level_us > WCET_DEADLINE_US);
+    return b_failed;
+}
+
+// Sets a budget from handler=instructions[,blocking us]
+int wcet_set_budget(const char * arg)
+{
+    const char * equals = strchr(arg, '=');
+    const char * comma;
+    unsigned int i;
+    
+    for (i = 0 ; equals && (i < N_WCET) ; i++)
+    {
+        if ((strlen(g_wcet[i].name) == (size_t)(equals - arg)) && (strncmp(g_wcet[i].name, arg, equals - arg) == 0))
+        {
+            g_wcet[i].budget = strtoul(equals + 1, 0, 0);
+            comma = strchr(equals, ',');
+            if (comma)
+            {
+                g_wcet[i].budget_us = atof(comma + 1);
+            }
+            return 0;
+        }
+    }
+    fprintf(stderr, "bad budget %s\n", arg);
+    return -1;
+}
+
+int main(int argc, char ** argv)
+{
+    const char * filter = 0;
+    pid_t pid;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "b:f:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                if (wcet_set_budget(optarg) < 0)
+                {
+                    return 1;
+                }
+                break;
+            case 'f': filter = optarg; break;
+            case 'v': gb_verbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-b handler=instructions[,blocking us]] [-f handler] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+    
+    g_trace = mmap(0, sizeof(*g_trace), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (g_trace == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0)
+    {
+        ptrace(PTRACE_TRACEME, 0, 0, 0);
+        raise(SIGSTOP);
+        exit(wcet_run(filter));
+    }
+    return wcet_trace(pid);
+}
@@ -0,0 +1,302 @@
+// Calibration fit
+// Fits the per channel gain trims and offsets of final/calibration.c from
+// reference meter logs and writes the eeprom block. Each log line is
+//   cell <n> <BMS reading, 0.1 mV> <meter, V>
+//   temp <n> <BMS reading, ADC code> <reference thermometer, C>
+// with the BMS readings taken before any calibration is programmed. Blank
+// lines and lines starting with # are skipped. A channel logged at two or
+// more distinct readings gets a least squares gain and offset, one logged at
+// a single reading an offset only and one not logged neither.
+// The fit is checked by loading the block into the eeprom model and
+// correcting the logged readings with the firmware's calibration_apply. The
+// worst residual of each channel is reported before and after, cells in
+// 0.1 mV and thermistors in ADC codes.
+// The block file holds CAL_BLOCK_LEN bytes to program at CAL_ADDRESS. calprog
+// writes it into the eeprom of a node over CAN and bms_host -c loads it into
+// its eeprom model.
+// Usage: calfit [-o block file] [-v] log file...
+
+#include <stdlib.h>
+#include <getopt.h>
+#include "host_can.c"
+
+#define main bms_main
+#include "main.c"
+#undef main
+
+#include "bms_devices.c"
+#include "bms_hal.c"
+
+#define N_CAL_CHANNELS (N_CELLS + N_ADC_CHANNELS) // Cells first
+#define N_CAL_POINTS   4096
+
+typedef struct
+{
+    int            channel;
+    unsigned int16 reading;
+    double         reference; // In the units of the reading
+} cal_point_t;
+
+typedef struct
+{
+    int    n;
+    double sx;
+    double sy;
+    double sxx;
+    double sxy;
+    double x_min;
+    double x_max;
+} cal_sums_t;
+
+static cal_point_t g_point[N_CAL_POINTS];
+static int         g_n_points = 0;
+static cal_sums_t  g_sums[N_CAL_CHANNELS];
+
+// ADC code of a thermistor at a temperature, the exact inverse of
+// thermistor_convert_data
+double calfit_thermistor_code(double temp_c)
+{
+    double r = THERMISTOR_NOMINAL * exp(B_COEFF * (1.0 / (temp_c + 273.15) - 1.0 / (TEMPERATURE_NOMINAL + 273.15)));
+    
+    return LSBS_PER_VOLT * THERMISTOR_SUPPLY * r / (r + THERMISTOR_SERIES);
+}
+
+// Reads the points of a log file, returns -1 on an error
+int calfit_read(const char * path)
+{
+    char line[256];
+    char kind[16];
+    int index;
+    unsigned reading;
+    double reference;
+    int n_line = 0;
+    FILE * f = fopen(path, "r");
+    
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        n_line++;
+        if ((line[0] == '#') || (strspn(line, " \t\r\n") == strlen(line)))
+        {
+            continue;
+        }
+        if (g_n_points >= N_CAL_POINTS)
+        {
+            fprintf(stderr, "%s:%d: more than %d points\n", path, n_line, N_CAL_POINTS);
+            fclose(f);
+            return -1;
+        }
+        if ((sscanf(line, "%15s %d %u %lf", kind, &index, &reading, &reference) != 4) || (index < 0))
+        {
+            fprintf(stderr, "%s:%d: expected cell|temp <n> <reading> <reference>\n", path, n_line);
+            fclose(f);
+            return -1;
+        }
+        
+        if ((strcmp(kind, "cell") == 0) && (index < N_CELLS) && (reading <= CAL_CELL_MAX))
+        {
+            g_point[g_n_points].channel = index;
+            g_point[g_n_points].reference = reference * 10000.0;
+        }
+        else if ((strcmp(kind, "temp") == 0) && (index < N_ADC_CHANNELS) && (reading <= CAL_ADC_MAX))
+        {
+            g_point[g_n_points].channel = N_CELLS + index;
+            g_point[g_n_points].reference = calfit_thermistor_code(reference);
+        }
+        else
+        {
+            fprintf(stderr, "%s:%d: no channel %s %d or reading out of range\n", path, n_line, kind, index);
+            fclose(f);
+            return -1;
+        }
+        g_point[g_n_points].reading = reading;
+        g_n_points++;
+    }
+    fclose(f);
+    return 0;
+}
+
+signed int16 calfit_clamp(double x)
+{
+    x = floor(x + 0.5);
+    return (x > 32767.0) ? 32767 : ((x < -32768.0) ? -32768 : (signed int16)x);
+}
+
+// Fits every channel and packs the block
+void calfit_fit(unsigned int8 * block)
+{
+    cal_sums_t * s;
+    signed int16 gain[N_CAL_CHANNELS];
+    signed int16 offset[N_CAL_CHANNELS];
+    double a;
+    double b;
+    unsigned int8 sum = 0;
+    int i;
+    
+    for (i = 0 ; i < g_n_points ; i++)
+    {
+        s = &g_sums[g_point[i].channel];
+        if ((s->n == 0) || (g_point[i].reading < s->x_min))
+        {
+            s->x_min = g_point[i].reading;
+        }
+        if ((s->n == 0) || (g_point[i].reading > s->x_max))
+        {
+            s->x_max = g_point[i].reading;
+        }
+        s->n++;
+        s->sx += g_point[i].reading;
+        s->sy += g_point[i].reference;
+        s->sxx += (double)g_point[i].reading * g_point[i].reading;
+        s->sxy += g_point[i].reading * g_point[i].reference;
+    }
+    
+    for (i = 0 ; i < N_CAL_CHANNELS ; i++)
+    {
+        s = &g_sums[i];
+        a = 1.0;
+        b = 0.0;
+        if ((s->n >= 2) && (s->x_max > s->x_min))
+        {
+            a = (s->n * s->sxy - s->sx * s->sy) / (s->n * s->sxx - s->sx * s->sx);
+            b = (s->sy - a * s->sx) / s->n;
+        }
+        else if (s->n >= 1)
+        {
+            b = (s->sy - s->sx) / s->n;
+        }
+        gain[i] = calfit_clamp((a - 1.0) * 65536.0);
+        offset[i] = calfit_clamp(b);
+    }
+    
+    // Cell gains, cell offsets, thermistor gains, thermistor offsets
+    block[0] = CAL_MARKER;
+    for (i = 0 ; i < N_CELLS ; i++)
+    {
+        block[1 + 2*i] = (unsigned int16)gain[i] >> 8;
+        block[2 + 2*i] = (unsigned int8)gain[i];
+        block[1 + 2*(N_CELLS + i)] = (unsigned int16)offset[i] >> 8;
+        block[2 + 2*(N_CELLS + i)] = (unsigned int8)offset[i];
+    }
+    for (i = 0 ; i < N_ADC_CHANNELS ; i++)
+    {
+        block[1 + 4*N_CELLS + 2*i] = (unsigned int16)gain[N_CELLS + i] >> 8;
+        block[2 + 4*N_CELLS + 2*i] = (unsigned int8)gain[N_CELLS + i];
+        block[1 + 4*N_CELLS + 2*(N_ADC_CHANNELS + i)] = (unsigned int16)offset[N_CELLS + i] >> 8;
+        block[2 + 4*N_CELLS + 2*(N_ADC_CHANNELS + i)] = (unsigned int8)offset[N_CELLS + i];
+    }
+    for (i = 0 ; i < CAL_BLOCK_LEN - 1 ; i++)
+    {
+        sum += block[i];
+    }
+    block[CAL_BLOCK_LEN - 1] = (unsigned int8)(0 - sum);
+}
+
+// Loads the block as the firmware would and corrects every point with it,
+// prints the worst residuals. Returns -1 if the firmware rejects the block.
+int calfit_check(const unsigned int8 * block, int b_verbose)
+{
+    double before[N_CAL_CHANNELS] = {0};
+    double after[N_CAL_CHANNELS] = {0};
+    unsigned int16 x[N_CAL_CHANNELS];
+    double error;
+    int i;
+    int c;
+    
+    memcpy(&g_eeprom_model[CAL_ADDRESS], block, CAL_BLOCK_LEN);
+    calibration_load();
+    if (!g_cal.b_valid)
+    {
+        fprintf(stderr, "the firmware rejects the block\n");
+        return -1;
+    }
+    
+    for (i = 0 ; i < g_n_points ; i++)
+    {
+        // Correct the point as one sweep would
+        c = g_point[i].channel;
+        memset(x, 0, sizeof(x));
+        x[c] = g_point[i].reading;
+        calibration_apply_cells(x);
+        calibration_apply_thermistors(x + N_CELLS);
+        
+        error = fabs(g_point[i].reading - g_point[i].reference);
+        before[c] = (error > before[c]) ? error : before[c];
+        error = fabs(x[c] - g_point[i].reference);
+        after[c] = (error > after[c]) ? error : after[c];
+    }
+    
+    printf("%-8s %6s %10s %8s %12s %12s\n", "Channel", "Points", "Gain ppm", "Offset", "Worst before", "Worst after");
+    printf("---------------------------------------------------------------\n");
+    for (c = 0 ; c < N_CAL_CHANNELS ; c++)
+    {
+        if ((g_sums[c].n == 0) && !b_verbose)
+        {
+            continue;
+        }
+        printf("%-4s %-3d %6d %10.0f %8d %12.1f %12.1f\n", (c < N_CELLS) ? "cell" : "temp",
+               (c < N_CELLS) ? c : c - N_CELLS, g_sums[c].n,
+               ((c < N_CELLS) ? g_cal.cell_gain[c] : g_cal.thermistor_gain[c - N_CELLS]) * 1e6 / 65536.0,
+               (c < N_CELLS) ? g_cal.cell_offset[c] : g_cal.thermistor_offset[c - N_CELLS],
+               before[c], after[c]);
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    unsigned int8 block[CAL_BLOCK_LEN];
+    const char * output = 0;
+    int b_verbose = 0;
+    FILE * f;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "o:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'o': output = optarg; break;
+            case 'v': b_verbose = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-o block file] [-v] log file...\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-o block file] [-v] log file...\n", argv[0]);
+        return 1;
+    }
+    for ( ; optind < argc ; optind++)
+    {
+        if (calfit_read(argv[optind]) < 0)
+        {
+            return 1;
+        }
+    }
+    if (host_hal_init(0.0) < 0)
+    {
+        return 1;
+    }
+    
+    calfit_fit(block);
+    if (calfit_check(block, b_verbose) < 0)
+    {
+        return 1;
+    }
+    
+    if (output)
+    {
+        f = fopen(output, "wb");
+        if (!f || (fwrite(block, 1, CAL_BLOCK_LEN, f) != CAL_BLOCK_LEN) || (fclose(f) != 0))
+        {
+            perror(output);
+            return 1;
+        }
+    }
+    return 0;
+}
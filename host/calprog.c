@@ -0,0 +1,154 @@
+// Calibration programmer
+// Writes a block file from calfit into the eeprom of a BMS node with
+// COMMAND_CALIBRATION_WRITE (see final/calibration.c), a piece of up to 7
+// bytes per command, each sent again until the node answers it. The node
+// reloads its tables once the last byte of the block is written and reports
+// whether the block it read back is valid. The node only takes the commands
+// while all its readings are within the safe range.
+// Exit status 0 if the node reloaded a valid block, 1 otherwise.
+// Usage: calprog [-n BMS node] block file [interface]
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#include <getopt.h>
+#include "host_can.c"
+#include "can_telem.h"
+
+#define CALPROG_MAX_LEN      256 // Eeprom size, bounds any block
+#define CALPROG_PIECE_LEN      7
+#define CALPROG_TIMEOUT_MS   500 // Covers two page writes and a reload
+#define CALPROG_RETRIES        4
+
+static int64_t calprog_now_ms(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Waits for the response to the piece at offset, returns false on timeout
+bool calprog_response(int s, unsigned id, unsigned char offset, struct can_frame * frame)
+{
+    struct pollfd pfd = { .fd = s, .events = POLLIN };
+    int64_t deadline = calprog_now_ms() + CALPROG_TIMEOUT_MS;
+    int64_t left;
+    
+    while ((left = deadline - calprog_now_ms()) > 0)
+    {
+        if (poll(&pfd, 1, (int)left) <= 0)
+        {
+            break;
+        }
+        if (host_can_receive(s, frame) && ((frame->can_id & CAN_SFF_MASK) == id)
+            && (frame->can_dlc >= 3) && (frame->data[0] == offset))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char ** argv)
+{
+    const char * interface = HOST_CAN_DEFAULT_INTERFACE;
+    unsigned char block[CALPROG_MAX_LEN];
+    unsigned char data[8];
+    struct can_frame frame;
+    unsigned offset = 0;
+    size_t len;
+    size_t n;
+    FILE * f;
+    int retry;
+    int opt;
+    int s;
+    
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                if ((atoi(optarg) < 0) || (atoi(optarg) >= N_CAN_NODES))
+                {
+                    fprintf(stderr, "node %s out of range\n", optarg);
+                    return 1;
+                }
+                offset = atoi(optarg) * CAN_NODE_STRIDE;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n node] block file [interface]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-n node] block file [interface]\n", argv[0]);
+        return 1;
+    }
+    f = fopen(argv[optind], "rb");
+    if (!f)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    len = fread(block, 1, sizeof(block), f);
+    fclose(f);
+    if (len == 0)
+    {
+        fprintf(stderr, "%s: empty calibration block\n", argv[optind]);
+        return 1;
+    }
+    if (optind + 1 < argc)
+    {
+        interface = argv[optind + 1];
+    }
+    
+    s = host_can_open(interface);
+    if (s < 0)
+    {
+        return 1;
+    }
+    
+    // Command: offset, then the piece. Response: offset, bytes written,
+    // reloaded valid block.
+    for (data[0] = 0 ; data[0] < len ; data[0] += n)
+    {
+        n = (len - data[0] < CALPROG_PIECE_LEN) ? len - data[0] : CALPROG_PIECE_LEN;
+        memcpy(&data[1], &block[data[0]], n);
+        for (retry = 0 ; retry < CALPROG_RETRIES ; retry++)
+        {
+            if (!host_can_send(s, COMMAND_CALIBRATION_WRITE_ID + offset, data, 1 + n))
+            {
+                perror("COMMAND_CALIBRATION_WRITE");
+            }
+            else if (calprog_response(s, RESPONSE_CALIBRATION_WRITE_ID + offset, data[0], &frame))
+            {
+                break;
+            }
+        }
+        if (retry == CALPROG_RETRIES)
+        {
+            fprintf(stderr, "no response to the piece at %u\n", data[0]);
+            return 1;
+        }
+        if (frame.data[1] != n)
+        {
+            fprintf(stderr, "piece at %u rejected, the block is longer than the node's\n", data[0]);
+            return 1;
+        }
+        if (data[0] + n == len)
+        {
+            break;
+        }
+    }
+    
+    if (!frame.data[2])
+    {
+        fprintf(stderr, "node did not reload a valid block, check the block length and checksum\n");
+        return 1;
+    }
+    printf("%zu bytes written, calibration reloaded\n", len);
+    return 0;
+}
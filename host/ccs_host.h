@@ -0,0 +1,17 @@
+#ifndef CCS_HOST_H
+#define CCS_HOST_H
+
+// Maps the CCS PCD integer types onto the host compiler so firmware modules
+// written in plain C can be built into the host tools.
+// PCD integers are signed unless declared unsigned, build with -fsigned-char
+// so a plain int8 is signed on every host.
+
+#include <stdbool.h>
+
+#define int1  bool
+#define int8  char
+#define int16 short
+#define int32 int
+#define int64 long long
+
+#endif
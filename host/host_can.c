@@ -0,0 +1,82 @@
+#ifndef HOST_CAN_C
+#define HOST_CAN_C
+
+// SocketCAN helpers shared by the host tools
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#define HOST_CAN_DEFAULT_INTERFACE "vcan0"
+#define HOST_CAN_DEFAULT_BITRATE   250000 // BMS ECAN setting, see can_PIC24.h
+
+// Worst case length of a standard data frame on the wire, including stuff
+// bits and the interframe space
+int host_can_frame_bits(int len)
+{
+    return 47 + 8*len + (34 + 8*len - 1) / 4;
+}
+
+// Opens a raw CAN socket bound to the interface, returns -1 on failure
+int host_can_open(const char * interface)
+{
+    struct sockaddr_can addr;
+    struct ifreq ifr;
+    int s;
+    
+    s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    if (s < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
+    if (ioctl(s, SIOCGIFINDEX, &ifr) < 0)
+    {
+        perror(interface);
+        close(s);
+        return -1;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = ifr.ifr_ifindex;
+    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+// Sends a standard frame, returns false on failure
+bool host_can_send(int s, unsigned int id, const unsigned char * data, int len)
+{
+    struct can_frame frame;
+    
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = id;
+    frame.can_dlc = len;
+    if (len > 0)
+    {
+        memcpy(frame.data, data, len);
+    }
+    return write(s, &frame, sizeof(frame)) == sizeof(frame);
+}
+
+// Blocks until a frame is received, returns false on failure
+bool host_can_receive(int s, struct can_frame * frame)
+{
+    return read(s, frame, sizeof(*frame)) == sizeof(*frame);
+}
+
+#endif
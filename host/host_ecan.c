@@ -0,0 +1,364 @@
+#ifndef HOST_ECAN_C
+#define HOST_ECAN_C
+
+// ECAN driver for the host build of the BMS, used by can_bus.c in place of
+// can_PIC24.c. Keeps the same transmit buffer bookkeeping as the CCS library
+// on top of a SocketCAN socket:
+//   - committed buffers go on the bus one at a time, highest priority first
+//     and the highest buffer on a tie, each taking its length in bits at the
+//     bus bit rate
+//   - finished buffers are returned by can_tx_complete() from the CAN1 event
+//     interrupt, so a busy bus runs the buffers out as it does on the car
+//   - receptions carry the kernel receive time in place of the IC2 capture
+//   - the acceptance filters become CAN_RAW_FILTER socket filters
+//   - standard IDs keep only their low 11 bits, sent and received, as the
+//     ECAN header words do
+//   - with gb_host_no_wait set a committed frame is sent and its buffer
+//     returned at once, as if the bus were idle and the CAN1 event interrupt
+//     ran straight away, and it is only counted in host_ecan_frames
+
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include "host_can.c"
+
+#if TELEMETRY_ON_CAN2
+#error "The host build only models CAN1"
+#endif
+
+#define CAN_TX_NONE    0xFF
+#define N_HOST_ECAN_TX 8
+#define TB             0x01 // Transmit buffer interrupt, see can_enable_interrupts
+
+// As in can_PIC24.h
+struct rx_stat
+{
+    uint8_t  filthit;
+    uint8_t  buffer;
+    int1     err_ovfl;
+    int1     rtr;
+    int1     ext;
+    int1     inv;
+    int1     stamped;
+    uint16_t timestamp;
+};
+
+typedef struct
+{
+    uint32_t id;
+    uint8_t  len;
+    uint8_t  priority;
+    uint8_t  data[8];
+} host_ecan_buffer_t;
+
+static int                host_ecan_socket = -1;
+static long               host_ecan_bitrate = HOST_CAN_DEFAULT_BITRATE;
+static host_ecan_buffer_t host_ecan_tx[N_HOST_ECAN_TX];
+static uint8_t            host_ecan_sending = CAN_TX_NONE; // Buffer on the bus
+static uint8_t            host_ecan_done = 0;              // Sent, not yet reclaimed
+static unsigned long long host_ecan_bus_free = 0;          // Host time the bus is idle again
+static unsigned long      host_ecan_frames = 0;            // Sent with gb_host_no_wait
+
+uint8_t can_tx_free = 0;
+uint8_t can_tx_inflight = 0;
+
+// Uses an open SocketCAN socket for CAN1, with receive timestamps
+void host_ecan_open(int s, long bitrate)
+{
+    int on = 1;
+    
+    host_ecan_socket = s;
+    host_ecan_bitrate = bitrate;
+    if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+    {
+        perror("SO_TIMESTAMPNS");
+    }
+}
+
+void can_init(void)
+{
+    can_tx_free = 0;
+    can_tx_inflight = 0;
+    host_ecan_done = 0;
+    host_ecan_sending = CAN_TX_NONE;
+}
+
+// Receives only the given standard IDs, as the ECAN filters do
+void can_set_filters(uint16_t * ids, uint8_t count)
+{
+    struct can_filter filter[16];
+    int i;
+    
+    for (i = 0 ; (i < count) && (i < 16) ; i++)
+    {
+        filter[i].can_id = ids[i];
+        filter[i].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG;
+    }
+    if (setsockopt(host_ecan_socket, SOL_CAN_RAW, CAN_RAW_FILTER, filter, i * sizeof(filter[0])) < 0)
+    {
+        perror("CAN_RAW_FILTER");
+    }
+}
+
+void can_enable_b_transfer(uint8_t port)
+{
+    can_tx_free |= 1 << port;
+}
+
+void can_enable_interrupts(uint8_t flags)
+{
+}
+
+// Puts the next waiting buffer on the bus once the previous frame has ended
+// Called on every interrupt check, see host_service()
+void host_ecan_transmit(void)
+{
+    unsigned long long now = host_ticks();
+    host_ecan_buffer_t * b;
+    struct can_frame frame;
+    uint8_t waiting;
+    int port = -1;
+    int i;
+    
+    if (now < host_ecan_bus_free)
+    {
+        return;
+    }
+    if (host_ecan_sending != CAN_TX_NONE)
+    {
+        host_ecan_done |= 1 << host_ecan_sending;
+        host_ecan_sending = CAN_TX_NONE;
+    }
+    
+    waiting = can_tx_inflight & ~host_ecan_done;
+    for (i = N_HOST_ECAN_TX-1 ; i >= 0 ; i--)
+    {
+        if ((waiting & (1 << i)) && ((port < 0) || (host_ecan_tx[i].priority > host_ecan_tx[port].priority)))
+        {
+            port = i;
+        }
+    }
+    if (port < 0)
+    {
+        return;
+    }
+    
+    if (gb_host_no_wait)
+    {
+        can_tx_inflight &= ~(1 << port);
+        can_tx_free |= 1 << port;
+        host_ecan_frames++;
+        return;
+    }
+    
+    b = &host_ecan_tx[port];
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = b->id;
+    frame.can_dlc = b->len;
+    memcpy(frame.data, b->data, b->len);
+    if (write(host_ecan_socket, &frame, sizeof(frame)) != sizeof(frame))
+    {
+        // Socket queue full, try again on the next check
+        return;
+    }
+    host_ecan_sending = port;
+    host_ecan_bus_free = now + (unsigned long long)host_can_frame_bits(b->len) * HOST_TICKS_PER_S / host_ecan_bitrate;
+}
+
+// Returns the host time of the next transmit event, 0 if nothing is waiting
+unsigned long long host_ecan_next_event(void)
+{
+    if ((host_ecan_sending == CAN_TX_NONE) && !(can_tx_inflight & ~host_ecan_done))
+    {
+        return 0;
+    }
+    return host_ecan_bus_free;
+}
+
+uint8_t can_tx_reclaim(void)
+{
+    can_tx_inflight &= ~host_ecan_done;
+    can_tx_free |= host_ecan_done;
+    host_ecan_done = 0;
+    
+    return can_tx_free;
+}
+
+void can_tx_complete(void)
+{
+    can_tx_reclaim();
+}
+
+uint8_t can_tx_reserve(uint8_t reserve)
+{
+    uint8_t avail;
+    uint8_t port;
+    
+    if (!can_tx_free)
+    {
+        can_tx_reclaim();
+    }
+    
+    // More than reserve buffers must be free
+    avail = can_tx_free;
+    while (reserve && avail)
+    {
+        avail &= avail - 1;
+        reserve--;
+    }
+    if (!avail)
+    {
+        return CAN_TX_NONE;
+    }
+    for (port = 0 ; !(can_tx_free & (1 << port)) ; port++)
+    {
+    }
+    can_tx_free &= ~(1 << port);
+    
+    return port;
+}
+
+#define can_tx_payload(port) (host_ecan_tx[port].data)
+
+void can_load_header(uint16_t port, uint32_t id, uint8_t len, int1 ext, int1 rtr)
+{
+    host_ecan_tx[port].id = (ext ? (id & CAN_EFF_MASK) | CAN_EFF_FLAG : id & CAN_SFF_MASK) | (rtr ? CAN_RTR_FLAG : 0);
+    host_ecan_tx[port].len = len;
+}
+
+void can_tx_commit(uint16_t port, uint32_t id, uint8_t len, uint8_t priority, int1 ext, int1 rtr)
+{
+    can_load_header(port, id, len, ext, rtr);
+    host_ecan_tx[port].priority = priority;
+    can_tx_inflight |= 1 << port;
+    host_ecan_transmit();
+}
+
+void can_tx_cancel(uint16_t port)
+{
+    can_tx_free |= 1 << port;
+}
+
+// Claims the lowest free buffers, at most count of them, leaving reserve free
+uint8_t can_tx_reserve_batch(uint8_t count, uint8_t reserve)
+{
+    uint8_t avail;
+    uint8_t spare;
+    uint8_t bit;
+    uint8_t claimed = 0;
+    
+    avail = can_tx_free;
+    if (!avail)
+    {
+        avail = can_tx_reclaim();
+    }
+    
+    spare = avail;
+    while (reserve && spare)
+    {
+        spare &= spare - 1;
+        reserve--;
+    }
+    while (count && spare)
+    {
+        bit = avail & (uint8_t)(0 - avail);
+        claimed |= bit;
+        avail &= ~bit;
+        spare &= spare - 1;
+        count--;
+    }
+    can_tx_free &= ~claimed;
+    
+    return claimed;
+}
+
+// Requests every buffer in ports, their headers loaded with can_load_header()
+void can_tx_commit_batch(uint8_t ports, uint8_t priority)
+{
+    int i;
+    
+    for (i = 0 ; i < N_HOST_ECAN_TX ; i++)
+    {
+        if (ports & (1 << i))
+        {
+            host_ecan_tx[i].priority = priority;
+        }
+    }
+    can_tx_inflight |= ports;
+    host_ecan_transmit();
+}
+
+int1 can_putd(uint32_t id, uint8_t * data, uint8_t len, uint8_t priority, int1 ext, int1 rtr)
+{
+    uint8_t port = can_tx_reserve(0);
+    
+    if (port == CAN_TX_NONE)
+    {
+        return 0;
+    }
+    if (len > 0)
+    {
+        memcpy(host_ecan_tx[port].data, data, len);
+    }
+    can_tx_commit(port, id, len, priority, ext, rtr);
+    return 1;
+}
+
+// Reads a received frame without blocking, returns false if there is none
+// The capture is timer 2 at the time the kernel received the frame, left out
+// if it is too old to be extended by timebase_rx_time()
+int1 host_ecan_getd(uint32_t * id, uint8_t * data, uint8_t * len, struct rx_stat * stat)
+{
+    struct can_frame frame;
+    struct iovec iov = { .iov_base = &frame, .iov_len = sizeof(frame) };
+    char control[64];
+    struct msghdr msg;
+    struct cmsghdr * cmsg;
+    struct timespec * rx = 0;
+    struct timespec now;
+    unsigned long long age;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(host_ecan_socket, &msg, MSG_DONTWAIT) != sizeof(frame))
+    {
+        return 0;
+    }
+    
+    *id = frame.can_id & ((frame.can_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+    *len = frame.can_dlc;
+    memcpy(data, frame.data, frame.can_dlc);
+    memset(stat, 0, sizeof(*stat));
+    stat->ext = (frame.can_id & CAN_EFF_FLAG) != 0;
+    stat->rtr = (frame.can_id & CAN_RTR_FLAG) != 0;
+    
+    for (cmsg = CMSG_FIRSTHDR(&msg) ; cmsg ; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_TIMESTAMPNS))
+        {
+            rx = (struct timespec *)CMSG_DATA(cmsg);
+        }
+    }
+    if (rx)
+    {
+        clock_gettime(CLOCK_REALTIME, &now);
+        age = ((unsigned long long)(now.tv_sec - rx->tv_sec) * 1000000000ULL + now.tv_nsec - rx->tv_nsec) / 100;
+        host_rx_latency(age);
+        if (age < 0x8000)
+        {
+            stat->stamped = 1;
+            stat->timestamp = (uint16_t)(get_timer23() - age);
+        }
+    }
+    return 1;
+}
+
+// The CCS driver takes its outputs by reference
+#define can_getd(id, data, len, stat) \
+    host_ecan_getd((uint32_t *)&(id), (uint8_t *)(data), (uint8_t *)&(len), &(stat))
+
+#endif
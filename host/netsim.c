@@ -0,0 +1,400 @@
+// CAN network simulator
+// Stands in for the nodes the BMS talks to on a SocketCAN interface:
+//   PMS       answers COMMAND_PMS_DISCONNECT_ARRAY with
+//             RESPONSE_PMS_DISCONNECT_ARRAY and sends PMS_HEARTBEAT every
+//             period until it dies
+//   MPPT 1-4  answer COMMAND_PMS_DISCONNECT_ARRAY with RESPONSE_MPPT1-4 once
+//             they have shut down
+//   motor     sends COMMAND_EVDC_DRIVE every period until the BMS trips
+//   blinker   takes COMMAND_BPS_TRIP_SIGNAL
+//   ground    sends COMMAND_ENABLE_BALANCING every period until the BMS trips,
+//             without payload or with the session given by -T (see
+//             final/balance.c)
+// and fills a share of the bus with background frames. Responses have a
+// latency, a random jitter on top and a drop probability. Events are logged
+// with CLOCK_MONOTONIC stamps so they line up with bms_host. The nodes talk
+// to one BMS node, using its offset IDs where it has them and the shared IDs
+// of the motor controller, blinker and MPPTs as is (see can_telem.h).
+// Usage: netsim [interface] [-p PMS ms] [-P PMS drop %] [-m MPPT ms]
+//               [-M MPPT drop %] [-j jitter ms] [-d motor period ms]
+//               [-l bus load %] [-L load ID] [-b bit rate] [-s seed]
+//               [-n BMS node] [-H PMS heartbeat ms] [-k PMS death s]
+//               [-B balancing command period ms]
+//               [-T target mV/duration s/most bleeders]
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include "host_can.c"
+#include "can_telem.h"
+
+#define NETSIM_MAX_PENDING 16
+#define NETSIM_N_MPPTS      4
+
+typedef struct
+{
+    uint64_t      due;  // ns, 0 if the slot is free
+    unsigned int  id;
+    const char *  node;
+} netsim_pending_t;
+
+typedef struct
+{
+    double   pms_ms;
+    double   pms_drop;
+    double   mppt_ms;
+    double   mppt_drop;
+    double   jitter_ms;
+    double   motor_ms;
+    double   load;
+    unsigned load_id;
+    long     bitrate;
+    unsigned offset; // ID offset of the BMS node
+    double   heartbeat_ms;
+    double   pms_death_s; // 0 for a PMS that never dies
+    double   balance_ms;  // 0 for no balancing commands
+    int      balance_len; // 0 for commands without payload
+    unsigned char balance[5]; // Payload of the balancing commands
+} netsim_config_t;
+
+static const unsigned g_mppt_id[NETSIM_N_MPPTS] =
+{
+    RESPONSE_MPPT1_ID, RESPONSE_MPPT2_ID, RESPONSE_MPPT3_ID, RESPONSE_MPPT4_ID
+};
+static const char * g_mppt_name[NETSIM_N_MPPTS] = {"mppt1", "mppt2", "mppt3", "mppt4"};
+static const unsigned g_misc_id[N_CAN_MISC] = {CAN_MISC_TABLE(EXPAND_AS_MISC_ID_ARRAY)};
+static const int      g_misc_node[N_CAN_MISC] = {CAN_MISC_TABLE(EXPAND_AS_MISC_NODE_ARRAY)};
+
+static netsim_config_t  g_config = {10.0, 0.0, 50.0, 0.0, 0.0, 100.0, 0.0, 0x7FF, HOST_CAN_DEFAULT_BITRATE, 0, 200.0, 0.0, 0.0, 0, {0}};
+static netsim_pending_t g_pending[NETSIM_MAX_PENDING];
+static uint64_t         g_disconnect_ns = 0; // Last disconnect command, 0 once the trip is seen
+static bool             gb_tripped = false;
+static bool             gb_pms_dead = false;
+
+uint64_t netsim_now(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void netsim_log(const char * node, const char * format, ...)
+{
+    uint64_t now = netsim_now();
+    va_list args;
+    
+    printf("%6lu.%06lu %-8s", (unsigned long)(now / 1000000000), (unsigned long)(now % 1000000000 / 1000), node);
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    fflush(stdout);
+}
+
+// Returns true for the IDs every BMS node uses as is
+bool netsim_is_shared(unsigned id)
+{
+    int i;
+    
+    for (i = 0 ; i < N_CAN_MISC ; i++)
+    {
+        if ((g_misc_id[i] == id) && (g_misc_node[i] == CAN_NODE_SHARED))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the ID a table entry has on the bus for the BMS node, as
+// can_bus_node_id does
+unsigned netsim_node_id(unsigned id)
+{
+    return netsim_is_shared(id) ? id : id + g_config.offset;
+}
+
+// Queues a response after the latency plus jitter unless it is dropped
+void netsim_respond(const char * node, unsigned int id, double latency_ms, double drop_pct)
+{
+    double delay_ms = latency_ms + g_config.jitter_ms * drand48();
+    int i;
+    
+    if (drand48() * 100.0 < drop_pct)
+    {
+        netsim_log(node, "drops its response");
+        return;
+    }
+    for (i = 0 ; i < NETSIM_MAX_PENDING ; i++)
+    {
+        if (g_pending[i].due == 0)
+        {
+            g_pending[i].due = netsim_now() + (uint64_t)(delay_ms * 1e6);
+            g_pending[i].id = id;
+            g_pending[i].node = node;
+            return;
+        }
+    }
+    netsim_log(node, "response queue full");
+}
+
+void netsim_receive(const struct can_frame * frame)
+{
+    uint64_t now = netsim_now();
+    int i;
+    
+    switch (netsim_is_shared(frame->can_id) ? frame->can_id : frame->can_id - g_config.offset)
+    {
+        case COMMAND_PMS_DISCONNECT_ARRAY_ID:
+            netsim_log("bms", "COMMAND_PMS_DISCONNECT_ARRAY");
+            g_disconnect_ns = now;
+            if (!gb_pms_dead)
+            {
+                netsim_respond("pms", RESPONSE_PMS_DISCONNECT_ARRAY_ID, g_config.pms_ms, g_config.pms_drop);
+            }
+            for (i = 0 ; i < NETSIM_N_MPPTS ; i++)
+            {
+                netsim_respond(g_mppt_name[i], g_mppt_id[i], g_config.mppt_ms, g_config.mppt_drop);
+            }
+            break;
+        case COMMAND_BPS_TRIP_SIGNAL_ID:
+            if (!gb_tripped)
+            {
+                gb_tripped = true;
+                netsim_log("blinker", "COMMAND_BPS_TRIP_SIGNAL, motor stops");
+            }
+            if (g_disconnect_ns != 0)
+            {
+                netsim_log("blinker", "trip signal %.3f ms after the disconnect command",
+                           (now - g_disconnect_ns) / 1e6);
+                g_disconnect_ns = 0;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Sends the responses that are due, returns the next due time or 0
+uint64_t netsim_send_pending(int s, uint64_t now)
+{
+    uint64_t next = 0;
+    int i;
+    
+    for (i = 0 ; i < NETSIM_MAX_PENDING ; i++)
+    {
+        if (g_pending[i].due == 0)
+        {
+            continue;
+        }
+        if (g_pending[i].due <= now)
+        {
+            host_can_send(s, netsim_node_id(g_pending[i].id), 0, 0);
+            if (g_disconnect_ns != 0)
+            {
+                netsim_log(g_pending[i].node, "responds %.3f ms after the disconnect command",
+                           (now - g_disconnect_ns) / 1e6);
+            }
+            g_pending[i].due = 0;
+        }
+        else if ((next == 0) || (g_pending[i].due < next))
+        {
+            next = g_pending[i].due;
+        }
+    }
+    return next;
+}
+
+uint64_t netsim_earliest(uint64_t a, uint64_t b)
+{
+    if ((a == 0) || ((b != 0) && (b < a)))
+    {
+        return b;
+    }
+    return a;
+}
+
+int main(int argc, char ** argv)
+{
+    const char * interface = HOST_CAN_DEFAULT_INTERFACE;
+    struct can_frame frame;
+    struct pollfd pfd;
+    struct timespec timeout;
+    unsigned char load_data[8];
+    uint64_t now;
+    uint64_t next;
+    uint64_t motor_next = 0;
+    uint64_t load_next = 0;
+    uint64_t load_period = 0;
+    uint64_t heartbeat_next = 0;
+    uint64_t balance_next = 0;
+    uint64_t death = 0;
+    double target_mv;
+    unsigned duration_s;
+    unsigned bleeders;
+    long seed = 1;
+    int opt;
+    int s;
+    int i;
+    
+    while ((opt = getopt(argc, argv, "p:P:m:M:j:d:l:L:b:s:n:H:k:B:T:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p': g_config.pms_ms = atof(optarg); break;
+            case 'P': g_config.pms_drop = atof(optarg); break;
+            case 'm': g_config.mppt_ms = atof(optarg); break;
+            case 'M': g_config.mppt_drop = atof(optarg); break;
+            case 'j': g_config.jitter_ms = atof(optarg); break;
+            case 'd': g_config.motor_ms = atof(optarg); break;
+            case 'l': g_config.load = atof(optarg); break;
+            case 'L': g_config.load_id = strtoul(optarg, 0, 0); break;
+            case 'b': g_config.bitrate = atol(optarg); break;
+            case 's': seed = atol(optarg); break;
+            case 'n':
+                if ((atoi(optarg) < 0) || (atoi(optarg) >= N_CAN_NODES))
+                {
+                    fprintf(stderr, "node %s out of range\n", optarg);
+                    return 1;
+                }
+                g_config.offset = atoi(optarg) * CAN_NODE_STRIDE;
+                break;
+            case 'H': g_config.heartbeat_ms = atof(optarg); break;
+            case 'k': g_config.pms_death_s = atof(optarg); break;
+            case 'B': g_config.balance_ms = atof(optarg); break;
+            case 'T':
+                if ((sscanf(optarg, "%lf/%u/%u", &target_mv, &duration_s, &bleeders) != 3) || (target_mv < 0.0)
+                    || (target_mv > 6553.5) || (duration_s > 0xFFFF) || (bleeders > 0xFF))
+                {
+                    fprintf(stderr, "session %s is not target mV/duration s/most bleeders\n", optarg);
+                    return 1;
+                }
+                g_config.balance[0] = (unsigned)(target_mv * 10.0 + 0.5) >> 8;
+                g_config.balance[1] = (unsigned)(target_mv * 10.0 + 0.5);
+                g_config.balance[2] = duration_s >> 8;
+                g_config.balance[3] = duration_s;
+                g_config.balance[4] = bleeders;
+                g_config.balance_len = 5;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [interface] [-p ms] [-P %%] [-m ms] [-M %%] [-j ms] [-d ms] [-l %%] [-L id] [-b bit/s] [-s seed] [-n node] [-H ms] [-k s] [-B ms] [-T mV/s/n]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc)
+    {
+        interface = argv[optind];
+    }
+    srand48(seed);
+    
+    s = host_can_open(interface);
+    if (s < 0)
+    {
+        return 1;
+    }
+    
+    // Background frames of 8 bytes taking the given share of the bus
+    if (g_config.load > 0.0)
+    {
+        load_period = (uint64_t)(host_can_frame_bits(8) * 1e9 / g_config.bitrate / (g_config.load / 100.0));
+        load_next = netsim_now();
+    }
+    if (g_config.motor_ms > 0.0)
+    {
+        motor_next = netsim_now();
+    }
+    if (g_config.heartbeat_ms > 0.0)
+    {
+        heartbeat_next = netsim_now();
+    }
+    if (g_config.balance_ms > 0.0)
+    {
+        balance_next = netsim_now();
+    }
+    if (g_config.pms_death_s > 0.0)
+    {
+        death = netsim_now() + (uint64_t)(g_config.pms_death_s * 1e9);
+    }
+    netsim_log("netsim", "pms %.1f ms drop %.1f%%, mppt %.1f ms drop %.1f%%, jitter %.1f ms, load %.1f%% on 0x%03X",
+               g_config.pms_ms, g_config.pms_drop, g_config.mppt_ms, g_config.mppt_drop,
+               g_config.jitter_ms, g_config.load, g_config.load_id);
+    
+    while (true)
+    {
+        now = netsim_now();
+        next = netsim_send_pending(s, now);
+        
+        if (motor_next && !gb_tripped)
+        {
+            if (now >= motor_next)
+            {
+                host_can_send(s, netsim_node_id(COMMAND_EVDC_DRIVE_ID), 0, 0);
+                motor_next += (uint64_t)(g_config.motor_ms * 1e6);
+            }
+            next = netsim_earliest(next, motor_next);
+        }
+        
+        if (balance_next && !gb_tripped)
+        {
+            if (now >= balance_next)
+            {
+                host_can_send(s, netsim_node_id(COMMAND_ENABLE_BALANCING_ID), g_config.balance, g_config.balance_len);
+                balance_next += (uint64_t)(g_config.balance_ms * 1e6);
+            }
+            next = netsim_earliest(next, balance_next);
+        }
+        
+        if (death && (now >= death))
+        {
+            netsim_log("pms", "dies");
+            gb_pms_dead = true;
+            death = 0;
+        }
+        next = netsim_earliest(next, death);
+        
+        if (heartbeat_next && !gb_pms_dead)
+        {
+            if (now >= heartbeat_next)
+            {
+                host_can_send(s, netsim_node_id(PMS_HEARTBEAT_ID), 0, 0);
+                heartbeat_next += (uint64_t)(g_config.heartbeat_ms * 1e6);
+            }
+            next = netsim_earliest(next, heartbeat_next);
+        }
+        
+        if (load_next)
+        {
+            while (now >= load_next)
+            {
+                for (i = 0 ; i < 8 ; i++)
+                {
+                    load_data[i] = (unsigned char)lrand48();
+                }
+                host_can_send(s, g_config.load_id, load_data, 8);
+                load_next += load_period;
+            }
+            next = netsim_earliest(next, load_next);
+        }
+        
+        pfd.fd = s;
+        pfd.events = POLLIN;
+        if (next == 0)
+        {
+            poll(&pfd, 1, -1);
+        }
+        else
+        {
+            now = netsim_now();
+            timeout.tv_sec = (next > now) ? (next - now) / 1000000000 : 0;
+            timeout.tv_nsec = (next > now) ? (next - now) % 1000000000 : 0;
+            ppoll(&pfd, 1, &timeout, NULL);
+        }
+        if ((pfd.revents & POLLIN) && host_can_receive(s, &frame))
+        {
+            netsim_receive(&frame);
+        }
+    }
+}
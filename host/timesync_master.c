@@ -0,0 +1,139 @@
+// Time sync master for the ground station
+// Broadcasts SYNC and FOLLOW_UP (see final/timesync.c) every period on a
+// SocketCAN interface. The FOLLOW_UP carries the time the SYNC left the
+// socket, taken from the kernel transmit timestamp when the driver provides
+// one and from the clock right after the write otherwise.
+// Usage: timesync_master [interface] [period ms]
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include "host_can.c"
+#include "can_telem.h"
+
+#define TIMESYNC_DEFAULT_PERIOD_MS 1000
+#define TIMESYNC_TX_TIMEOUT_MS       10 // Wait for the kernel transmit timestamp
+
+static uint64_t timespec_to_us(const struct timespec * ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+// Asks the kernel for software transmit timestamps
+void timesync_enable_tx_timestamps(int s)
+{
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE
+              | SOF_TIMESTAMPING_SOFTWARE
+              | SOF_TIMESTAMPING_OPT_TSONLY;
+    
+    if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    {
+        perror("SO_TIMESTAMPING");
+    }
+}
+
+// Reads the transmit timestamp of the last frame from the error queue
+// Returns false if none arrives in time
+bool timesync_tx_timestamp(int s, uint64_t * us)
+{
+    struct pollfd pfd = { .fd = s, .events = POLLERR };
+    char control[256];
+    struct msghdr msg;
+    struct cmsghdr * cmsg;
+    struct scm_timestamping * tss;
+    
+    if (poll(&pfd, 1, TIMESYNC_TX_TIMEOUT_MS) <= 0)
+    {
+        return false;
+    }
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(s, &msg, MSG_ERRQUEUE) < 0)
+    {
+        return false;
+    }
+    
+    for (cmsg = CMSG_FIRSTHDR(&msg) ; cmsg != NULL ; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPING))
+        {
+            tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+            *us = timespec_to_us(&tss->ts[0]);
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char ** argv)
+{
+    const char * interface = (argc > 1) ? argv[1] : HOST_CAN_DEFAULT_INTERFACE;
+    int period_ms = (argc > 2) ? atoi(argv[2]) : TIMESYNC_DEFAULT_PERIOD_MS;
+    struct timespec now;
+    struct timespec next;
+    unsigned char data[8];
+    unsigned char seq = 0;
+    uint64_t us;
+    bool b_tx_timestamp;
+    int s;
+    int i;
+    
+    s = host_can_open(interface);
+    if (s < 0)
+    {
+        return 1;
+    }
+    timesync_enable_tx_timestamps(s);
+    
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (true)
+    {
+        data[0] = seq;
+        if (!host_can_send(s, TIMESYNC_SYNC_ID, data, 1))
+        {
+            perror("SYNC");
+        }
+        else
+        {
+            clock_gettime(CLOCK_REALTIME, &now);
+            b_tx_timestamp = timesync_tx_timestamp(s, &us);
+            if (!b_tx_timestamp)
+            {
+                us = timespec_to_us(&now);
+            }
+            
+            // FOLLOW_UP: sequence, then the SYNC send time in us, MSB first
+            for (i = 7 ; i >= 1 ; i--)
+            {
+                data[i] = (unsigned char)us;
+                us >>= 8;
+            }
+            if (!host_can_send(s, TIMESYNC_FOLLOW_UP_ID, data, 8))
+            {
+                perror("FOLLOW_UP");
+            }
+            else
+            {
+                // Drop the timestamp of the FOLLOW_UP itself
+                timesync_tx_timestamp(s, &us);
+            }
+            printf("sync %3u %s\n", seq, b_tx_timestamp ? "tx timestamp" : "write time");
+            fflush(stdout);
+        }
+        seq++;
+        
+        next.tv_nsec += (long)period_ms * 1000000;
+        while (next.tv_nsec >= 1000000000)
+        {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+// Time sync node simulator
+// Runs the BMS time sync loop (final/timesync.c) against the master on a
+// SocketCAN interface. The local timebase is simulated from the host clock
+// with a configurable frequency error and start offset, and after every
+// FOLLOW_UP the synchronised clock is compared with the host clock.
+// Usage: timesync_node [interface] [drift ppm] [offset ms]
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "host_can.c"
+#include "can_telem.h"
+#include "ccs_host.h"
+
+#define TIMEBASE_TICKS_PER_US 10
+
+#include "timesync.c"
+
+static struct timespec g_start;
+static double          g_drift_ppm;
+static double          g_offset_ms;
+
+// Simulated BMS timebase, in 0.1 us ticks since the node started
+unsigned int64 node_ticks(void)
+{
+    struct timespec now;
+    double ns;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (double)(now.tv_sec - g_start.tv_sec) * 1e9 + (double)(now.tv_nsec - g_start.tv_nsec);
+    return (unsigned int64)((ns * (1.0 + g_drift_ppm * 1e-6) + g_offset_ms * 1e6) / 100.0);
+}
+
+int64_t realtime_us(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int main(int argc, char ** argv)
+{
+    const char * interface = (argc > 1) ? argv[1] : HOST_CAN_DEFAULT_INTERFACE;
+    struct can_frame frame;
+    unsigned int64 rx_time;
+    int64_t error_us;
+    int s;
+    
+    g_drift_ppm = (argc > 2) ? atof(argv[2]) : 50.0;
+    g_offset_ms = (argc > 3) ? atof(argv[3]) : 1000.0;
+    
+    s = host_can_open(interface);
+    if (s < 0)
+    {
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &g_start);
+    
+    while (host_can_receive(s, &frame))
+    {
+        rx_time = node_ticks();
+        switch (frame.can_id)
+        {
+            case TIMESYNC_SYNC_ID:
+                timesync_sync((int8 *)frame.data, rx_time);
+                break;
+            case TIMESYNC_FOLLOW_UP_ID:
+                timesync_follow_up((int8 *)frame.data);
+                error_us = (int64_t)(timesync_from_local(node_ticks()) / TIMEBASE_TICKS_PER_US) - realtime_us();
+                printf("seq %3u error %8lld us rate %+9.3f ppm %s\n",
+                       frame.data[0],
+                       (long long)error_us,
+                       g_timesync.rate * 1e6 / (double)(1L << TIMESYNC_RATE_SHIFT),
+                       timesync_locked() ? "locked" : "");
+                fflush(stdout);
+                break;
+            default:
+                break;
+        }
+    }
+    perror("read");
+    return 1;
+}